@@ -0,0 +1,2820 @@
+/*
+ * Copyright (C) 2016 Daewoong Jang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "Acceptor.h"
+#include "CompletionPort.h"
+#include "NonblockIoHandle.h"
+#include "Statistics.h"
+#include "BufferPool.h"
+#include "CompletionStatusPool.h"
+#include "DatagramHandle.h"
+#include "Framing.h"
+#include "MemoryPipe.h"
+#include "PortGroup.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <random>
+#include <vector>
+
+int WSASocketPair(int domain, int type, int protocol, SOCKET socket_vector[2]);
+
+// Heap allocations, counted while a scenario that reports them per operation has asked for it.
+static std::atomic<ULONGLONG> s_allocations;
+static bool s_countAllocations;
+
+void* operator new(size_t size)
+{
+    if (s_countAllocations)
+        ++s_allocations;
+
+    void* memory = malloc(size ? size : 1);
+    if (!memory)
+        throw std::bad_alloc();
+    return memory;
+}
+
+void operator delete(void* memory) throw()
+{
+    free(memory);
+}
+
+// Handlers run inline when an operation completes right away. Past a few levels the continuation is bounced
+// through the port, so a fast loopback connection can't exhaust the stack.
+static __declspec(thread) unsigned s_nesting;
+static const unsigned kMaxNesting = 16;
+
+template<typename Function>
+static void continueWith(CompletionPort& port, Function function)
+{
+    if (s_nesting >= kMaxNesting) {
+        port.post(function);
+        return;
+    }
+
+    ++s_nesting;
+    function();
+    --s_nesting;
+}
+
+// Tracks the peers of a run: how many still have work in progress, and how many handles are still open.
+class Run : public NonblockIoHandle::Client {
+public:
+    Run(unsigned peers, unsigned handles)
+        : m_idle(CreateEvent(NULL, TRUE, FALSE, NULL))
+        , m_closed(CreateEvent(NULL, TRUE, FALSE, NULL))
+        , m_active(peers)
+        , m_open(handles)
+        , m_stopping(false)
+    {
+    }
+    ~Run()
+    {
+        CloseHandle(m_idle);
+        CloseHandle(m_closed);
+    }
+
+    void handleDidClose(NonblockIoHandle*)
+    {
+        if (!--m_open)
+            SetEvent(m_closed);
+    }
+    void handleDidRead(NonblockIoHandle*, size_t)
+    {
+    }
+    void handleDidWrite(NonblockIoHandle*, size_t)
+    {
+    }
+
+    bool stopping() const { return m_stopping; }
+    void stop() { m_stopping = true; }
+
+    void didFinish()
+    {
+        if (!--m_active)
+            SetEvent(m_idle);
+    }
+
+    void waitUntilIdle() { WaitForSingleObject(m_idle, INFINITE); }
+    void waitUntilClosed() { WaitForSingleObject(m_closed, INFINITE); }
+
+private:
+    HANDLE m_idle;
+    HANDLE m_closed;
+    std::atomic<unsigned> m_active;
+    std::atomic<unsigned> m_open;
+    std::atomic<bool> m_stopping;
+};
+
+// Every peer has at most one operation outstanding, so its counters are only touched by one thread at a time.
+// A peer made with |callbacks| starts its operations without a handler and hears about them through the client
+// interface instead.
+class Peer : public NonblockIoHandle::CompletionHandler {
+public:
+    Peer(Run& run, std::shared_ptr<CompletionPort> port, SOCKET socket, size_t bufferSize, bool callbacks = false)
+        : m_run(run)
+        , m_port(port)
+        , m_callbacks(*this)
+        , m_handle(NonblockIoHandle::create(socket, port, callbacks ? static_cast<NonblockIoHandle::Client*>(&m_callbacks) : &run))
+        , m_handler(callbacks ? nullptr : this)
+        , m_buffer(bufferSize, 'x')
+        , m_operations(0)
+        , m_bytes(0)
+        , m_finished(false)
+    {
+    }
+    virtual ~Peer() { }
+
+    virtual void start() = 0;
+
+    virtual void close() { m_handle->close(); }
+
+    void setPriority(CompletionKey::Priority priority) { m_handle->setPriority(priority); }
+
+    ULONGLONG operations() const { return m_operations; }
+    ULONGLONG bytes() const { return m_bytes; }
+    const Histogram& latency() const { return m_latency; }
+
+protected:
+    // Starting an operation that fails right away never calls back, so the peer is done.
+    void issue(std::pair<NonblockIoHandle::ErrorCode, size_t> result)
+    {
+        if (result.first > NonblockIoHandle::Pending)
+            finish();
+    }
+
+    void finish()
+    {
+        if (!m_finished.exchange(true))
+            m_run.didFinish();
+    }
+
+    // Passes the client interface on to handleCompletion(). Operations aborted by closing aren't reported to it, so
+    // the close finishes a peer that was still waiting for one.
+    class Callbacks final : public NonblockIoHandle::Client {
+    public:
+        explicit Callbacks(Peer& peer)
+            : m_peer(peer)
+        {
+        }
+
+        void handleDidClose(NonblockIoHandle* handle) override
+        {
+            m_peer.finish();
+            m_peer.m_run.handleDidClose(handle);
+        }
+        void handleDidRead(NonblockIoHandle* handle, size_t size) override
+        {
+            m_peer.handleCompletion(handle, NonblockIoHandle::Complete, size);
+        }
+        void handleDidWrite(NonblockIoHandle* handle, size_t size) override
+        {
+            m_peer.handleCompletion(handle, NonblockIoHandle::Complete, size);
+        }
+
+    private:
+        Peer& m_peer;
+    };
+
+    Run& m_run;
+    std::shared_ptr<CompletionPort> m_port;
+    Callbacks m_callbacks;
+    std::shared_ptr<NonblockIoHandle> m_handle;
+    NonblockIoHandle::CompletionHandler* m_handler;
+    std::vector<char> m_buffer;
+    ULONGLONG m_operations;
+    ULONGLONG m_bytes;
+    Histogram m_latency;
+    std::atomic<bool> m_finished;
+};
+
+// Reads whatever arrives and, when echoing, writes it straight back. Stops at end of stream.
+class Server final : public Peer {
+public:
+    Server(Run& run, std::shared_ptr<CompletionPort> port, SOCKET socket, size_t bufferSize, bool echo, bool callbacks = false)
+        : Peer(run, port, socket, bufferSize, callbacks)
+        , m_echo(echo)
+        , m_writing(false)
+    {
+    }
+
+    void start() override { read(); }
+
+    void handleCompletion(NonblockIoHandle*, NonblockIoHandle::ErrorCode error, size_t size) override
+    {
+        if (error != NonblockIoHandle::Complete || !size) {
+            finish();
+            return;
+        }
+
+        if (m_writing || !m_echo) {
+            m_bytes += size;
+            ++m_operations;
+            continueWith(*m_port, [this] { read(); });
+            return;
+        }
+
+        m_writing = true;
+        issue(m_handle->write(&m_buffer[0], size, m_handler));
+    }
+
+private:
+    void read()
+    {
+        m_writing = false;
+        issue(m_handle->read(&m_buffer[0], m_buffer.size(), m_handler));
+    }
+
+    bool m_echo;
+    bool m_writing;
+};
+
+// Sends a message and, when the server echoes, waits for all of it to come back before sending the next one.
+// The latency histogram holds round trips, or write completions when nothing is echoed.
+class Client final : public Peer {
+public:
+    Client(Run& run, std::shared_ptr<CompletionPort> port, SOCKET socket, size_t messageSize, bool echo, bool callbacks = false)
+        : Peer(run, port, socket, messageSize, callbacks)
+        , m_echo(echo)
+        , m_reading(false)
+        , m_received(0)
+        , m_sendTime(0)
+    {
+    }
+
+    void start() override { send(); }
+
+    void handleCompletion(NonblockIoHandle*, NonblockIoHandle::ErrorCode error, size_t size) override
+    {
+        if (error != NonblockIoHandle::Complete || !size) {
+            finish();
+            return;
+        }
+
+        if (m_echo && !m_reading) {
+            m_reading = true;
+            m_received = 0;
+            issue(m_handle->read(&m_buffer[0], m_buffer.size(), m_handler));
+            return;
+        }
+
+        m_received += size;
+        if (m_echo && m_received < m_buffer.size()) {
+            issue(m_handle->read(&m_buffer[m_received], m_buffer.size() - m_received, m_handler));
+            return;
+        }
+
+        m_latency.record(ticksToMicroseconds(currentTicks() - m_sendTime));
+        m_bytes += m_buffer.size();
+        ++m_operations;
+
+        if (m_run.stopping()) {
+            finish();
+            return;
+        }
+
+        continueWith(*m_port, [this] { send(); });
+    }
+
+private:
+    void send()
+    {
+        m_reading = false;
+        m_received = 0;
+        m_sendTime = currentTicks();
+        issue(m_handle->write(&m_buffer[0], m_buffer.size(), m_handler));
+    }
+
+    bool m_echo;
+    bool m_reading;
+    size_t m_received;
+    LONGLONG m_sendTime;
+};
+
+struct Options {
+    const _TCHAR* scenario;
+    size_t messageSize;
+    unsigned connections;
+    unsigned threads;
+    unsigned seconds;
+    unsigned fileSize;
+    bool unbuffered;
+    bool json;
+    const _TCHAR* output;
+    const _TCHAR* wait;
+    unsigned spinMicroseconds;
+    unsigned seed;
+    unsigned fair;
+};
+
+struct Result {
+    Result()
+        : seconds(0)
+        , cpuSeconds(0)
+        , operations(0)
+        , bytes(0)
+    {
+    }
+
+    double seconds;
+    double cpuSeconds;
+    ULONGLONG operations;
+    ULONGLONG bytes;
+    Histogram latency;
+};
+
+template<typename Target>
+static void setWaitPolicy(const Options& options, Target& target)
+{
+    if (!_tcscmp(options.wait, _T("spin")))
+        target.setWaitPolicy(CompletionPort::SpinThenBlock, options.spinMicroseconds);
+    else if (!_tcscmp(options.wait, _T("busy")))
+        target.setWaitPolicy(CompletionPort::BusyPoll);
+}
+
+static std::shared_ptr<CompletionPort> createPort(const Options& options)
+{
+    std::shared_ptr<CompletionPort> port = CompletionPort::create(options.threads);
+    setWaitPolicy(options, *port);
+    if (options.fair)
+        port->setFairDispatch(options.fair);
+    return port;
+}
+
+// A port per core on the first -threads processors the process may run on.
+static std::shared_ptr<PortGroup> createGroup(const Options& options)
+{
+    DWORD_PTR processAffinityMask;
+    DWORD_PTR systemAffinityMask;
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &processAffinityMask, &systemAffinityMask))
+        return nullptr;
+
+    DWORD_PTR affinityMask = 0;
+    unsigned processors = 0;
+    for (DWORD_PTR mask = processAffinityMask; mask && processors < options.threads; mask &= mask - 1, ++processors)
+        affinityMask |= mask & ~(mask - 1);
+
+    std::shared_ptr<PortGroup> group = PortGroup::create(affinityMask);
+    if (group)
+        setWaitPolicy(options, *group);
+    return group;
+}
+
+// Connects |connections| client/server pairs over loopback, lets them run for the configured time and tears
+// them down once every peer has stopped. Clients may own |extraHandles| more handles each, which they close
+// along with their socket. Servers and clients get a port each, unless there's a |group|, which puts both ends of a
+// connection on the least loaded of its ports.
+// A |makeServer| replaces the plain servers.
+typedef std::function<Peer*(Run&, std::shared_ptr<CompletionPort>, SOCKET)> ClientFactory;
+typedef ClientFactory ServerFactory;
+
+static bool runConnections(const Options& options, bool echo, ClientFactory makeClient, unsigned extraHandles, Result& result, std::shared_ptr<PortGroup> group = nullptr, ServerFactory makeServer = nullptr)
+{
+    std::vector<SOCKET> sockets;
+    for (unsigned i = 0; i < options.connections; ++i) {
+        SOCKET sv[2];
+        if (WSASocketPair(AF_INET, SOCK_STREAM, IPPROTO_TCP, sv) == SOCKET_ERROR) {
+            fprintf(stderr, "Couldn't create connection %u: %d\n", i, WSAGetLastError());
+            for (size_t j = 0; j < sockets.size(); ++j)
+                closesocket(sockets[j]);
+            return false;
+        }
+
+        sockets.push_back(sv[0]);
+        sockets.push_back(sv[1]);
+    }
+
+    std::shared_ptr<CompletionPort> serverPort = group ? nullptr : createPort(options);
+    std::shared_ptr<CompletionPort> clientPort = group ? nullptr : createPort(options);
+
+    std::vector<std::unique_ptr<Peer>> servers;
+    std::vector<std::unique_ptr<Peer>> clients;
+    Run run(options.connections * 2, options.connections * (2 + extraHandles));
+
+    for (unsigned i = 0; i < options.connections; ++i) {
+        if (group)
+            serverPort = clientPort = group->port(group->select(PortGroup::LeastLoaded));
+        if (makeServer)
+            servers.push_back(std::unique_ptr<Peer>(makeServer(run, serverPort, sockets[i * 2])));
+        else
+            servers.push_back(std::unique_ptr<Peer>(new Server(run, serverPort, sockets[i * 2], options.messageSize, echo)));
+        clients.push_back(std::unique_ptr<Peer>(makeClient(run, clientPort, sockets[i * 2 + 1])));
+    }
+
+    for (unsigned i = 0; i < options.connections; ++i)
+        servers[i]->start();
+
+    LONGLONG startTime = currentTicks();
+    for (unsigned i = 0; i < options.connections; ++i)
+        clients[i]->start();
+
+    Sleep(options.seconds * 1000);
+    run.stop();
+    result.seconds = ticksToMicroseconds(currentTicks() - startTime) / 1e6;
+
+    // Servers see the end of stream once their client has gone away.
+    for (unsigned i = 0; i < options.connections; ++i)
+        clients[i]->close();
+    run.waitUntilIdle();
+
+    for (unsigned i = 0; i < options.connections; ++i)
+        servers[i]->close();
+    run.waitUntilClosed();
+
+    for (unsigned i = 0; i < options.connections; ++i) {
+        result.operations += clients[i]->operations();
+        result.bytes += (echo ? clients[i] : servers[i])->bytes();
+        result.latency.merge(clients[i]->latency());
+    }
+
+    if (group)
+        group->terminate();
+    else {
+        serverPort->terminate();
+        clientPort->terminate();
+    }
+    return true;
+}
+
+// A plain pool of threads taking work from one locked queue, the usual alternative to running it on the port.
+class WorkerPool final {
+public:
+    explicit WorkerPool(unsigned numberOfThreads)
+        : m_stopping(false)
+    {
+        for (unsigned i = 0; i < numberOfThreads; ++i)
+            m_threads.push_back(std::thread([this] { threadMain(); }));
+    }
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_stopping = true;
+        }
+        m_wakeup.notify_all();
+        for (size_t i = 0; i < m_threads.size(); ++i)
+            m_threads[i].join();
+    }
+
+    void post(CompletionPort::Task task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_tasks.push_back(task);
+        }
+        m_wakeup.notify_one();
+    }
+
+private:
+    void threadMain()
+    {
+        for (;;) {
+            CompletionPort::Task task;
+            {
+                std::unique_lock<std::mutex> lock(m_lock);
+                m_wakeup.wait(lock, [this] { return m_stopping || !m_tasks.empty(); });
+                if (m_tasks.empty())
+                    return;
+                task = m_tasks.front();
+                m_tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::mutex m_lock;
+    std::condition_variable m_wakeup;
+    std::deque<CompletionPort::Task> m_tasks;
+    std::vector<std::thread> m_threads;
+    bool m_stopping;
+};
+
+// Echoes like Server, but spends |workMicroseconds| of processor time on every read before writing it back, either
+// in a task posted to its port or on a separate worker pool.
+class WorkServer final : public Peer {
+public:
+    WorkServer(Run& run, std::shared_ptr<CompletionPort> port, SOCKET socket, size_t bufferSize, unsigned workMicroseconds, WorkerPool* pool)
+        : Peer(run, port, socket, bufferSize)
+        , m_workTicks(microsecondsToTicks(workMicroseconds))
+        , m_pool(pool)
+        , m_writing(false)
+    {
+    }
+
+    void start() override { read(); }
+
+    void handleCompletion(NonblockIoHandle*, NonblockIoHandle::ErrorCode error, size_t size) override
+    {
+        if (error != NonblockIoHandle::Complete || !size) {
+            m_run.didFinish();
+            return;
+        }
+
+        if (m_writing) {
+            m_bytes += size;
+            ++m_operations;
+            continueWith(*m_port, [this] { read(); });
+            return;
+        }
+
+        CompletionPort::Task task = [this, size] {
+            LONGLONG end = currentTicks() + m_workTicks;
+            while (currentTicks() < end) { }
+
+            m_writing = true;
+            issue(m_handle->write(&m_buffer[0], size, this));
+        };
+        if (m_pool)
+            m_pool->post(task);
+        else
+            m_port->post(task);
+    }
+
+private:
+    void read()
+    {
+        m_writing = false;
+        issue(m_handle->read(&m_buffer[0], m_buffer.size(), this));
+    }
+
+    LONGLONG m_workTicks;
+    WorkerPool* m_pool;
+    bool m_writing;
+};
+
+// Ping-pong over -connections connections whose server does 50 microseconds of work per request, either as a task on
+// the port's own -threads workers or handed off to a separate pool of -threads threads. Latency is the round trip.
+static bool runTasks(const Options& options, bool separatePool, Result& result)
+{
+    static const unsigned kWorkMicroseconds = 50;
+
+    std::unique_ptr<WorkerPool> pool(separatePool ? new WorkerPool(options.threads) : nullptr);
+    WorkerPool* workers = pool.get();
+    size_t messageSize = options.messageSize;
+    ClientFactory makeClient = [=](Run& run, std::shared_ptr<CompletionPort> port, SOCKET socket) -> Peer* {
+        return new Client(run, port, socket, messageSize, true);
+    };
+    ServerFactory makeServer = [=](Run& run, std::shared_ptr<CompletionPort> port, SOCKET socket) -> Peer* {
+        return new WorkServer(run, port, socket, messageSize, kWorkMicroseconds, workers);
+    };
+    return runConnections(options, true, makeClient, 0, result, nullptr, makeServer);
+}
+
+// Ping-pong over -connections connections with every operation reported to a handler passed along with it, or with
+// |callbacks| to the client interface of the handle, and the heap allocations counted over the whole run. Setting up
+// and tearing down the connections is included, which the length of the run spreads thin.
+static bool runCompletionStyle(const Options& options, bool callbacks, Result& result)
+{
+    size_t messageSize = options.messageSize;
+    ClientFactory makeClient = [=](Run& run, std::shared_ptr<CompletionPort> port, SOCKET socket) -> Peer* {
+        return new Client(run, port, socket, messageSize, true, callbacks);
+    };
+    ServerFactory makeServer = [=](Run& run, std::shared_ptr<CompletionPort> port, SOCKET socket) -> Peer* {
+        return new Server(run, port, socket, messageSize, true, callbacks);
+    };
+
+    s_allocations = 0;
+    s_countAllocations = true;
+    bool succeeded = runConnections(options, true, makeClient, 0, result, nullptr, makeServer);
+    s_countAllocations = false;
+    if (!succeeded)
+        return false;
+
+    fprintf(stderr, "%llu allocations, %.3f per round trip\n", static_cast<ULONGLONG>(s_allocations),
+        result.operations ? static_cast<double>(s_allocations) / result.operations : 0);
+    return true;
+}
+
+// Keeps a deep pipeline of stream reads in flight and throws the data away, so that its completions come in bursts.
+class BulkSink final : public NonblockIoHandle::Client {
+public:
+    BulkSink(Run& run, std::shared_ptr<CompletionPort> port, SOCKET socket)
+        : m_run(run)
+        , m_handle(NonblockIoHandle::create(socket, port, this))
+        , m_bytes(0)
+    {
+        m_handle->setPriority(CompletionKey::Bulk);
+    }
+
+    void start(std::shared_ptr<BufferPool> pool, unsigned depth)
+    {
+        if (!m_handle->startReading(pool, depth))
+            m_run.didFinish();
+    }
+
+    void close() { m_handle->close(); }
+
+    void handleDidClose(NonblockIoHandle* handle) override
+    {
+        m_run.handleDidClose(handle);
+    }
+    void handleDidRead(NonblockIoHandle*, size_t) override
+    {
+        // Only the end of the stream is reported here.
+        m_run.didFinish();
+    }
+    void handleDidWrite(NonblockIoHandle*, size_t) override
+    {
+    }
+    void handleDidReadBuffer(NonblockIoHandle*, PooledBuffer* buffer, size_t size) override
+    {
+        m_bytes += size;
+        buffer->pool->release(buffer);
+    }
+
+    ULONGLONG bytes() const { return m_bytes; }
+
+private:
+    Run& m_run;
+    std::shared_ptr<NonblockIoHandle> m_handle;
+    ULONGLONG m_bytes;
+};
+
+// Ping-pong over -connections interactive connections whose servers share a port with four bulk connections, each
+// streaming 64KB writes into 32 outstanding reads. Latency is the interactive round trip; compare -fair 0 with, say,
+// -fair 4 to see what fair dispatch does to its tail while the bulk reads flood the port.
+static bool runMixed(const Options& options, Result& result)
+{
+    static const unsigned kBulkConnections = 4;
+    static const unsigned kBulkDepth = 32;
+    static const size_t kBulkWriteSize = 64 * 1024;
+
+    unsigned connections = options.connections + kBulkConnections;
+    std::vector<SOCKET> sockets;
+    for (unsigned i = 0; i < connections; ++i) {
+        SOCKET sv[2];
+        if (WSASocketPair(AF_INET, SOCK_STREAM, IPPROTO_TCP, sv) == SOCKET_ERROR) {
+            fprintf(stderr, "Couldn't create connection %u: %d\n", i, WSAGetLastError());
+            for (size_t j = 0; j < sockets.size(); ++j)
+                closesocket(sockets[j]);
+            return false;
+        }
+
+        sockets.push_back(sv[0]);
+        sockets.push_back(sv[1]);
+    }
+
+    std::shared_ptr<CompletionPort> serverPort = createPort(options);
+    std::shared_ptr<CompletionPort> clientPort = createPort(options);
+    std::shared_ptr<BufferPool> pool = BufferPool::create(kBulkWriteSize, kBulkConnections * kBulkDepth * 2);
+    Run run(connections * 2, connections * 2);
+
+    std::vector<std::unique_ptr<Peer>> servers;
+    std::vector<std::unique_ptr<Peer>> clients;
+    std::vector<std::unique_ptr<BulkSink>> sinks;
+    for (unsigned i = 0; i < options.connections; ++i) {
+        servers.push_back(std::unique_ptr<Peer>(new Server(run, serverPort, sockets[i * 2], options.messageSize, true)));
+        clients.push_back(std::unique_ptr<Peer>(new Client(run, clientPort, sockets[i * 2 + 1], options.messageSize, true)));
+    }
+    for (unsigned i = options.connections; i < connections; ++i) {
+        sinks.push_back(std::unique_ptr<BulkSink>(new BulkSink(run, serverPort, sockets[i * 2])));
+        clients.push_back(std::unique_ptr<Peer>(new Client(run, clientPort, sockets[i * 2 + 1], kBulkWriteSize, false)));
+        clients.back()->setPriority(CompletionKey::Bulk);
+    }
+
+    for (size_t i = 0; i < servers.size(); ++i)
+        servers[i]->start();
+    for (size_t i = 0; i < sinks.size(); ++i)
+        sinks[i]->start(pool, kBulkDepth);
+
+    LONGLONG startTime = currentTicks();
+    for (size_t i = 0; i < clients.size(); ++i)
+        clients[i]->start();
+
+    Sleep(options.seconds * 1000);
+    run.stop();
+    result.seconds = ticksToMicroseconds(currentTicks() - startTime) / 1e6;
+
+    for (size_t i = 0; i < clients.size(); ++i)
+        clients[i]->close();
+    run.waitUntilIdle();
+
+    for (size_t i = 0; i < servers.size(); ++i)
+        servers[i]->close();
+    for (size_t i = 0; i < sinks.size(); ++i)
+        sinks[i]->close();
+    run.waitUntilClosed();
+
+    ULONGLONG bulkBytes = 0;
+    for (size_t i = 0; i < sinks.size(); ++i)
+        bulkBytes += sinks[i]->bytes();
+    for (unsigned i = 0; i < options.connections; ++i) {
+        result.operations += clients[i]->operations();
+        result.bytes += clients[i]->bytes();
+        result.latency.merge(clients[i]->latency());
+    }
+    fprintf(stderr, "Bulk connections moved %.1f MB/s\n", result.seconds > 0 ? bulkBytes / result.seconds / (1024 * 1024) : 0);
+
+    serverPort->terminate();
+    clientPort->terminate();
+    return true;
+}
+
+// Streams 64KB writes over one connection into a reader that keeps -connections receives outstanding through
+// startReading(). Throughput is what the reader received; operations and latency are the writes. Run it at depths 1,
+// 2, 4 and 8 to see how far more receives in flight carry a single connection.
+static bool runStreamRead(const Options& options, Result& result)
+{
+    static const size_t kWriteSize = 64 * 1024;
+
+    SOCKET sv[2];
+    if (WSASocketPair(AF_INET, SOCK_STREAM, IPPROTO_TCP, sv) == SOCKET_ERROR) {
+        fprintf(stderr, "Couldn't create the connection: %d\n", WSAGetLastError());
+        return false;
+    }
+
+    std::shared_ptr<CompletionPort> readerPort = createPort(options);
+    std::shared_ptr<CompletionPort> writerPort = createPort(options);
+    std::shared_ptr<BufferPool> pool = BufferPool::create(kWriteSize, options.connections * 2);
+    Run run(2, 2);
+    BulkSink sink(run, readerPort, sv[0]);
+    Client writer(run, writerPort, sv[1], kWriteSize, false);
+
+    sink.start(pool, options.connections);
+    LONGLONG startTime = currentTicks();
+    writer.start();
+
+    Sleep(options.seconds * 1000);
+    run.stop();
+    result.seconds = ticksToMicroseconds(currentTicks() - startTime) / 1e6;
+
+    writer.close();
+    run.waitUntilIdle();
+    sink.close();
+    run.waitUntilClosed();
+
+    result.operations = writer.operations();
+    result.bytes = sink.bytes();
+    result.latency = writer.latency();
+
+    readerPort->terminate();
+    writerPort->terminate();
+    return true;
+}
+
+class ExchangeEvent final : public NonblockIoHandle::CompletionHandler {
+public:
+    ExchangeEvent()
+        : m_event(CreateEvent(NULL, TRUE, FALSE, NULL))
+    {
+    }
+    ~ExchangeEvent()
+    {
+        CloseHandle(m_event);
+    }
+
+    void wait(std::pair<NonblockIoHandle::ErrorCode, size_t> result)
+    {
+        if (result.first <= NonblockIoHandle::Pending)
+            WaitForSingleObject(m_event, INFINITE);
+        ResetEvent(m_event);
+    }
+
+    void handleCompletion(NonblockIoHandle*, NonblockIoHandle::ErrorCode, size_t) override
+    {
+        SetEvent(m_event);
+    }
+
+private:
+    HANDLE m_event;
+};
+
+// Each of |connections| threads repeatedly connects a pair, registers both ends, exchanges one message and
+// closes them again. The latency histogram holds whole cycles.
+static bool runChurn(const Options& options, Result& result)
+{
+    std::shared_ptr<CompletionPort> port = createPort(options);
+    std::vector<Result> results(options.connections);
+    std::vector<std::thread> threads;
+    std::atomic<bool> stopping(false);
+    std::atomic<bool> failed(false);
+
+    LONGLONG startTime = currentTicks();
+    for (unsigned i = 0; i < options.connections; ++i) {
+        threads.push_back(std::thread([&, i] {
+            std::vector<char> buffer(options.messageSize, 'x');
+            ExchangeEvent didWrite;
+            ExchangeEvent didRead;
+
+            while (!stopping) {
+                LONGLONG cycleTime = currentTicks();
+                SOCKET sv[2];
+                if (WSASocketPair(AF_INET, SOCK_STREAM, IPPROTO_TCP, sv) == SOCKET_ERROR) {
+                    failed = true;
+                    return;
+                }
+
+                Run run(0, 2);
+                std::shared_ptr<NonblockIoHandle> server = NonblockIoHandle::create(sv[0], port, &run);
+                std::shared_ptr<NonblockIoHandle> client = NonblockIoHandle::create(sv[1], port, &run);
+
+                didWrite.wait(client->write(&buffer[0], buffer.size(), &didWrite));
+                didRead.wait(server->read(&buffer[0], buffer.size(), &didRead));
+
+                client->close();
+                server->close();
+                run.waitUntilClosed();
+
+                results[i].latency.record(ticksToMicroseconds(currentTicks() - cycleTime));
+                results[i].bytes += buffer.size();
+                ++results[i].operations;
+            }
+        }));
+    }
+
+    Sleep(options.seconds * 1000);
+    stopping = true;
+    for (size_t i = 0; i < threads.size(); ++i)
+        threads[i].join();
+    result.seconds = ticksToMicroseconds(currentTicks() - startTime) / 1e6;
+
+    for (size_t i = 0; i < results.size(); ++i) {
+        result.operations += results[i].operations;
+        result.bytes += results[i].bytes;
+        result.latency.merge(results[i].latency);
+    }
+
+    port->terminate();
+    return !failed;
+}
+
+// Closes every connection as soon as it has been accepted.
+class AcceptCounter final : public Acceptor::Client, public NonblockIoHandle::Client {
+public:
+    AcceptCounter()
+        : m_closed(CreateEvent(NULL, TRUE, FALSE, NULL))
+        , m_accepted(0)
+        , m_connectionsClosed(0)
+    {
+    }
+    ~AcceptCounter()
+    {
+        CloseHandle(m_closed);
+    }
+
+    void handleDidAccept(Acceptor*, std::shared_ptr<NonblockIoHandle> handle) override
+    {
+        ++m_accepted;
+        handle->close();
+    }
+    void handleDidClose(Acceptor*) override
+    {
+        SetEvent(m_closed);
+    }
+
+    void handleDidClose(NonblockIoHandle*) override
+    {
+        ++m_connectionsClosed;
+    }
+    void handleDidRead(NonblockIoHandle*, size_t) override
+    {
+    }
+    void handleDidWrite(NonblockIoHandle*, size_t) override
+    {
+    }
+
+    ULONGLONG accepted() const { return m_accepted; }
+    ULONGLONG connectionsClosed() const { return m_connectionsClosed; }
+    void waitUntilClosed() { WaitForSingleObject(m_closed, INFINITE); }
+
+private:
+    HANDLE m_closed;
+    std::atomic<ULONGLONG> m_accepted;
+    std::atomic<ULONGLONG> m_connectionsClosed;
+};
+
+// -connections threads connect to an acceptor on loopback and reset each connection right away, so that neither end
+// is left in TIME_WAIT, for as long as the run lasts. Operations are the connections accepted; latency is the time
+// connect() took.
+static bool runAccept(const Options& options, Result& result)
+{
+    static const unsigned kBacklog = 64;
+    static const DWORD kSettleTime = 10000;
+
+    SOCKET listener = WSASocket(AF_INET, SOCK_STREAM, IPPROTO_TCP, NULL, 0, WSA_FLAG_OVERLAPPED);
+    if (listener == INVALID_SOCKET) {
+        fprintf(stderr, "Couldn't create the listening socket: %d\n", WSAGetLastError());
+        return false;
+    }
+
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int addressLength = sizeof(address);
+    if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == SOCKET_ERROR
+        || getsockname(listener, reinterpret_cast<sockaddr*>(&address), &addressLength) == SOCKET_ERROR
+        || listen(listener, SOMAXCONN) == SOCKET_ERROR) {
+        fprintf(stderr, "Couldn't listen on loopback: %d\n", WSAGetLastError());
+        closesocket(listener);
+        return false;
+    }
+
+    std::shared_ptr<CompletionPort> port = createPort(options);
+    AcceptCounter counter;
+    std::shared_ptr<Acceptor> acceptor = Acceptor::create(listener, port, &counter, &counter, kBacklog);
+    if (!acceptor) {
+        fprintf(stderr, "Couldn't create the acceptor\n");
+        port->terminate();
+        return false;
+    }
+
+    std::vector<Result> results(options.connections);
+    std::vector<std::thread> threads;
+    std::atomic<bool> stopping(false);
+    std::atomic<bool> failed(false);
+
+    LONGLONG startTime = currentTicks();
+    for (unsigned i = 0; i < options.connections; ++i) {
+        threads.push_back(std::thread([&, i] {
+            while (!stopping) {
+                SOCKET socket = WSASocket(AF_INET, SOCK_STREAM, IPPROTO_TCP, NULL, 0, 0);
+                if (socket == INVALID_SOCKET) {
+                    failed = true;
+                    return;
+                }
+
+                LONGLONG connectTime = currentTicks();
+                if (connect(socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == SOCKET_ERROR) {
+                    closesocket(socket);
+                    failed = true;
+                    return;
+                }
+                results[i].latency.record(ticksToMicroseconds(currentTicks() - connectTime));
+                ++results[i].operations;
+
+                linger reset = { 1, 0 };
+                setsockopt(socket, SOL_SOCKET, SO_LINGER, reinterpret_cast<char*>(&reset), sizeof(reset));
+                closesocket(socket);
+            }
+        }));
+    }
+
+    Sleep(options.seconds * 1000);
+    stopping = true;
+    for (size_t i = 0; i < threads.size(); ++i)
+        threads[i].join();
+
+    // The last connections may still be on their way through AcceptEx.
+    ULONGLONG connected = 0;
+    for (size_t i = 0; i < results.size(); ++i)
+        connected += results[i].operations;
+    ULONGLONG deadline = GetTickCount64() + kSettleTime;
+    while (counter.accepted() < connected && GetTickCount64() < deadline)
+        Sleep(1);
+    result.seconds = ticksToMicroseconds(currentTicks() - startTime) / 1e6;
+
+    acceptor->close();
+    counter.waitUntilClosed();
+    while (counter.connectionsClosed() < counter.accepted())
+        Sleep(1);
+
+    result.operations = counter.accepted();
+    for (size_t i = 0; i < results.size(); ++i)
+        result.latency.merge(results[i].latency);
+    if (result.operations < connected)
+        fprintf(stderr, "Only %llu of %llu connections were accepted\n", result.operations, connected);
+
+    port->terminate();
+    return !failed && result.operations == connected;
+}
+
+// Each of -threads threads opens -connections sockets, registers them all with one port and closes them again, in a
+// loop, so that adds on the threads and the closes on the port's workers hit the key registry at the same time.
+// Operations are handles that went through an add and a close; latency is the time per round.
+static bool runRegistry(const Options& options, Result& result)
+{
+    std::shared_ptr<CompletionPort> port = createPort(options);
+    std::vector<Result> results(options.threads);
+    std::vector<std::thread> threads;
+    std::atomic<bool> stopping(false);
+    std::atomic<bool> failed(false);
+
+    LONGLONG startTime = currentTicks();
+    for (unsigned i = 0; i < options.threads; ++i) {
+        threads.push_back(std::thread([&, i] {
+            std::vector<std::shared_ptr<NonblockIoHandle>> handles;
+            while (!stopping) {
+                LONGLONG roundTime = currentTicks();
+                Run run(0, options.connections);
+                for (unsigned j = 0; j < options.connections; ++j) {
+                    SOCKET socket = WSASocket(AF_INET, SOCK_STREAM, IPPROTO_TCP, NULL, 0, WSA_FLAG_OVERLAPPED);
+                    std::shared_ptr<NonblockIoHandle> handle = socket != INVALID_SOCKET ? NonblockIoHandle::create(socket, port, &run) : nullptr;
+                    if (!handle) {
+                        failed = true;
+                        run.handleDidClose(nullptr);
+                        continue;
+                    }
+                    handles.push_back(handle);
+                }
+
+                for (size_t j = 0; j < handles.size(); ++j)
+                    handles[j]->close();
+                handles.clear();
+                run.waitUntilClosed();
+
+                results[i].latency.record(ticksToMicroseconds(currentTicks() - roundTime));
+                results[i].operations += options.connections;
+                if (failed)
+                    return;
+            }
+        }));
+    }
+
+    Sleep(options.seconds * 1000);
+    stopping = true;
+    for (size_t i = 0; i < threads.size(); ++i)
+        threads[i].join();
+    result.seconds = ticksToMicroseconds(currentTicks() - startTime) / 1e6;
+
+    for (size_t i = 0; i < results.size(); ++i) {
+        result.operations += results[i].operations;
+        result.latency.merge(results[i].latency);
+    }
+    fprintf(stderr, "%.0f adds and closes per second\n", result.operations / result.seconds);
+
+    port->terminate();
+    if (failed)
+        fprintf(stderr, "Couldn't open or register a socket: %d\n", WSAGetLastError());
+    return !failed;
+}
+
+// Connects pairs that keep reads and writes in flight and then shuts their port down without closing anything,
+// over and over. Every round has to drain before the deadline; latency is how long the shutdown took.
+static bool runDrain(const Options& options, Result& result)
+{
+    static const DWORD kDeadline = 10000;
+
+    LONGLONG startTime = currentTicks();
+    ULONGLONG endTime = GetTickCount64() + options.seconds * 1000;
+    while (GetTickCount64() < endTime) {
+        std::vector<SOCKET> sockets;
+        for (unsigned i = 0; i < options.connections; ++i) {
+            SOCKET sv[2];
+            if (WSASocketPair(AF_INET, SOCK_STREAM, IPPROTO_TCP, sv) == SOCKET_ERROR) {
+                fprintf(stderr, "Couldn't create connection %u: %d\n", i, WSAGetLastError());
+                for (size_t j = 0; j < sockets.size(); ++j)
+                    closesocket(sockets[j]);
+                return false;
+            }
+
+            sockets.push_back(sv[0]);
+            sockets.push_back(sv[1]);
+        }
+
+        std::shared_ptr<CompletionPort> port = createPort(options);
+        Run run(options.connections * 2, options.connections * 2);
+        std::vector<std::unique_ptr<Peer>> peers;
+        for (unsigned i = 0; i < options.connections; ++i) {
+            peers.push_back(std::unique_ptr<Peer>(new Server(run, port, sockets[i * 2], options.messageSize, false)));
+            peers.push_back(std::unique_ptr<Peer>(new Client(run, port, sockets[i * 2 + 1], options.messageSize, false)));
+        }
+        for (size_t i = 0; i < peers.size(); ++i)
+            peers[i]->start();
+        Sleep(10);
+
+        LONGLONG shutdownTime = currentTicks();
+        if (!port->shutdown(kDeadline)) {
+            fprintf(stderr, "The port didn't drain within %u milliseconds\n", kDeadline);
+            return false;
+        }
+        result.latency.record(ticksToMicroseconds(currentTicks() - shutdownTime));
+
+        // Every handle has reported its close and every peer has seen its last operation fail by now.
+        run.waitUntilClosed();
+        run.waitUntilIdle();
+        for (size_t i = 0; i < peers.size(); ++i)
+            result.bytes += peers[i]->bytes();
+        ++result.operations;
+    }
+    result.seconds = ticksToMicroseconds(currentTicks() - startTime) / 1e6;
+
+    return true;
+}
+
+// Fills a temporary file with |megabytes| of data through a plain synchronous handle.
+static bool createTestFile(_TCHAR path[MAX_PATH], unsigned megabytes)
+{
+    _TCHAR directory[MAX_PATH];
+    if (!GetTempPath(MAX_PATH, directory) || !GetTempFileName(directory, _T("bch"), 0, path))
+        return false;
+
+    HANDLE file = CreateFile(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    std::vector<char> chunk(1024 * 1024, 'x');
+    bool succeeded = true;
+    for (unsigned i = 0; i < megabytes && succeeded; ++i) {
+        DWORD bytesWritten;
+        succeeded = WriteFile(file, &chunk[0], chunk.size(), &bytesWritten, NULL) && bytesWritten == chunk.size();
+    }
+
+    CloseHandle(file);
+    return succeeded;
+}
+
+// Streams the whole file through the read-ahead engine. The latency histogram holds the gaps between buffers.
+class FileStream final : public NonblockIoHandle::Client {
+public:
+    FileStream(Result& result)
+        : m_result(result)
+        , m_done(CreateEvent(NULL, TRUE, FALSE, NULL))
+        , m_closed(CreateEvent(NULL, TRUE, FALSE, NULL))
+        , m_lastDelivery(currentTicks())
+    {
+    }
+    ~FileStream()
+    {
+        CloseHandle(m_done);
+        CloseHandle(m_closed);
+    }
+
+    void handleDidClose(NonblockIoHandle*)
+    {
+        SetEvent(m_closed);
+    }
+    void handleDidRead(NonblockIoHandle*, size_t)
+    {
+        SetEvent(m_done);
+    }
+    void handleDidWrite(NonblockIoHandle*, size_t)
+    {
+    }
+    void handleDidReadBuffer(NonblockIoHandle* handle, PooledBuffer* buffer, size_t size)
+    {
+        LONGLONG now = currentTicks();
+        m_result.latency.record(ticksToMicroseconds(now - m_lastDelivery));
+        m_lastDelivery = now;
+        m_result.bytes += size;
+        ++m_result.operations;
+
+        buffer->pool->release(buffer);
+    }
+
+    void waitUntilDone() { WaitForSingleObject(m_done, INFINITE); }
+    void waitUntilClosed() { WaitForSingleObject(m_closed, INFINITE); }
+
+private:
+    Result& m_result;
+    HANDLE m_done;
+    HANDLE m_closed;
+    LONGLONG m_lastDelivery;
+};
+
+// Keeps one read outstanding at a random block-aligned offset.
+class RandomReader final : public NonblockIoHandle::CompletionHandler {
+public:
+    RandomReader(Run& run, std::shared_ptr<CompletionPort> port, std::shared_ptr<NonblockIoHandle> file, size_t blockSize, ULONGLONG blockCount, unsigned seed)
+        : m_run(run)
+        , m_port(port)
+        , m_file(file)
+        , m_buffer(static_cast<char*>(_aligned_malloc(blockSize, file->sectorSize())))
+        , m_blockSize(blockSize)
+        , m_blocks(0, blockCount - 1)
+        , m_random(seed)
+        , m_readTime(0)
+    {
+    }
+    ~RandomReader()
+    {
+        _aligned_free(m_buffer);
+    }
+
+    void read()
+    {
+        m_readTime = currentTicks();
+        if (m_file->readAt(m_blocks(m_random) * m_blockSize, m_buffer, m_blockSize, this).first > NonblockIoHandle::Pending)
+            m_run.didFinish();
+    }
+
+    void handleCompletion(NonblockIoHandle*, NonblockIoHandle::ErrorCode error, size_t size) override
+    {
+        if (error != NonblockIoHandle::Complete) {
+            m_run.didFinish();
+            return;
+        }
+
+        m_result.latency.record(ticksToMicroseconds(currentTicks() - m_readTime));
+        m_result.bytes += size;
+        ++m_result.operations;
+
+        if (m_run.stopping()) {
+            m_run.didFinish();
+            return;
+        }
+
+        continueWith(*m_port, [this] { read(); });
+    }
+
+    const Result& result() const { return m_result; }
+
+private:
+    Run& m_run;
+    std::shared_ptr<CompletionPort> m_port;
+    std::shared_ptr<NonblockIoHandle> m_file;
+    char* m_buffer;
+    size_t m_blockSize;
+    std::uniform_int_distribution<ULONGLONG> m_blocks;
+    std::mt19937 m_random;
+    LONGLONG m_readTime;
+    Result m_result;
+};
+
+// Reads a temporary file of |fileSize| megabytes in |messageSize| blocks, either front to back with up to
+// |connections| reads ahead, or at random offsets with |connections| reads outstanding.
+static bool runFile(const Options& options, bool sequential, Result& result)
+{
+    _TCHAR path[MAX_PATH];
+    if (!createTestFile(path, options.fileSize)) {
+        fprintf(stderr, "Couldn't create the test file: %u\n", GetLastError());
+        return false;
+    }
+
+    std::shared_ptr<CompletionPort> port = createPort(options);
+    unsigned flags = (options.unbuffered ? NonblockIoHandle::Unbuffered : 0) | (sequential ? NonblockIoHandle::SequentialScan : NonblockIoHandle::RandomAccess);
+    bool succeeded = false;
+
+    if (sequential) {
+        FileStream stream(result);
+        std::shared_ptr<NonblockIoHandle> file = NonblockIoHandle::openFile(path, GENERIC_READ, OPEN_EXISTING, flags, port, &stream);
+        if (file) {
+            size_t blockSize = (options.messageSize + file->sectorSize() - 1) / file->sectorSize() * file->sectorSize();
+            std::shared_ptr<BufferPool> pool = BufferPool::create(blockSize, options.connections * 2);
+
+            LONGLONG startTime = currentTicks();
+            succeeded = pool && file->startReadingAt(0, pool, options.connections);
+            if (succeeded)
+                stream.waitUntilDone();
+            result.seconds = ticksToMicroseconds(currentTicks() - startTime) / 1e6;
+
+            file->close();
+            stream.waitUntilClosed();
+        }
+    } else {
+        Run run(options.connections, 1);
+        std::shared_ptr<NonblockIoHandle> file = NonblockIoHandle::openFile(path, GENERIC_READ, OPEN_EXISTING, flags, port, &run);
+        if (file) {
+            size_t blockSize = (options.messageSize + file->sectorSize() - 1) / file->sectorSize() * file->sectorSize();
+            ULONGLONG blockCount = static_cast<ULONGLONG>(options.fileSize) * 1024 * 1024 / blockSize;
+
+            std::vector<std::unique_ptr<RandomReader>> readers;
+            for (unsigned i = 0; i < options.connections; ++i)
+                readers.push_back(std::unique_ptr<RandomReader>(new RandomReader(run, port, file, blockSize, blockCount, i)));
+
+            LONGLONG startTime = currentTicks();
+            for (unsigned i = 0; i < options.connections; ++i)
+                readers[i]->read();
+
+            Sleep(options.seconds * 1000);
+            run.stop();
+            run.waitUntilIdle();
+            result.seconds = ticksToMicroseconds(currentTicks() - startTime) / 1e6;
+
+            for (unsigned i = 0; i < options.connections; ++i) {
+                result.operations += readers[i]->result().operations;
+                result.bytes += readers[i]->result().bytes;
+                result.latency.merge(readers[i]->result().latency);
+            }
+
+            file->close();
+            run.waitUntilClosed();
+            succeeded = true;
+        }
+    }
+
+    port->terminate();
+    DeleteFile(path);
+    return succeeded;
+}
+
+// Sends the same file over and over in |messageSize| chunks, either with transmit() or by reading each chunk
+// into a buffer and writing it out. The latency histogram holds whole chunks.
+class FileSender final : public Peer {
+public:
+    FileSender(Run& run, std::shared_ptr<CompletionPort> port, SOCKET socket, size_t chunkSize, HANDLE file, ULONGLONG fileSize)
+        : Peer(run, port, socket, 0)
+        , m_zeroCopyFile(file)
+        , m_fileSize(fileSize)
+        , m_chunkSize(chunkSize)
+        , m_offset(0)
+        , m_writing(false)
+        , m_sendTime(0)
+    {
+    }
+    FileSender(Run& run, std::shared_ptr<CompletionPort> port, SOCKET socket, size_t chunkSize, LPCTSTR path, ULONGLONG fileSize)
+        : Peer(run, port, socket, chunkSize)
+        , m_file(NonblockIoHandle::openFile(path, GENERIC_READ, OPEN_EXISTING, NonblockIoHandle::SequentialScan, port, &run))
+        , m_zeroCopyFile(nullptr)
+        , m_fileSize(fileSize)
+        , m_chunkSize(chunkSize)
+        , m_offset(0)
+        , m_writing(false)
+        , m_sendTime(0)
+    {
+        // The run counts this file among its open handles.
+        if (!m_file)
+            run.handleDidClose(nullptr);
+    }
+
+    void start() override { send(); }
+
+    void close() override
+    {
+        Peer::close();
+        if (m_file)
+            m_file->close();
+    }
+
+    void handleCompletion(NonblockIoHandle*, NonblockIoHandle::ErrorCode error, size_t size) override
+    {
+        if (error != NonblockIoHandle::Complete || !size) {
+            m_run.didFinish();
+            return;
+        }
+
+        // The chunk has been read into the buffer; now it goes out.
+        if (!m_zeroCopyFile && !m_writing) {
+            m_writing = true;
+            issue(m_handle->write(&m_buffer[0], size, this));
+            return;
+        }
+
+        m_latency.record(ticksToMicroseconds(currentTicks() - m_sendTime));
+        m_bytes += size;
+        ++m_operations;
+
+        m_offset += m_chunkSize;
+        if (m_offset >= m_fileSize)
+            m_offset = 0;
+
+        if (m_run.stopping()) {
+            m_run.didFinish();
+            return;
+        }
+
+        continueWith(*m_port, [this] { send(); });
+    }
+
+private:
+    void send()
+    {
+        DWORD length = static_cast<DWORD>(std::min<ULONGLONG>(m_chunkSize, m_fileSize - m_offset));
+        m_writing = false;
+        m_sendTime = currentTicks();
+        if (m_zeroCopyFile)
+            issue(m_handle->transmit(m_zeroCopyFile, m_offset, length, nullptr, nullptr, this));
+        else if (m_file)
+            issue(m_file->readAt(m_offset, &m_buffer[0], length, this));
+        else
+            m_run.didFinish();
+    }
+
+    std::shared_ptr<NonblockIoHandle> m_file;
+    HANDLE m_zeroCopyFile;
+    ULONGLONG m_fileSize;
+    size_t m_chunkSize;
+    ULONGLONG m_offset;
+    bool m_writing;
+    LONGLONG m_sendTime;
+};
+
+// Serves a temporary file of |fileSize| megabytes to each connection, which reads and discards it.
+static bool runFileTransfer(const Options& options, bool zeroCopy, Result& result)
+{
+    _TCHAR path[MAX_PATH];
+    if (!createTestFile(path, options.fileSize)) {
+        fprintf(stderr, "Couldn't create the test file: %u\n", GetLastError());
+        return false;
+    }
+
+    ULONGLONG fileSize = static_cast<ULONGLONG>(options.fileSize) * 1024 * 1024;
+    HANDLE file = INVALID_HANDLE_VALUE;
+    if (zeroCopy)
+        file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+    bool succeeded = false;
+    if (!zeroCopy || file != INVALID_HANDLE_VALUE) {
+        size_t chunkSize = options.messageSize;
+        ClientFactory makeSender = [&](Run& run, std::shared_ptr<CompletionPort> port, SOCKET socket) -> Peer* {
+            if (zeroCopy)
+                return new FileSender(run, port, socket, chunkSize, file, fileSize);
+            return new FileSender(run, port, socket, chunkSize, path, fileSize);
+        };
+
+        succeeded = runConnections(options, false, makeSender, zeroCopy ? 0 : 1, result);
+    }
+
+    if (file != INVALID_HANDLE_VALUE)
+        CloseHandle(file);
+    DeleteFile(path);
+    return succeeded;
+}
+
+// Sends frames of an 8-byte header and a -size payload and reads each echo back before sending the next. Framing
+// either copies both into one buffer for a single write, or hands them to writev() as they are. The writes have no
+// handler; only the echo is read with one. The latency histogram holds round trips.
+class FrameSender final : public Peer {
+public:
+    FrameSender(Run& run, std::shared_ptr<CompletionPort> port, SOCKET socket, size_t payloadSize, bool vectored)
+        : Peer(run, port, socket, payloadSize)
+        , m_vectored(vectored)
+        , m_frame(kHeaderSize + payloadSize)
+        , m_echo(kHeaderSize + payloadSize)
+        , m_received(0)
+        , m_sequence(0)
+        , m_sendTime(0)
+    {
+        memset(m_header, 0, sizeof(m_header));
+    }
+
+    void start() override { send(); }
+
+    void handleCompletion(NonblockIoHandle*, NonblockIoHandle::ErrorCode error, size_t size) override
+    {
+        if (error != NonblockIoHandle::Complete || !size) {
+            m_run.didFinish();
+            return;
+        }
+
+        m_received += size;
+        if (m_received < m_echo.size()) {
+            issue(m_handle->read(&m_echo[m_received], m_echo.size() - m_received, this));
+            return;
+        }
+
+        m_latency.record(ticksToMicroseconds(currentTicks() - m_sendTime));
+        m_bytes += m_echo.size();
+        ++m_operations;
+
+        if (m_run.stopping()) {
+            m_run.didFinish();
+            return;
+        }
+
+        continueWith(*m_port, [this] { send(); });
+    }
+
+private:
+    static const size_t kHeaderSize = 8;
+
+    void send()
+    {
+        m_sendTime = currentTicks();
+        unsigned length = static_cast<unsigned>(m_buffer.size());
+        memcpy(m_header, &length, sizeof(length));
+        memcpy(m_header + sizeof(length), &m_sequence, sizeof(m_sequence));
+        ++m_sequence;
+
+        std::pair<NonblockIoHandle::ErrorCode, size_t> result;
+        if (m_vectored) {
+            m_buffers[0].buf = m_header;
+            m_buffers[0].len = kHeaderSize;
+            m_buffers[1].buf = &m_buffer[0];
+            m_buffers[1].len = static_cast<ULONG>(m_buffer.size());
+            result = m_handle->writev(m_buffers, 2);
+        } else {
+            memcpy(&m_frame[0], m_header, kHeaderSize);
+            memcpy(&m_frame[kHeaderSize], &m_buffer[0], m_buffer.size());
+            result = m_handle->write(&m_frame[0], m_frame.size());
+        }
+        if (result.first > NonblockIoHandle::Pending) {
+            m_run.didFinish();
+            return;
+        }
+
+        m_received = 0;
+        issue(m_handle->read(&m_echo[0], m_echo.size(), this));
+    }
+
+    bool m_vectored;
+    char m_header[kHeaderSize];
+    WSABUF m_buffers[2];
+    std::vector<char> m_frame;
+    std::vector<char> m_echo;
+    size_t m_received;
+    unsigned m_sequence;
+    LONGLONG m_sendTime;
+};
+
+// User and kernel time of the whole process, in seconds.
+static double processorTime()
+{
+    FILETIME creationTime, exitTime, kernelTime, userTime;
+    if (!GetProcessTimes(GetCurrentProcess(), &creationTime, &exitTime, &kernelTime, &userTime))
+        return 0;
+
+    ULARGE_INTEGER kernel = { kernelTime.dwLowDateTime, kernelTime.dwHighDateTime };
+    ULARGE_INTEGER user = { userTime.dwLowDateTime, userTime.dwHighDateTime };
+    return (kernel.QuadPart + user.QuadPart) / 1e7;
+}
+
+// Opens a datagram socket bound to an ephemeral loopback port and returns its address.
+static SOCKET createDatagramSocket(sockaddr_in& address)
+{
+    SOCKET socket = WSASocket(AF_INET, SOCK_DGRAM, IPPROTO_UDP, NULL, 0, WSA_FLAG_OVERLAPPED);
+    if (socket == INVALID_SOCKET)
+        return INVALID_SOCKET;
+
+    int bufferSize = 4 * 1024 * 1024;
+    setsockopt(socket, SOL_SOCKET, SO_RCVBUF, reinterpret_cast<char*>(&bufferSize), sizeof(bufferSize));
+    setsockopt(socket, SOL_SOCKET, SO_SNDBUF, reinterpret_cast<char*>(&bufferSize), sizeof(bufferSize));
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int addressLength = sizeof(address);
+    if (bind(socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == SOCKET_ERROR
+        || getsockname(socket, reinterpret_cast<sockaddr*>(&address), &addressLength) == SOCKET_ERROR) {
+        closesocket(socket);
+        return INVALID_SOCKET;
+    }
+
+    return socket;
+}
+
+// Every datagram carries the tick count it was sent at, which gives one-way latency on arrival.
+class DatagramReceiver final : public DatagramHandle::Client {
+public:
+    DatagramReceiver()
+        : m_closed(CreateEvent(NULL, TRUE, FALSE, NULL))
+    {
+    }
+    ~DatagramReceiver()
+    {
+        CloseHandle(m_closed);
+    }
+
+    void handleDidReceive(DatagramHandle*, PooledBuffer* buffer, size_t size, const sockaddr*, int)
+    {
+        LONGLONG sendTime = 0;
+        if (size >= sizeof(sendTime))
+            memcpy(&sendTime, buffer->data, sizeof(sendTime));
+        buffer->pool->release(buffer);
+
+        // Datagrams arrive on all workers at once, so each worker counts into its own result.
+        static __declspec(thread) Result* s_result;
+        if (!s_result) {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_results.push_back(std::unique_ptr<Result>(new Result));
+            s_result = m_results.back().get();
+        }
+
+        if (sendTime)
+            s_result->latency.record(ticksToMicroseconds(currentTicks() - sendTime));
+        s_result->bytes += size;
+        ++s_result->operations;
+    }
+    void handleDidClose(DatagramHandle*)
+    {
+        SetEvent(m_closed);
+    }
+
+    void waitUntilClosed() { WaitForSingleObject(m_closed, INFINITE); }
+
+    void addTo(Result& result)
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        for (size_t i = 0; i < m_results.size(); ++i) {
+            result.operations += m_results[i]->operations;
+            result.bytes += m_results[i]->bytes;
+            result.latency.merge(m_results[i]->latency);
+        }
+    }
+
+private:
+    HANDLE m_closed;
+    std::mutex m_lock;
+    std::vector<std::unique_ptr<Result>> m_results;
+};
+
+// Keeps as many datagrams in flight as its pool has buffers, sending them in batches as buffers come back.
+class DatagramSender final : public DatagramHandle::Client {
+public:
+    DatagramSender(const sockaddr_in& destination, size_t messageSize, std::atomic<bool>& stopping)
+        : m_destination(destination)
+        , m_messageSize(messageSize)
+        , m_stopping(stopping)
+        , m_closed(CreateEvent(NULL, TRUE, FALSE, NULL))
+        , m_pool(BufferPool::create(messageSize, kWindow))
+    {
+    }
+    ~DatagramSender()
+    {
+        CloseHandle(m_closed);
+    }
+
+    bool start(std::shared_ptr<CompletionPort> port)
+    {
+        sockaddr_in address;
+        SOCKET socket = createDatagramSocket(address);
+        if (!m_pool || socket == INVALID_SOCKET)
+            return false;
+
+        m_handle = DatagramHandle::create(socket, port, this);
+        send();
+        return true;
+    }
+
+    void close()
+    {
+        if (m_handle)
+            m_handle->close();
+        else
+            SetEvent(m_closed);
+    }
+
+    void handleDidReceive(DatagramHandle*, PooledBuffer* buffer, size_t, const sockaddr*, int)
+    {
+        buffer->pool->release(buffer);
+    }
+    void handleDidSend(DatagramHandle*, size_t)
+    {
+        send();
+    }
+    void handleDidClose(DatagramHandle*)
+    {
+        SetEvent(m_closed);
+    }
+
+    void waitUntilClosed() { WaitForSingleObject(m_closed, INFINITE); }
+
+private:
+    static const size_t kWindow = 256;
+    static const size_t kBatchSize = 32;
+
+    void send()
+    {
+        DatagramHandle::Datagram batch[kBatchSize];
+        size_t count = 0;
+        while (count < kBatchSize && !m_stopping) {
+            PooledBuffer* buffer = m_pool->acquire();
+            if (!buffer)
+                break;
+
+            LONGLONG sendTime = currentTicks();
+            memcpy(buffer->data, &sendTime, std::min(sizeof(sendTime), m_messageSize));
+            DatagramHandle::Datagram datagram = { buffer, m_messageSize, reinterpret_cast<const sockaddr*>(&m_destination), sizeof(m_destination) };
+            batch[count++] = datagram;
+        }
+
+        for (size_t sent = m_handle->sendEach(batch, count); sent < count; ++sent)
+            m_pool->release(batch[sent].buffer);
+    }
+
+    sockaddr_in m_destination;
+    size_t m_messageSize;
+    std::atomic<bool>& m_stopping;
+    HANDLE m_closed;
+    std::shared_ptr<BufferPool> m_pool;
+    std::shared_ptr<DatagramHandle> m_handle;
+};
+
+// |connections| senders blast datagrams at one receiver that keeps |connections| * 16 receives posted. Datagrams
+// dropped by the stack simply don't count.
+static bool runDatagrams(const Options& options, Result& result)
+{
+    sockaddr_in address;
+    SOCKET socket = createDatagramSocket(address);
+    if (socket == INVALID_SOCKET) {
+        fprintf(stderr, "Couldn't create the receiving socket: %d\n", WSAGetLastError());
+        return false;
+    }
+
+    std::shared_ptr<CompletionPort> receiverPort = createPort(options);
+    std::shared_ptr<CompletionPort> senderPort = createPort(options);
+    unsigned depth = options.connections * 16;
+    std::shared_ptr<BufferPool> pool = BufferPool::create(std::max<size_t>(options.messageSize, 2048), depth * 2);
+
+    DatagramReceiver receiver;
+    std::shared_ptr<DatagramHandle> handle = DatagramHandle::create(socket, receiverPort, &receiver);
+    bool succeeded = pool && handle->startReceiving(pool, depth);
+
+    std::atomic<bool> stopping(false);
+    std::vector<std::unique_ptr<DatagramSender>> senders;
+    for (unsigned i = 0; i < options.connections; ++i)
+        senders.push_back(std::unique_ptr<DatagramSender>(new DatagramSender(address, options.messageSize, stopping)));
+
+    LONGLONG startTime = currentTicks();
+    for (unsigned i = 0; i < options.connections && succeeded; ++i)
+        succeeded = senders[i]->start(senderPort);
+
+    if (succeeded)
+        Sleep(options.seconds * 1000);
+    stopping = true;
+    result.seconds = ticksToMicroseconds(currentTicks() - startTime) / 1e6;
+
+    for (unsigned i = 0; i < options.connections; ++i) {
+        senders[i]->close();
+        senders[i]->waitUntilClosed();
+    }
+    handle->close();
+    receiver.waitUntilClosed();
+    receiver.addTo(result);
+
+    receiverPort->terminate();
+    senderPort->terminate();
+    return succeeded;
+}
+
+// Writes as fast as flow control lets it. The latency histogram holds how long each throttled stretch lasted.
+class FloodWriter final : public NonblockIoHandle::Client {
+public:
+    FloodWriter(std::shared_ptr<CompletionPort> port, size_t messageSize, std::atomic<bool>& stopping)
+        : m_port(port)
+        , m_message(messageSize, 'x')
+        , m_stopping(stopping)
+        , m_closed(CreateEvent(NULL, TRUE, FALSE, NULL))
+        , m_throttledTime(0)
+    {
+    }
+    ~FloodWriter()
+    {
+        CloseHandle(m_closed);
+    }
+
+    void start(SOCKET socket, size_t highWatermark, bool coalescing = false)
+    {
+        m_handle = NonblockIoHandle::create(socket, m_port, this);
+        m_handle->setWriteWatermarks(highWatermark / 4, highWatermark);
+        m_handle->setWriteCoalescing(coalescing);
+        write();
+    }
+
+    void handleDidClose(NonblockIoHandle*)
+    {
+        SetEvent(m_closed);
+    }
+    void handleDidRead(NonblockIoHandle*, size_t)
+    {
+    }
+    void handleDidWrite(NonblockIoHandle*, size_t)
+    {
+    }
+    void handleWritable(NonblockIoHandle*)
+    {
+        m_result.latency.record(ticksToMicroseconds(currentTicks() - m_throttledTime));
+        continueWith(*m_port, [this] { write(); });
+    }
+
+    std::shared_ptr<NonblockIoHandle> handle() const { return m_handle; }
+    const Result& result() const { return m_result; }
+    void waitUntilClosed() { WaitForSingleObject(m_closed, INFINITE); }
+
+private:
+    void write()
+    {
+        while (!m_stopping) {
+            std::pair<NonblockIoHandle::ErrorCode, size_t> result = m_handle->write(&m_message[0], m_message.size());
+            if (result.first == NonblockIoHandle::Throttled)
+                m_throttledTime = currentTicks();
+            if (result.first > NonblockIoHandle::Pending)
+                return;
+
+            m_result.bytes += m_message.size();
+            ++m_result.operations;
+        }
+    }
+
+    std::shared_ptr<CompletionPort> m_port;
+    std::vector<char> m_message;
+    std::atomic<bool>& m_stopping;
+    HANDLE m_closed;
+    std::shared_ptr<NonblockIoHandle> m_handle;
+    LONGLONG m_throttledTime;
+    Result m_result;
+};
+
+// Reads one message at a time and pauses for a millisecond after each.
+class SlowReader final : public NonblockIoHandle::Client, public NonblockIoHandle::CompletionHandler {
+public:
+    SlowReader(std::shared_ptr<CompletionPort> port, size_t messageSize, std::atomic<bool>& stopping)
+        : m_port(port)
+        , m_buffer(messageSize)
+        , m_stopping(stopping)
+        , m_closed(CreateEvent(NULL, TRUE, FALSE, NULL))
+        , m_timer([this] { read(); })
+    {
+    }
+    ~SlowReader()
+    {
+        CloseHandle(m_closed);
+    }
+
+    void start(SOCKET socket)
+    {
+        m_handle = NonblockIoHandle::create(socket, m_port, this);
+        read();
+    }
+
+    void close()
+    {
+        m_port->cancelTimer(&m_timer);
+        m_handle->close();
+    }
+
+    void handleDidClose(NonblockIoHandle*)
+    {
+        SetEvent(m_closed);
+    }
+    void handleDidRead(NonblockIoHandle*, size_t)
+    {
+    }
+    void handleDidWrite(NonblockIoHandle*, size_t)
+    {
+    }
+    void handleCompletion(NonblockIoHandle*, NonblockIoHandle::ErrorCode error, size_t size) override
+    {
+        if (error == NonblockIoHandle::Complete && size && !m_stopping)
+            m_port->armTimer(&m_timer, 1);
+    }
+
+    void waitUntilClosed() { WaitForSingleObject(m_closed, INFINITE); }
+
+private:
+    void read()
+    {
+        if (!m_stopping)
+            m_handle->read(&m_buffer[0], m_buffer.size(), this);
+    }
+
+    std::shared_ptr<CompletionPort> m_port;
+    std::vector<char> m_buffer;
+    std::atomic<bool>& m_stopping;
+    HANDLE m_closed;
+    CompletionPort::Timer m_timer;
+    std::shared_ptr<NonblockIoHandle> m_handle;
+};
+
+// Floods a connection whose reader can't keep up. With flow control the writer's queue stays within its high
+// watermark instead of growing for as long as the run lasts. Fails if the peak went past the watermark by more than
+// the one message that writers racing on different workers may slip in.
+static bool runSlowReader(const Options& options, Result& result)
+{
+    SOCKET sv[2];
+    if (WSASocketPair(AF_INET, SOCK_STREAM, IPPROTO_TCP, sv) == SOCKET_ERROR) {
+        fprintf(stderr, "Couldn't create the connection: %d\n", WSAGetLastError());
+        return false;
+    }
+
+    size_t highWatermark = options.messageSize * 16;
+    std::shared_ptr<CompletionPort> port = createPort(options);
+    std::atomic<bool> stopping(false);
+    FloodWriter writer(port, options.messageSize, stopping);
+    SlowReader reader(port, options.messageSize, stopping);
+
+    LONGLONG startTime = currentTicks();
+    reader.start(sv[0]);
+    writer.start(sv[1], highWatermark);
+
+    Sleep(options.seconds * 1000);
+    stopping = true;
+    result.seconds = ticksToMicroseconds(currentTicks() - startTime) / 1e6;
+
+    NonblockIoHandle::FlowControlStatistics statistics = writer.handle()->flowControlStatistics();
+    fprintf(stderr, "peak queued bytes: %u (high watermark %u), throttled writes: %u, throttled for %.3f seconds\n",
+        static_cast<unsigned>(statistics.peakQueuedBytes), static_cast<unsigned>(highWatermark),
+        static_cast<unsigned>(statistics.throttledWrites), statistics.throttledMicroseconds / 1e6);
+
+    writer.handle()->close();
+    reader.close();
+    writer.waitUntilClosed();
+    reader.waitUntilClosed();
+
+    result.operations = writer.result().operations;
+    result.bytes = writer.result().bytes;
+    result.latency = writer.result().latency;
+
+    port->terminate();
+
+    if (statistics.peakQueuedBytes > highWatermark + options.messageSize) {
+        fprintf(stderr, "The queue went past the high watermark\n");
+        return false;
+    }
+    return true;
+}
+
+// Writes -size messages as fast as a reader that takes 64KB at a time lets it, with up to 256KB queued, either one send
+// per write or with write coalescing. Operations are messages written; latency is how long the writer stayed
+// throttled.
+static bool runSmallWrites(const Options& options, bool coalescing, Result& result)
+{
+    static const size_t kHighWatermark = 256 * 1024;
+    static const size_t kReadSize = 64 * 1024;
+
+    SOCKET sv[2];
+    if (WSASocketPair(AF_INET, SOCK_STREAM, IPPROTO_TCP, sv) == SOCKET_ERROR) {
+        fprintf(stderr, "Couldn't create the connection: %d\n", WSAGetLastError());
+        return false;
+    }
+
+    std::shared_ptr<CompletionPort> port = createPort(options);
+    std::atomic<bool> stopping(false);
+    Run run(1, 1);
+    Server reader(run, port, sv[0], kReadSize, false);
+    FloodWriter writer(port, options.messageSize, stopping);
+
+    LONGLONG startTime = currentTicks();
+    reader.start();
+    writer.start(sv[1], kHighWatermark, coalescing);
+
+    Sleep(options.seconds * 1000);
+    stopping = true;
+    result.seconds = ticksToMicroseconds(currentTicks() - startTime) / 1e6;
+
+    if (coalescing) {
+        NonblockIoHandle::WriteCoalescingStatistics statistics = writer.handle()->writeCoalescingStatistics();
+        fprintf(stderr, "%u writes went out in %u sends, %.1f writes per send\n", static_cast<unsigned>(statistics.writes),
+            static_cast<unsigned>(statistics.sends), statistics.sends ? static_cast<double>(statistics.writes) / statistics.sends : 0);
+    }
+
+    // The reader sees the end of the stream once the writer's queue has gone out.
+    writer.handle()->close();
+    writer.waitUntilClosed();
+    run.waitUntilIdle();
+    reader.close();
+    run.waitUntilClosed();
+
+    result.operations = writer.result().operations;
+    result.bytes = writer.result().bytes;
+    result.latency = writer.result().latency;
+    fprintf(stderr, "%.2f million messages per second\n", result.operations / result.seconds / 1e6);
+
+    port->terminate();
+    return true;
+}
+
+class FrameCounter final : public FrameDecoder::Client {
+public:
+    FrameCounter()
+        : frames(0)
+    {
+    }
+
+    void handleDidDecodeFrame(FrameDecoder*, const char*, size_t) override
+    {
+        ++frames;
+    }
+
+    ULONGLONG frames;
+};
+
+// Decodes an in-memory stream of frames with -size byte payloads, in 64KB reads, for as long as the run lasts. Copying
+// each read into the decoder stands in for the socket read. Latency is the time per pass over the stream.
+static bool runFraming(const Options& options, const FrameFormat& format, Result& result)
+{
+    static const size_t kStreamSize = 64 * 1024 * 1024;
+    static const size_t kReadSize = 64 * 1024;
+
+    FrameEncoder encoder(format);
+    std::vector<char> payload(options.messageSize, 'x');
+    while (encoder.size() < kStreamSize)
+        encoder.append(&payload[0], payload.size());
+
+    FrameCounter counter;
+    FrameDecoder decoder(format, &counter, kReadSize);
+
+    LONGLONG startTime = currentTicks();
+    ULONGLONG endTime = GetTickCount64() + options.seconds * 1000;
+    while (GetTickCount64() < endTime) {
+        LONGLONG passTime = currentTicks();
+        for (size_t offset = 0; offset < encoder.size();) {
+            std::pair<char*, size_t> space = decoder.readBuffer();
+            size_t size = std::min(std::min(space.second, kReadSize), encoder.size() - offset);
+            memcpy(space.first, encoder.data() + offset, size);
+            if (!decoder.didRead(size)) {
+                fprintf(stderr, "The stream didn't decode\n");
+                return false;
+            }
+            offset += size;
+        }
+
+        result.latency.record(ticksToMicroseconds(currentTicks() - passTime));
+        result.bytes += encoder.size();
+    }
+    result.seconds = ticksToMicroseconds(currentTicks() - startTime) / 1e6;
+    result.operations = counter.frames;
+
+    fprintf(stderr, "%.2f GB/s, %.1f million frames per second\n", result.bytes / result.seconds / 1e9, result.operations / result.seconds / 1e6);
+    return true;
+}
+
+// One end of a memory pipe pair. The client sends a message and reads the whole echo back before sending the next
+// one, until the run stops or it has done |maxExchanges|; the server echoes whatever it reads. Both close on the end
+// of the stream or any error. When there's a |digest|, every completion is folded into it.
+class MemoryPeer final : public MemoryPipe::Client, public MemoryPipe::CompletionHandler {
+public:
+    MemoryPeer(unsigned id, bool client, size_t messageSize, std::atomic<unsigned>& open, const std::atomic<bool>& stopping, unsigned maxExchanges = 0, ULONGLONG* digest = nullptr)
+        : m_id(id)
+        , m_client(client)
+        , m_buffer(messageSize, 'x')
+        , m_open(open)
+        , m_stopping(stopping)
+        , m_maxExchanges(maxExchanges)
+        , m_digest(digest)
+        , m_reading(false)
+        , m_received(0)
+        , m_toWrite(0)
+        , m_written(0)
+        , m_sendTime(0)
+        , m_exchanges(0)
+        , m_completions(0)
+    {
+    }
+
+    void start(std::shared_ptr<MemoryPipe> pipe)
+    {
+        m_pipe = pipe;
+        if (m_client)
+            send();
+        else
+            read(0);
+    }
+
+    void handleDidClose(MemoryPipe*) override
+    {
+        record(~0u, 0);
+        --m_open;
+    }
+    void handleDidRead(MemoryPipe*, size_t) override
+    {
+    }
+    void handleDidWrite(MemoryPipe*, size_t) override
+    {
+    }
+
+    void handleCompletion(MemoryPipe*, MemoryPipe::ErrorCode error, size_t size) override
+    {
+        record(error, size);
+        ++m_completions;
+        if (error != NonblockIoHandle::Complete || (m_reading && !size)) {
+            m_pipe->close();
+            return;
+        }
+
+        if (!m_reading) {
+            // Writes may be cut short by a fault.
+            m_written += size;
+            if (m_written < m_toWrite)
+                issue(m_pipe->write(&m_buffer[m_written], m_toWrite - m_written, this));
+            else
+                read(0);
+            return;
+        }
+
+        if (!m_client) {
+            m_toWrite = size;
+            write();
+            return;
+        }
+
+        m_received += size;
+        if (m_received < m_buffer.size()) {
+            read(m_received);
+            return;
+        }
+
+        m_latency.record(ticksToMicroseconds(currentTicks() - m_sendTime));
+        if (++m_exchanges == m_maxExchanges || m_stopping) {
+            m_pipe->close();
+            return;
+        }
+        send();
+    }
+
+    ULONGLONG exchanges() const { return m_exchanges; }
+    ULONGLONG completions() const { return m_completions; }
+    size_t messageSize() const { return m_buffer.size(); }
+    const Histogram& latency() const { return m_latency; }
+
+private:
+    void send()
+    {
+        m_sendTime = currentTicks();
+        m_toWrite = m_buffer.size();
+        write();
+    }
+
+    void write()
+    {
+        m_reading = false;
+        m_written = 0;
+        issue(m_pipe->write(&m_buffer[0], m_toWrite, this));
+    }
+
+    void read(size_t offset)
+    {
+        m_reading = true;
+        m_received = offset;
+        issue(m_pipe->read(&m_buffer[offset], m_buffer.size() - offset, this));
+    }
+
+    void issue(std::pair<MemoryPipe::ErrorCode, size_t> result)
+    {
+        if (result.first > NonblockIoHandle::Pending)
+            m_pipe->close();
+    }
+
+    // FNV-1a over the peer, the outcome and the size of each completion.
+    void record(unsigned event, size_t size)
+    {
+        if (!m_digest)
+            return;
+
+        ULONGLONG values[3] = { m_id, event, size };
+        for (size_t i = 0; i < 3; ++i)
+            *m_digest = (*m_digest ^ values[i]) * 1099511628211ULL;
+    }
+
+    unsigned m_id;
+    bool m_client;
+    std::vector<char> m_buffer;
+    std::shared_ptr<MemoryPipe> m_pipe;
+    std::atomic<unsigned>& m_open;
+    const std::atomic<bool>& m_stopping;
+    unsigned m_maxExchanges;
+    ULONGLONG* m_digest;
+    bool m_reading;
+    size_t m_received;
+    size_t m_toWrite;
+    size_t m_written;
+    LONGLONG m_sendTime;
+    ULONGLONG m_exchanges;
+    ULONGLONG m_completions;
+    Histogram m_latency;
+};
+
+// Ping-pong over -connections memory pipe pairs on a port with -threads workers. There's no kernel I/O, so the round
+// trips measure the port's dispatch and the library's own overhead; compare with pingpong for what the network stack
+// adds. The completions the peers handled are added to |completions| when it's given.
+static bool runMemory(const Options& options, Result& result, ULONGLONG* completions = nullptr)
+{
+    std::shared_ptr<CompletionPort> port = createPort(options);
+    std::atomic<unsigned> open(options.connections * 2);
+    std::atomic<bool> stopping(false);
+
+    std::vector<std::unique_ptr<MemoryPeer>> peers;
+    std::vector<std::pair<std::shared_ptr<MemoryPipe>, std::shared_ptr<MemoryPipe>>> pairs;
+    for (unsigned i = 0; i < options.connections; ++i) {
+        MemoryPeer* client = new MemoryPeer(i * 2, true, options.messageSize, open, stopping);
+        MemoryPeer* server = new MemoryPeer(i * 2 + 1, false, options.messageSize, open, stopping);
+        peers.push_back(std::unique_ptr<MemoryPeer>(client));
+        peers.push_back(std::unique_ptr<MemoryPeer>(server));
+        pairs.push_back(MemoryPipe::createPair(port, client, server));
+    }
+
+    LONGLONG startTime = currentTicks();
+    for (unsigned i = 0; i < options.connections; ++i) {
+        peers[i * 2 + 1]->start(pairs[i].second);
+        peers[i * 2]->start(pairs[i].first);
+    }
+
+    Sleep(options.seconds * 1000);
+    stopping = true;
+    while (open)
+        Sleep(1);
+    result.seconds = ticksToMicroseconds(currentTicks() - startTime) / 1e6;
+
+    for (unsigned i = 0; i < options.connections; ++i) {
+        MemoryPeer& client = *peers[i * 2];
+        result.operations += client.exchanges();
+        result.bytes += client.exchanges() * client.messageSize();
+        result.latency.merge(client.latency());
+    }
+    for (size_t i = 0; completions && i < peers.size(); ++i)
+        *completions += peers[i]->completions();
+
+    port->terminate();
+    return true;
+}
+
+// Runs the memory scenario and divides the processor time it took by the completions it dispatched, then times what
+// the port records for each completion with statistics compiled in: the submit, dispatch and callback timestamps,
+// the counters and the two histograms, plus a batch of one. The recording is timed apart from the run, on a cache
+// that's hot in a way the port's isn't, so the share it prints is an estimate; comparing memory results from builds
+// with and without statistics is the measurement.
+static bool runStatisticsOverhead(const Options& options, Result& result)
+{
+#if ENABLE_STATISTICS
+    static const unsigned kRecordings = 10 * 1000 * 1000;
+
+    ULONGLONG completions = 0;
+    double cpuStart = processorTime();
+    if (!runMemory(options, result, &completions) || !completions)
+        return false;
+    double completionNanoseconds = (processorTime() - cpuStart) * 1e9 / completions;
+
+    std::unique_ptr<WorkerStatistics> statistics(new WorkerStatistics);
+    LONGLONG startTime = currentTicks();
+    for (unsigned i = 0; i < kRecordings; ++i) {
+        LONGLONG submitTime = currentTicks();
+        LONGLONG dispatchTime = currentTicks();
+        statistics->completionLatency.record(ticksToMicroseconds(dispatchTime - submitTime));
+        ++statistics->completions;
+        statistics->bytesTransferred += options.messageSize;
+        statistics->callbackDuration.record(ticksToMicroseconds(currentTicks() - dispatchTime));
+        ++statistics->batches;
+        statistics->batchSize.record(1);
+    }
+    double recordingNanoseconds = ticksToMicroseconds(currentTicks() - startTime) * 1e3 / kRecordings;
+
+    fprintf(stderr, "Recording statistics takes about %.0f ns, against %.0f ns of processor time per completion (%.2f%%)\n",
+        recordingNanoseconds, completionNanoseconds, recordingNanoseconds / completionNanoseconds * 100);
+    return true;
+#else
+    fprintf(stderr, "Statistics are compiled out\n");
+    return false;
+#endif
+}
+
+// Runs -connections memory pipe pairs through a fixed number of exchanges with partial writes, resets and delayed
+// completions, on a manual port whose clock only moves when the port is idle, then does it all again with the same
+// -seed. The two runs must dispatch exactly the same completions; the digest identifies the run. The buffers are half
+// a message, so writes have to wait for the reader. Latency is the time per run.
+static bool runReplay(const Options& options, Result& result)
+{
+    static const unsigned kExchanges = 1000;
+    static const ULONGLONG kMaxSteps = 100000000;
+    static const MemoryPipe::FaultPlan kFaults = { 0.2, 0.0005, 0.1, 5 };
+
+    ULONGLONG digests[2];
+    LONGLONG startTime = currentTicks();
+    for (unsigned run = 0; run < 2; ++run) {
+        LONGLONG runTime = currentTicks();
+        ULONGLONG now = 0;
+        std::shared_ptr<CompletionPort> port = CompletionPort::createManual([&now] { return now; });
+        std::atomic<unsigned> open(options.connections * 2);
+        std::atomic<bool> stopping(false);
+        digests[run] = 14695981039346656037ULL;
+
+        std::vector<std::unique_ptr<MemoryPeer>> peers;
+        for (unsigned i = 0; i < options.connections; ++i) {
+            MemoryPeer* client = new MemoryPeer(i * 2, true, options.messageSize, open, stopping, kExchanges, &digests[run]);
+            MemoryPeer* server = new MemoryPeer(i * 2 + 1, false, options.messageSize, open, stopping, 0, &digests[run]);
+            peers.push_back(std::unique_ptr<MemoryPeer>(client));
+            peers.push_back(std::unique_ptr<MemoryPeer>(server));
+
+            std::pair<std::shared_ptr<MemoryPipe>, std::shared_ptr<MemoryPipe>> pair = MemoryPipe::createPair(port, client, server, options.messageSize / 2 + 1, &kFaults, options.seed + i);
+            server->start(pair.second);
+            client->start(pair.first);
+        }
+
+        ULONGLONG steps = 0;
+        for (; open && steps < kMaxSteps; ++steps) {
+            if (!port->runOnce(0))
+                ++now;
+        }
+        if (open) {
+            fprintf(stderr, "%u pipes were still open after %llu steps\n", static_cast<unsigned>(open), steps);
+            return false;
+        }
+        port->terminate();
+
+        // Resets cut some pairs short.
+        for (size_t i = 0; i < peers.size(); ++i) {
+            result.operations += peers[i]->completions();
+            result.bytes += peers[i]->exchanges() * peers[i]->messageSize();
+        }
+        result.latency.record(ticksToMicroseconds(currentTicks() - runTime));
+    }
+    result.seconds = ticksToMicroseconds(currentTicks() - startTime) / 1e6;
+
+    fprintf(stderr, "Seed %u: digests %016llx and %016llx\n", options.seed, digests[0], digests[1]);
+    if (digests[0] != digests[1]) {
+        fprintf(stderr, "The runs diverged\n");
+        return false;
+    }
+    return true;
+}
+
+// Counts the messages posted to it. Delivery is serialized, so only the count is read from other threads.
+class MessageCounter final : public CompletionKey {
+public:
+    MessageCounter()
+        : m_delivered(0)
+    {
+    }
+
+    void completionCallback(CompletionStatus*, size_t) override
+    {
+    }
+    void destroyKeyCallback() override
+    {
+    }
+    void messageCallback(void* payload) override
+    {
+        // Sampled messages carry the low bits of the tick count they were posted at.
+        if (payload)
+            m_latency.record(ticksToMicroseconds(static_cast<ULONG_PTR>(currentTicks()) - reinterpret_cast<ULONG_PTR>(payload)));
+        m_delivered.fetch_add(1, std::memory_order_release);
+    }
+
+    ULONGLONG delivered() const { return m_delivered.load(std::memory_order_acquire); }
+    const Histogram& latency() const { return m_latency; }
+
+private:
+    std::atomic<ULONGLONG> m_delivered;
+    Histogram m_latency;
+};
+
+// -connections producer threads post messages to one key on the port, one at a time with post() or, when -size is
+// more than one, in batches of -size with postBatch(). At most 64K messages are left undelivered at any time. Every
+// 1024th message of a producer is timed; latency is how long it took to be delivered.
+static bool runPost(const Options& options, Result& result)
+{
+    static const ULONGLONG kMaxUndelivered = 64 * 1024;
+    static const unsigned kSampleInterval = 1024;
+
+    std::shared_ptr<CompletionPort> port = createPort(options);
+    MessageCounter counter;
+    std::atomic<ULONGLONG> posted(0);
+    std::atomic<bool> stopping(false);
+    std::vector<std::thread> producers;
+    size_t batchSize = options.messageSize;
+
+    LONGLONG startTime = currentTicks();
+    for (unsigned i = 0; i < options.connections; ++i) {
+        producers.push_back(std::thread([&] {
+            std::vector<CompletionPort::Message> batch(batchSize);
+            unsigned sequence = 0;
+            while (!stopping) {
+                ULONGLONG delivered = counter.delivered();
+                if (posted > delivered + kMaxUndelivered) {
+                    SwitchToThread();
+                    continue;
+                }
+
+                for (size_t j = 0; j < batchSize; ++j) {
+                    batch[j].key = &counter;
+                    batch[j].payload = ++sequence % kSampleInterval ? nullptr : reinterpret_cast<void*>(static_cast<ULONG_PTR>(currentTicks()));
+                }
+                posted += batchSize;
+                if (batchSize == 1)
+                    port->post(batch[0].key, batch[0].payload);
+                else
+                    port->postBatch(&batch[0], batchSize);
+            }
+        }));
+    }
+
+    Sleep(options.seconds * 1000);
+    stopping = true;
+    for (size_t i = 0; i < producers.size(); ++i)
+        producers[i].join();
+    while (counter.delivered() < posted)
+        Sleep(1);
+    result.seconds = ticksToMicroseconds(currentTicks() - startTime) / 1e6;
+
+    result.operations = counter.delivered();
+    result.latency = counter.latency();
+    fprintf(stderr, "%.2f million messages per second\n", result.operations / result.seconds / 1e6);
+
+    port->terminate();
+    return true;
+}
+
+// Each of -threads threads allocates statuses in bursts of 16 and frees them again, first with new and delete, then
+// through a pool's shared list and last through per-thread caches in front of it, for -seconds each. The result is
+// the cached pool; the other two go to stderr for comparison. Latency is the time per 4096 bursts.
+static bool runStatusPool(const Options& options, Result& result)
+{
+    static const size_t kBurstSize = 16;
+    static const unsigned kBurstsPerSample = 4096;
+    enum Allocator { Heap, SharedList, Caches };
+    static const char* names[] = { "new and delete", "shared list", "per-thread caches" };
+
+    for (unsigned allocator = Heap; allocator <= Caches; ++allocator) {
+        CompletionStatusPool pool;
+        if (allocator == Caches)
+            pool.createCaches(options.threads);
+
+        std::vector<Result> results(options.threads);
+        std::vector<std::thread> threads;
+        std::atomic<bool> stopping(false);
+
+        LONGLONG startTime = currentTicks();
+        for (unsigned i = 0; i < options.threads; ++i) {
+            threads.push_back(std::thread([&, i] {
+                CompletionStatus* statuses[kBurstSize];
+                while (!stopping) {
+                    LONGLONG sampleTime = currentTicks();
+                    for (unsigned burst = 0; burst < kBurstsPerSample; ++burst) {
+                        for (size_t j = 0; j < kBurstSize; ++j) {
+                            if (allocator == Heap) {
+                                statuses[j] = new CompletionStatus;
+                                memset(statuses[j], 0, sizeof(CompletionStatus));
+                            } else if (allocator == SharedList)
+                                statuses[j] = pool.allocate();
+                            else
+                                statuses[j] = pool.allocate(i);
+                        }
+                        for (size_t j = 0; j < kBurstSize; ++j) {
+                            if (allocator == Heap)
+                                delete statuses[j];
+                            else if (allocator == SharedList)
+                                pool.free(statuses[j]);
+                            else
+                                pool.free(i, statuses[j]);
+                        }
+                    }
+                    results[i].latency.record(ticksToMicroseconds(currentTicks() - sampleTime));
+                    results[i].operations += kBurstsPerSample * kBurstSize;
+                }
+            }));
+        }
+
+        Sleep(options.seconds * 1000);
+        stopping = true;
+        for (size_t i = 0; i < threads.size(); ++i)
+            threads[i].join();
+
+        Result variant;
+        variant.seconds = ticksToMicroseconds(currentTicks() - startTime) / 1e6;
+        for (size_t i = 0; i < results.size(); ++i) {
+            variant.operations += results[i].operations;
+            variant.latency.merge(results[i].latency);
+        }
+        fprintf(stderr, "%s: %.1f million allocations per second", names[allocator], variant.operations / variant.seconds / 1e6);
+        if (allocator != Heap)
+            fprintf(stderr, ", %llu hits, %llu misses", static_cast<ULONGLONG>(pool.hits()), static_cast<ULONGLONG>(pool.misses()));
+        fprintf(stderr, "\n");
+
+        if (allocator == Caches)
+            result = variant;
+    }
+
+    return true;
+}
+
+// Arms -connections timers on a manual port, a quarter on each level of the wheel and none more than 2^26
+// milliseconds out, cancels every other one and then steps the simulated clock forward in random strides of up to
+// 256 milliseconds until all of them are due. Every timer left armed has to fire exactly once, in the stride its
+// expiration falls in and in expiration order, across cascades from the upper levels. Then a real port fires 1000
+// timers due within two seconds; the latency histogram holds how late they were, in microseconds, which includes the
+// granularity of the system tick count. Operations are the arms, cancels and expirations on the manual port.
+static bool runTimers(const Options& options, Result& result)
+{
+    static const unsigned kLevels = 4;
+    static const DWORD kMaxDelay = 1 << 26;
+    static const unsigned kMaxStride = 256;
+    static const unsigned kAccuracyTimers = 1000;
+    static const DWORD kAccuracySpan = 2000;
+
+    ULONGLONG now = 0;
+    ULONGLONG previousNow = 0;
+    ULONGLONG lastExpiration = 0;
+    ULONGLONG fired = 0;
+    ULONGLONG misfired = 0;
+    std::shared_ptr<CompletionPort> manualPort = CompletionPort::createManual([&now] { return now; });
+
+    unsigned count = options.connections;
+    std::mt19937 random(options.seed);
+    std::vector<DWORD> delays(count);
+    std::vector<std::unique_ptr<CompletionPort::Timer>> timers(count);
+    DWORD maxDelay = 0;
+    for (unsigned i = 0; i < count; ++i) {
+        unsigned level = random() % kLevels;
+        DWORD low = level ? 1 << (8 * level) : 1;
+        DWORD high = static_cast<DWORD>(std::min<ULONGLONG>(1ULL << (8 * level + 8), kMaxDelay));
+        delays[i] = low + random() % (high - low);
+        maxDelay = std::max(maxDelay, delays[i]);
+
+        bool cancelled = i % 2;
+        timers[i].reset(new CompletionPort::Timer([&, i, cancelled] {
+            ULONGLONG expiration = timers[i]->expiration();
+            if (cancelled || expiration > now || expiration <= previousNow || expiration < lastExpiration)
+                ++misfired;
+            lastExpiration = expiration;
+            ++fired;
+        }));
+    }
+
+    LONGLONG startTime = currentTicks();
+    for (unsigned i = 0; i < count; ++i)
+        manualPort->armTimer(timers[i].get(), delays[i]);
+    LONGLONG armedTime = currentTicks();
+    for (unsigned i = 1; i < count; i += 2)
+        manualPort->cancelTimer(timers[i].get());
+    LONGLONG cancelledTime = currentTicks();
+
+    while (now <= maxDelay) {
+        previousNow = now;
+        now += 1 + random() % kMaxStride;
+        manualPort->runOnce(0);
+    }
+    LONGLONG firedTime = currentTicks();
+    manualPort->terminate();
+
+    unsigned cancelledCount = count / 2;
+    result.seconds = ticksToMicroseconds(firedTime - startTime) / 1e6;
+    result.operations = count + cancelledCount + fired;
+    fprintf(stderr, "arm: %.0f ns, cancel: %.0f ns, %.1f million expirations per second\n",
+        ticksToMicroseconds(armedTime - startTime) * 1e3 / count, ticksToMicroseconds(cancelledTime - armedTime) * 1e3 / std::max(cancelledCount, 1u),
+        fired / std::max(ticksToMicroseconds(firedTime - cancelledTime) / 1e6, 1e-6) / 1e6);
+
+    if (misfired || fired != count - cancelledCount) {
+        fprintf(stderr, "%llu of %u timers fired, %llu of them out of order, early, late or after being cancelled\n", fired, count - cancelledCount, misfired);
+        return false;
+    }
+
+    // Callbacks run on any of the workers.
+    std::shared_ptr<CompletionPort> port = createPort(options);
+    std::mutex lock;
+    std::atomic<unsigned> accurateFired(0);
+    std::vector<LONGLONG> dueTimes(kAccuracyTimers);
+    std::vector<std::unique_ptr<CompletionPort::Timer>> accuracyTimers(kAccuracyTimers);
+    for (unsigned i = 0; i < kAccuracyTimers; ++i) {
+        accuracyTimers[i].reset(new CompletionPort::Timer([&, i] {
+            LONGLONG lateness = currentTicks() - dueTimes[i];
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                result.latency.record(lateness > 0 ? ticksToMicroseconds(lateness) : 0);
+            }
+            ++accurateFired;
+        }));
+    }
+    for (unsigned i = 0; i < kAccuracyTimers; ++i) {
+        DWORD delay = 1 + random() % kAccuracySpan;
+        dueTimes[i] = currentTicks() + microsecondsToTicks(delay * 1000ULL);
+        port->armTimer(accuracyTimers[i].get(), delay);
+    }
+
+    ULONGLONG deadline = GetTickCount64() + kAccuracySpan * 5;
+    while (accurateFired < kAccuracyTimers && GetTickCount64() < deadline)
+        Sleep(10);
+    for (unsigned i = 0; i < kAccuracyTimers; ++i)
+        port->cancelTimer(accuracyTimers[i].get());
+    port->terminate();
+
+    if (accurateFired < kAccuracyTimers) {
+        fprintf(stderr, "Only %u of %u timers fired on the real port\n", static_cast<unsigned>(accurateFired), kAccuracyTimers);
+        return false;
+    }
+    return true;
+}
+
+static void writeResult(FILE* file, const Options& options, const Result& result, bool header)
+{
+    double operationsPerSecond = result.seconds > 0 ? result.operations / result.seconds : 0;
+    double megabytesPerSecond = result.seconds > 0 ? result.bytes / result.seconds / (1024 * 1024) : 0;
+    double cpuSecondsPerGigabyte = result.bytes ? result.cpuSeconds / (result.bytes / (1024.0 * 1024 * 1024)) : 0;
+
+    if (options.json) {
+        _ftprintf(file, _T("{ \"scenario\": \"%s\", \"messageSize\": %u, \"connections\": %u, \"threads\": %u, \"wait\": \"%s\", \"fair\": %u, "),
+            options.scenario, static_cast<unsigned>(options.messageSize), options.connections, options.threads, options.wait, options.fair);
+        fprintf(file, "\"seconds\": %.3f, \"operations\": %llu, \"bytes\": %llu, \"operationsPerSecond\": %.1f, "
+            "\"megabytesPerSecond\": %.2f, \"cpuSeconds\": %.3f, \"cpuSecondsPerGigabyte\": %.3f, "
+            "\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu }\n",
+            result.seconds, result.operations, result.bytes, operationsPerSecond, megabytesPerSecond,
+            result.cpuSeconds, cpuSecondsPerGigabyte,
+            result.latency.percentile(50), result.latency.percentile(90), result.latency.percentile(99),
+            result.latency.percentile(99.9), result.latency.max());
+        return;
+    }
+
+    if (header) {
+        fprintf(file, "scenario,messageSize,connections,threads,wait,fair,seconds,operations,bytes,operationsPerSecond,"
+            "megabytesPerSecond,cpuSeconds,cpuSecondsPerGigabyte,p50,p90,p99,p999,max\n");
+    }
+    _ftprintf(file, _T("%s,%u,%u,%u,%s,%u,"), options.scenario, static_cast<unsigned>(options.messageSize), options.connections, options.threads, options.wait, options.fair);
+    fprintf(file, "%.3f,%llu,%llu,%.1f,%.2f,%.3f,%.3f,%llu,%llu,%llu,%llu,%llu\n",
+        result.seconds, result.operations, result.bytes, operationsPerSecond, megabytesPerSecond,
+        result.cpuSeconds, cpuSecondsPerGigabyte,
+        result.latency.percentile(50), result.latency.percentile(90), result.latency.percentile(99),
+        result.latency.percentile(99.9), result.latency.max());
+}
+
+static int usage()
+{
+    fprintf(stderr,
+        "usage: benchmark <pingpong|throughput|fanin|rps|sharded|mixed|churn|drain> [-size bytes] [-connections count]\n"
+        "                 [-threads count] [-seconds count] [-format csv|json] [-output path]\n"
+        "       benchmark accept [-connections threads] [-threads count] [-seconds count] [-format csv|json] [-output path]\n"
+        "       benchmark registry [-connections handles] [-threads count] [-seconds count] [-format csv|json] [-output path]\n"
+        "       benchmark <seqread|randread> [-size bytes] [-connections depth] [-threads count] [-filesize megabytes]\n"
+        "                 [-unbuffered 0|1] [-seconds count] [-format csv|json] [-output path]\n"
+        "       benchmark <handlers|callbacks> [-size bytes] [-connections count] [-threads count] [-seconds count]\n"
+        "                 [-format csv|json] [-output path]\n"
+        "       benchmark <tasks|pooltasks> [-size bytes] [-connections count] [-threads count] [-seconds count]\n"
+        "                 [-format csv|json] [-output path]\n"
+        "       benchmark streamread [-connections depth] [-threads count] [-seconds count] [-format csv|json] [-output path]\n"
+        "       benchmark udp [-size bytes] [-connections senders] [-threads count] [-seconds count] [-format csv|json]\n"
+        "                 [-output path]\n"
+        "       benchmark <lengthframes|varintframes|lineframes> [-size bytes] [-seconds count] [-format csv|json]\n"
+        "                 [-output path]\n"
+        "       benchmark <memory|statsoverhead> [-size bytes] [-connections count] [-threads count] [-seconds count]\n"
+        "                 [-format csv|json] [-output path]\n"
+        "       benchmark replay [-size bytes] [-connections count] [-seed number] [-format csv|json] [-output path]\n"
+        "       benchmark <framecopy|framewritev> [-size payload] [-connections count] [-threads count] [-seconds count]\n"
+        "                 [-format csv|json] [-output path]\n"
+        "       benchmark timers [-connections timers] [-threads count] [-seed number] [-format csv|json] [-output path]\n"
+        "       benchmark post [-size batch] [-connections producers] [-threads count] [-seconds count] [-format csv|json]\n"
+        "                 [-output path]\n"
+        "       benchmark statuspool [-threads count] [-seconds count] [-format csv|json] [-output path]\n"
+        "       benchmark <slowreader|smallwrites|coalesced> [-size bytes] [-threads count] [-seconds count]\n"
+        "                 [-format csv|json] [-output path]\n"
+        "       benchmark <transmit|copy> [-size chunk] [-connections count] [-threads count] [-filesize megabytes]\n"
+        "                 [-seconds count] [-format csv|json] [-output path]\n"
+        "Every scenario also takes [-wait blocking|spin|busy] [-spin microseconds] to set how the workers wait, and\n"
+        "[-fair count] to turn on fair dispatch with a cap of count completions per handle and batch.\n"
+        "Latencies are reported in microseconds. Results are appended to the output file, if one is given.\n");
+    return 1;
+}
+
+int _tmain(int argc, _TCHAR* argv[])
+{
+    if (argc < 2)
+        return usage();
+
+    // Defaults per scenario: message size and connection count.
+    static const struct {
+        const _TCHAR* name;
+        size_t messageSize;
+        unsigned connections;
+    } scenarios[] = {
+        { _T("pingpong"), 64, 1 },
+        { _T("throughput"), 64 * 1024, 1 },
+        { _T("fanin"), 64, 10000 },
+        { _T("rps"), 64, 256 },
+        { _T("mixed"), 64, 16 },
+        { _T("tasks"), 64, 64 },
+        { _T("pooltasks"), 64, 64 },
+        { _T("handlers"), 64, 16 },
+        { _T("callbacks"), 64, 16 },
+        { _T("streamread"), 64 * 1024, 4 },
+        { _T("sharded"), 64, 256 },
+        { _T("churn"), 64, 4 },
+        { _T("accept"), 64, 4 },
+        { _T("registry"), 64, 256 },
+        { _T("drain"), 16 * 1024, 64 },
+        { _T("seqread"), 1024 * 1024, 8 },
+        { _T("randread"), 4096, 32 },
+        { _T("transmit"), 1024 * 1024, 1 },
+        { _T("copy"), 1024 * 1024, 1 },
+        { _T("udp"), 64, 4 },
+        { _T("slowreader"), 16 * 1024, 1 },
+        { _T("smallwrites"), 64, 1 },
+        { _T("coalesced"), 64, 1 },
+        { _T("lengthframes"), 64, 1 },
+        { _T("varintframes"), 64, 1 },
+        { _T("lineframes"), 64, 1 },
+        { _T("memory"), 64, 1 },
+        { _T("statsoverhead"), 64, 1 },
+        { _T("replay"), 64, 16 },
+        { _T("post"), 1, 4 },
+        { _T("statuspool"), 64, 1 },
+        { _T("timers"), 64, 1000000 },
+        { _T("framecopy"), 16 * 1024, 16 },
+        { _T("framewritev"), 16 * 1024, 16 },
+    };
+
+    Options options = { argv[1], 0, 0, 2, 10, 1024, false, false, nullptr, _T("blocking"), 50, 1, 0 };
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); ++i) {
+        if (!_tcscmp(options.scenario, scenarios[i].name)) {
+            options.messageSize = scenarios[i].messageSize;
+            options.connections = scenarios[i].connections;
+        }
+    }
+    if (!options.messageSize)
+        return usage();
+
+    for (int i = 2; i + 1 < argc; i += 2) {
+        if (!_tcscmp(argv[i], _T("-size")))
+            options.messageSize = _ttoi(argv[i + 1]);
+        else if (!_tcscmp(argv[i], _T("-connections")))
+            options.connections = _ttoi(argv[i + 1]);
+        else if (!_tcscmp(argv[i], _T("-threads")))
+            options.threads = _ttoi(argv[i + 1]);
+        else if (!_tcscmp(argv[i], _T("-seconds")))
+            options.seconds = _ttoi(argv[i + 1]);
+        else if (!_tcscmp(argv[i], _T("-filesize")))
+            options.fileSize = _ttoi(argv[i + 1]);
+        else if (!_tcscmp(argv[i], _T("-unbuffered")))
+            options.unbuffered = !!_ttoi(argv[i + 1]);
+        else if (!_tcscmp(argv[i], _T("-format")))
+            options.json = !_tcscmp(argv[i + 1], _T("json"));
+        else if (!_tcscmp(argv[i], _T("-output")))
+            options.output = argv[i + 1];
+        else if (!_tcscmp(argv[i], _T("-wait")))
+            options.wait = argv[i + 1];
+        else if (!_tcscmp(argv[i], _T("-spin")))
+            options.spinMicroseconds = _ttoi(argv[i + 1]);
+        else if (!_tcscmp(argv[i], _T("-seed")))
+            options.seed = _ttoi(argv[i + 1]);
+        else if (!_tcscmp(argv[i], _T("-fair")))
+            options.fair = _ttoi(argv[i + 1]);
+        else
+            return usage();
+    }
+    if (_tcscmp(options.wait, _T("blocking")) && _tcscmp(options.wait, _T("spin")) && _tcscmp(options.wait, _T("busy")))
+        return usage();
+    if (!options.messageSize || !options.connections || !options.threads || !options.fileSize)
+        return usage();
+
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+        return 1;
+
+    Result result;
+    bool succeeded;
+    double cpuStart = processorTime();
+    if (!_tcscmp(options.scenario, _T("churn")))
+        succeeded = runChurn(options, result);
+    else if (!_tcscmp(options.scenario, _T("mixed")))
+        succeeded = runMixed(options, result);
+    else if (!_tcscmp(options.scenario, _T("streamread")))
+        succeeded = runStreamRead(options, result);
+    else if (!_tcscmp(options.scenario, _T("tasks")) || !_tcscmp(options.scenario, _T("pooltasks")))
+        succeeded = runTasks(options, !_tcscmp(options.scenario, _T("pooltasks")), result);
+    else if (!_tcscmp(options.scenario, _T("handlers")) || !_tcscmp(options.scenario, _T("callbacks")))
+        succeeded = runCompletionStyle(options, !_tcscmp(options.scenario, _T("callbacks")), result);
+    else if (!_tcscmp(options.scenario, _T("accept")))
+        succeeded = runAccept(options, result);
+    else if (!_tcscmp(options.scenario, _T("registry")))
+        succeeded = runRegistry(options, result);
+    else if (!_tcscmp(options.scenario, _T("drain")))
+        succeeded = runDrain(options, result);
+    else if (!_tcscmp(options.scenario, _T("seqread")) || !_tcscmp(options.scenario, _T("randread")))
+        succeeded = runFile(options, !_tcscmp(options.scenario, _T("seqread")), result);
+    else if (!_tcscmp(options.scenario, _T("slowreader")))
+        succeeded = runSlowReader(options, result);
+    else if (!_tcscmp(options.scenario, _T("smallwrites")) || !_tcscmp(options.scenario, _T("coalesced")))
+        succeeded = runSmallWrites(options, !_tcscmp(options.scenario, _T("coalesced")), result);
+    else if (!_tcscmp(options.scenario, _T("lengthframes")))
+        succeeded = runFraming(options, FrameFormat::fixedLength(4, options.messageSize), result);
+    else if (!_tcscmp(options.scenario, _T("varintframes")))
+        succeeded = runFraming(options, FrameFormat::varint(options.messageSize), result);
+    else if (!_tcscmp(options.scenario, _T("lineframes")))
+        succeeded = runFraming(options, FrameFormat::delimited("\r\n", 2, options.messageSize), result);
+    else if (!_tcscmp(options.scenario, _T("memory")))
+        succeeded = runMemory(options, result);
+    else if (!_tcscmp(options.scenario, _T("statsoverhead")))
+        succeeded = runStatisticsOverhead(options, result);
+    else if (!_tcscmp(options.scenario, _T("replay")))
+        succeeded = runReplay(options, result);
+    else if (!_tcscmp(options.scenario, _T("post")))
+        succeeded = runPost(options, result);
+    else if (!_tcscmp(options.scenario, _T("statuspool")))
+        succeeded = runStatusPool(options, result);
+    else if (!_tcscmp(options.scenario, _T("timers")))
+        succeeded = runTimers(options, result);
+    else if (!_tcscmp(options.scenario, _T("udp")))
+        succeeded = runDatagrams(options, result);
+    else if (!_tcscmp(options.scenario, _T("transmit")) || !_tcscmp(options.scenario, _T("copy")))
+        succeeded = runFileTransfer(options, !_tcscmp(options.scenario, _T("transmit")), result);
+    else if (!_tcscmp(options.scenario, _T("framecopy")) || !_tcscmp(options.scenario, _T("framewritev"))) {
+        bool vectored = !_tcscmp(options.scenario, _T("framewritev"));
+        size_t payloadSize = options.messageSize;
+        ClientFactory makeSender = [=](Run& run, std::shared_ptr<CompletionPort> port, SOCKET socket) -> Peer* {
+            return new FrameSender(run, port, socket, payloadSize, vectored);
+        };
+        succeeded = runConnections(options, true, makeSender, 0, result);
+    }
+    else {
+        bool echo = !!_tcscmp(options.scenario, _T("throughput"));
+        size_t messageSize = options.messageSize;
+        ClientFactory makeClient = [=](Run& run, std::shared_ptr<CompletionPort> port, SOCKET socket) -> Peer* {
+            return new Client(run, port, socket, messageSize, echo);
+        };
+        std::shared_ptr<PortGroup> group;
+        if (!_tcscmp(options.scenario, _T("sharded")) && !(group = createGroup(options)))
+            return 1;
+        succeeded = runConnections(options, echo, makeClient, 0, result, group);
+    }
+    result.cpuSeconds = processorTime() - cpuStart;
+
+    if (succeeded) {
+        FILE* file = stdout;
+        if (options.output && _tfopen_s(&file, options.output, _T("a")))
+            file = nullptr;
+        if (file) {
+            writeResult(file, options, result, !options.output || !ftell(file));
+            if (file != stdout)
+                fclose(file);
+        }
+    }
+
+    WSACleanup();
+    return succeeded ? 0 : 1;
+}
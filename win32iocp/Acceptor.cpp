@@ -0,0 +1,224 @@
+/*
+ * Copyright (C) 2016 Daewoong Jang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "Acceptor.h"
+
+#include <mswsock.h>
+
+std::shared_ptr<Acceptor> Acceptor::create(SOCKET socket, std::shared_ptr<CompletionPort> port, Client* client, NonblockIoHandle::Client* connectionClient, unsigned backlog)
+{
+    std::shared_ptr<Acceptor> acceptor(new Acceptor(socket, port, client, connectionClient, backlog));
+    acceptor->m_weakThis = acceptor;
+    if (!acceptor->m_acceptEx) {
+        closesocket(socket);
+        acceptor->m_closed = true;
+        return nullptr;
+    }
+
+    if (!port->add((HANDLE)socket, acceptor)) {
+        closesocket(socket);
+        acceptor->m_closed = true;
+        return nullptr;
+    }
+
+    for (size_t slot = 0; slot < acceptor->m_accepts.size(); ++slot) {
+        if (!acceptor->postAccept(slot))
+            acceptor->retryLater(slot);
+    }
+
+    return acceptor;
+}
+
+Acceptor::Acceptor(SOCKET socket, std::shared_ptr<CompletionPort> port, Client* client, NonblockIoHandle::Client* connectionClient, unsigned backlog)
+    : m_socket(socket)
+    , m_port(port)
+    , m_client(client)
+    , m_connectionClient(connectionClient)
+    , m_acceptEx(nullptr)
+    , m_accepts(backlog)
+    , m_pendingAccepts(0)
+    , m_closing(false)
+    , m_closed(false)
+    , m_didClose(false)
+    , m_retryTimer([this] { retryTimerFired(); })
+{
+    ASSERT(socket && socket != INVALID_SOCKET);
+    ASSERT(m_client);
+    ASSERT(m_connectionClient);
+    ASSERT(m_port);
+    ASSERT(backlog > 0);
+
+    for (size_t slot = 0; slot < m_accepts.size(); ++slot)
+        m_accepts[slot].socket = INVALID_SOCKET;
+
+    int protocolInfoSize = sizeof(m_protocolInfo);
+    if (getsockopt(m_socket, SOL_SOCKET, SO_PROTOCOL_INFO, reinterpret_cast<char*>(&m_protocolInfo), &protocolInfoSize) == SOCKET_ERROR)
+        return;
+
+    GUID acceptExGuid = WSAID_ACCEPTEX;
+    DWORD bytesReturned = 0;
+    if (WSAIoctl(m_socket, SIO_GET_EXTENSION_FUNCTION_POINTER, &acceptExGuid, sizeof(acceptExGuid), &m_acceptEx, sizeof(m_acceptEx), &bytesReturned, NULL, NULL) == SOCKET_ERROR)
+        m_acceptEx = nullptr;
+}
+
+Acceptor::~Acceptor()
+{
+    ASSERT(m_closed);
+    m_port->cancelTimer(&m_retryTimer);
+}
+
+void Acceptor::close()
+{
+    if (m_closed || m_closing.exchange(true))
+        return;
+
+    if (!m_port->close((HANDLE)m_socket))
+        m_closing = false;
+}
+
+bool Acceptor::postAccept(size_t slot)
+{
+    PendingAccept& accept = m_accepts[slot];
+    ASSERT(accept.socket == INVALID_SOCKET);
+
+    accept.socket = WSASocket(m_protocolInfo.iAddressFamily, m_protocolInfo.iSocketType, m_protocolInfo.iProtocol, NULL, 0, WSA_FLAG_OVERLAPPED);
+    if (accept.socket == INVALID_SOCKET)
+        return false;
+
+    CompletionStatus* status = m_port->allocateCompletionStatus();
+    status->sequence = slot;
+    ++m_pendingAccepts;
+
+    DWORD bytesReceived = 0;
+    LPFN_ACCEPTEX acceptEx = reinterpret_cast<LPFN_ACCEPTEX>(m_acceptEx);
+    if (!acceptEx(m_socket, accept.socket, accept.addresses, 0, kAddressLength, kAddressLength, &bytesReceived, status) && WSAGetLastError() != ERROR_IO_PENDING) {
+        --m_pendingAccepts;
+        m_port->freeCompletionStatus(status);
+        closesocket(accept.socket);
+        accept.socket = INVALID_SOCKET;
+        return false;
+    }
+
+    return true;
+}
+
+void Acceptor::didAccept(size_t slot)
+{
+    PendingAccept& accept = m_accepts[slot];
+    SOCKET socket = accept.socket;
+    accept.socket = INVALID_SOCKET;
+
+    if (setsockopt(socket, SOL_SOCKET, SO_UPDATE_ACCEPT_CONTEXT, reinterpret_cast<char*>(&m_socket), sizeof(m_socket)) == SOCKET_ERROR) {
+        closesocket(socket);
+        return;
+    }
+
+    // The port refuses new handles once it's shutting down.
+    std::shared_ptr<NonblockIoHandle> connection = NonblockIoHandle::create(socket, m_port, m_connectionClient);
+    if (connection)
+        m_client->handleDidAccept(this, connection);
+}
+
+void Acceptor::completionCallback(CompletionStatus* status, size_t)
+{
+    size_t slot = status->sequence;
+    DWORD bytesTransferred = 0;
+    DWORD flags = 0;
+    BOOL succeeded = WSAGetOverlappedResult(m_closed ? m_accepts[slot].socket : m_socket, status, &bytesTransferred, FALSE, &flags);
+    m_port->freeCompletionStatus(status);
+
+    if (succeeded && !m_closing)
+        didAccept(slot);
+    else {
+        closesocket(m_accepts[slot].socket);
+        m_accepts[slot].socket = INVALID_SOCKET;
+    }
+
+    // m_closing stays set once the close has been queued, so nothing is posted on a socket that's being closed.
+    if (!m_closing && !postAccept(slot))
+        retryLater(slot);
+
+    // The last accept aborted by closing the listening socket has come back; nothing refers to this anymore.
+    if (!--m_pendingAccepts && m_closed)
+        didClose();
+}
+
+void Acceptor::retryLater(size_t slot)
+{
+    std::lock_guard<std::mutex> lock(m_retryLock);
+    m_retrySlots.push_back(slot);
+    if (m_retrySlots.size() == 1)
+        m_port->armTimer(&m_retryTimer, kRetryDelay);
+}
+
+void Acceptor::retryTimerFired()
+{
+    std::shared_ptr<CompletionKey> protectedThis = m_weakThis.lock();
+    if (!protectedThis)
+        return;
+
+    std::vector<size_t> slots;
+    {
+        std::lock_guard<std::mutex> lock(m_retryLock);
+        slots.swap(m_retrySlots);
+    }
+
+    for (size_t i = 0; i < slots.size(); ++i) {
+        if (m_closing)
+            return;
+        if (!postAccept(slots[i]))
+            retryLater(slots[i]);
+    }
+}
+
+void Acceptor::destroyKeyCallback()
+{
+    // The local reference outlives a close finished early by the last aborted accept on another worker.
+    std::shared_ptr<CompletionKey> protectedThis = m_protectedThis = m_port->didClose((HANDLE)m_socket);
+    m_port->cancelTimer(&m_retryTimer);
+
+    // The socket value is left alone, since completions of aborted accepts may still be reading it; m_closed tells
+    // them it's gone.
+    m_closed = true;
+    closesocket(m_socket);
+
+    // Accepts still in flight are aborted and come back through completionCallback, which finishes the close.
+    if (!m_pendingAccepts)
+        didClose();
+}
+
+void Acceptor::didClose()
+{
+    // Both the close and the last aborted accept may get here when they race on different workers.
+    if (m_didClose.exchange(true))
+        return;
+
+    std::shared_ptr<CompletionKey> protectedThis;
+    protectedThis.swap(m_protectedThis);
+    m_client->handleDidClose(this);
+}
+
+void Acceptor::shutdownCallback(bool)
+{
+    close();
+}
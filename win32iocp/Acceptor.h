@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2016 Daewoong Jang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "includes.h"
+#include "CompletionPort.h"
+#include "NonblockIoHandle.h"
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <winsock2.h>
+
+// Keeps a number of AcceptEx calls posted on a listening socket. Every accepted socket is registered with the same
+// port as a NonblockIoHandle that reports to the connection client, and then handed to the acceptor's client.
+class Acceptor final : public CompletionKey {
+public:
+    class Client {
+    public:
+        virtual void handleDidAccept(Acceptor*, std::shared_ptr<NonblockIoHandle>) = 0;
+        virtual void handleDidClose(Acceptor*) = 0;
+    };
+
+    // Takes ownership of a bound socket that has already been put into the listening state. Returns null, with the
+    // socket closed, if AcceptEx is unavailable or the port has started shutting down.
+    static std::shared_ptr<Acceptor> create(SOCKET, std::shared_ptr<CompletionPort>, Client*, NonblockIoHandle::Client* connectionClient, unsigned backlog = 16);
+    ~Acceptor();
+
+    void close();
+
+private:
+    Acceptor(SOCKET, std::shared_ptr<CompletionPort>, Client*, NonblockIoHandle::Client*, unsigned backlog);
+
+    // AcceptEx wants room for both addresses plus 16 bytes each.
+    static const DWORD kAddressLength = sizeof(sockaddr_storage) + 16;
+
+    struct PendingAccept {
+        SOCKET socket;
+        char addresses[kAddressLength * 2];
+    };
+
+    bool postAccept(size_t slot);
+    void didAccept(size_t slot);
+    void didClose();
+
+    // Slots whose accept couldn't be posted, typically for lack of sockets or memory, are tried again after a while.
+    static const DWORD kRetryDelay = 500;
+    void retryLater(size_t slot);
+    void retryTimerFired();
+
+    void completionCallback(CompletionStatus*, size_t) override;
+    void destroyKeyCallback() override;
+    void shutdownCallback(bool immediately) override;
+
+    SOCKET m_socket;
+    std::shared_ptr<CompletionPort> m_port;
+    Client* m_client;
+    NonblockIoHandle::Client* m_connectionClient;
+    WSAPROTOCOL_INFO m_protocolInfo;
+    void* m_acceptEx;
+    std::vector<PendingAccept> m_accepts;
+    std::atomic<unsigned> m_pendingAccepts;
+    std::atomic<bool> m_closing;
+    std::atomic<bool> m_closed;
+    std::atomic<bool> m_didClose;
+    std::shared_ptr<CompletionKey> m_protectedThis;
+    std::weak_ptr<CompletionKey> m_weakThis;
+    std::mutex m_retryLock;
+    std::vector<size_t> m_retrySlots;
+    CompletionPort::Timer m_retryTimer;
+};
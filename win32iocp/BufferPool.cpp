@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2016 Daewoong Jang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "BufferPool.h"
+
+std::shared_ptr<BufferPool> BufferPool::create(size_t bufferSize, size_t bufferCount, bool lockPages)
+{
+    std::shared_ptr<BufferPool> pool(new BufferPool(bufferSize, bufferCount, lockPages));
+    if (!pool->m_slab || !pool->m_buffers)
+        return nullptr;
+
+    return pool;
+}
+
+BufferPool::BufferPool(size_t bufferSize, size_t bufferCount, bool lockPages)
+    : m_bufferSize(bufferSize)
+    , m_bufferCount(bufferCount)
+    , m_slabSize(bufferSize * bufferCount)
+    , m_slab(static_cast<char*>(VirtualAlloc(NULL, m_slabSize, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE)))
+    , m_buffers(static_cast<PooledBuffer*>(_aligned_malloc(sizeof(PooledBuffer) * bufferCount, MEMORY_ALLOCATION_ALIGNMENT)))
+    , m_locked(false)
+{
+    ASSERT(bufferSize && bufferCount);
+
+    InitializeSListHead(&m_freeList);
+
+    if (!m_slab || !m_buffers)
+        return;
+
+    if (lockPages)
+        m_locked = !!VirtualLock(m_slab, m_slabSize);
+
+    for (size_t i = bufferCount; i > 0; --i) {
+        PooledBuffer* buffer = &m_buffers[i - 1];
+        buffer->pool = this;
+        buffer->data = m_slab + (i - 1) * bufferSize;
+        buffer->capacity = bufferSize;
+        InterlockedPushEntrySList(&m_freeList, &buffer->entry);
+    }
+}
+
+BufferPool::~BufferPool()
+{
+    if (m_slab) {
+        if (m_locked)
+            VirtualUnlock(m_slab, m_slabSize);
+        VirtualFree(m_slab, 0, MEM_RELEASE);
+    }
+
+    _aligned_free(m_buffers);
+}
+
+PooledBuffer* BufferPool::acquire()
+{
+    PSLIST_ENTRY entry = InterlockedPopEntrySList(&m_freeList);
+    if (!entry)
+        return nullptr;
+
+    return CONTAINING_RECORD(entry, PooledBuffer, entry);
+}
+
+void BufferPool::release(PooledBuffer* buffer)
+{
+    if (!buffer)
+        return;
+
+    ASSERT(buffer->pool == this);
+    InterlockedPushEntrySList(&m_freeList, &buffer->entry);
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2016 Daewoong Jang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "includes.h"
+
+class BufferPool;
+
+// A lease on one fixed-size buffer of a BufferPool. Whoever holds the lease returns it with BufferPool::release().
+struct PooledBuffer {
+    SLIST_ENTRY entry;
+    BufferPool* pool;
+    char* data;
+    size_t capacity;
+};
+
+// Carves fixed-size buffers out of a single page-aligned slab. The slab is locked into physical memory when the
+// working set quota allows it, and used as plain memory otherwise. The pool must outlive all of its leases.
+// Buffers sit back to back in the slab, so a buffer size that's a multiple of the sector size gives buffers that
+// are suitable for unbuffered file I/O.
+class BufferPool final {
+public:
+    static std::shared_ptr<BufferPool> create(size_t bufferSize, size_t bufferCount, bool lockPages = true);
+    ~BufferPool();
+
+    PooledBuffer* acquire();
+    void release(PooledBuffer*);
+
+    size_t bufferSize() const { return m_bufferSize; }
+    size_t bufferCount() const { return m_bufferCount; }
+    bool isLocked() const { return m_locked; }
+
+private:
+    BufferPool(size_t bufferSize, size_t bufferCount, bool lockPages);
+
+    SLIST_HEADER m_freeList;
+    size_t m_bufferSize;
+    size_t m_bufferCount;
+    size_t m_slabSize;
+    char* m_slab;
+    PooledBuffer* m_buffers;
+    bool m_locked;
+};
@@ -23,15 +23,84 @@
 #include "CompletionPort.h"
 
 #include "NonblockIoHandle.h"
+#include <algorithm>
+#include <climits>
 
 static const LPOVERLAPPED kPerformClose = (LPOVERLAPPED)1;
+static const LPOVERLAPPED kPerformTerminate = (LPOVERLAPPED)2;
+static const LPOVERLAPPED kPerformWakeup = (LPOVERLAPPED)3;
+static const LPOVERLAPPED kPerformDeliverMessages = (LPOVERLAPPED)4;
 
-CompletionPort::CompletionPort()
-    : m_port(CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0))
+// Queued messages borrow slots from the completion status pool.
+struct QueuedMessage {
+    SLIST_ENTRY entry;
+    CompletionKey* key;
+    void* payload;
+};
+static_assert(sizeof(QueuedMessage) <= sizeof(CompletionStatus), "QueuedMessage must fit in a CompletionStatus slot");
+
+static __declspec(thread) CompletionPort* s_currentPort;
+static __declspec(thread) unsigned s_currentWorkerIndex;
+static __declspec(thread) CompletionPort::Timer* s_firingTimer;
+
+static DWORD_PTR nthProcessorInMask(DWORD_PTR affinityMask, unsigned n)
+{
+    unsigned processorCount = 0;
+    for (DWORD_PTR mask = affinityMask; mask; mask &= mask - 1)
+        ++processorCount;
+
+    n %= processorCount;
+    for (DWORD_PTR mask = affinityMask; mask; mask &= mask - 1) {
+        if (!n--)
+            return mask & ~(mask - 1);
+    }
+
+    return 0;
+}
+
+CompletionPort::CompletionPort(unsigned numberOfThreads, DWORD_PTR affinityMask, Clock clock)
+    : m_port(CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, std::max(numberOfThreads, 1u)))
     , m_error(0)
-    , m_thread(&CompletionPort::threadMain, this)
+    , m_clock(clock)
+    , m_timers(currentTime())
+    , m_scheduledWakeup(ULLONG_MAX)
+    , m_pendingTasks(0)
+    , m_sleepingWorkers(0)
+    , m_nextWorkerQueue(0)
+    , m_waitPolicy(Blocking)
+    , m_maxSpinTicks(0)
+    , m_maxCompletionsPerKey(0)
+    , m_fairQuantum(64 * 1024)
+    , m_messagesScheduled(false)
+    , m_handleCount(0)
+    , m_shuttingDown(false)
+    , m_closingKeys(0)
+    , m_writeBudget(0)
+    , m_writeBudgetUsed(0)
+    , m_hasWriteBudgetWaiters(false)
+#if ENABLE_STATISTICS
+    , m_startTime(currentTime())
+#endif
 {
-    m_thread.detach();
+    InitializeSListHead(&m_messages);
+
+    if (!m_port) {
+        handleError();
+        return;
+    }
+
+    // A manual port has the queue and statistics of a single worker, which belong to the thread running it.
+    unsigned numberOfQueues = std::max(numberOfThreads, 1u);
+    m_statusPool.createCaches(numberOfQueues);
+    for (unsigned i = 0; i < numberOfQueues; ++i)
+        m_workerQueues.push_back(std::unique_ptr<WorkerQueue>(new WorkerQueue));
+#if ENABLE_STATISTICS
+    for (unsigned i = 0; i < numberOfQueues; ++i)
+        m_workerStatistics.push_back(std::unique_ptr<WorkerStatistics>(new WorkerStatistics));
+#endif
+
+    for (unsigned i = 0; i < numberOfThreads; ++i)
+        m_threads.push_back(std::thread(&CompletionPort::threadMain, this, i, affinityMask ? nthProcessorInMask(affinityMask, i) : 0));
 }
 
 CompletionPort::~CompletionPort()
@@ -39,34 +108,128 @@ CompletionPort::~CompletionPort()
     terminate();
 }
 
+void CompletionPort::destroy(CompletionPort* port)
+{
+    // The worker finishes its callback and goes back to wait, where it picks up the terminate packet like the others.
+    if (s_currentPort == port && !port->m_threads.empty()) {
+        std::thread([port] { delete port; }).detach();
+        return;
+    }
+
+    delete port;
+}
+
 bool CompletionPort::add(HANDLE fileHandle, std::shared_ptr<CompletionKey> completionKey)
 {
     ASSERT(completionKey);
 
-    if (m_error)
+    if (m_error || m_shuttingDown)
         return false;
 
     if (fileHandle == INVALID_HANDLE_VALUE)
         return false;
 
-    ASSERT(m_keys.count(fileHandle) == 0);
-
-    m_keys[fileHandle] = completionKey;
+    KeyShard& shard = keyShard(fileHandle);
+    {
+        std::lock_guard<std::mutex> lock(shard.lock);
+        ASSERT(shard.keys.count(fileHandle) == 0);
+        shard.keys[fileHandle] = completionKey;
+    }
 
-    if (CreateIoCompletionPort(fileHandle, m_port, reinterpret_cast<ULONG_PTR>(completionKey.get()), 0) == INVALID_HANDLE_VALUE) {
+    if (!CreateIoCompletionPort(fileHandle, m_port, reinterpret_cast<ULONG_PTR>(completionKey.get()), 0)) {
         handleError();
+        std::lock_guard<std::mutex> lock(shard.lock);
+        shard.keys.erase(fileHandle);
+        return false;
+    }
+
+    ++m_handleCount;
+    return true;
+}
+
+// FileReplaceCompletionInformation is the only way to move a handle to another port, and it's only reachable through
+// the native API.
+struct FileCompletionInformation {
+    HANDLE port;
+    PVOID key;
+};
+
+struct IoStatusBlock {
+    union {
+        LONG status;
+        PVOID pointer;
+    };
+    ULONG_PTR information;
+};
+
+typedef LONG (NTAPI* NtSetInformationFileFunction)(HANDLE, IoStatusBlock*, PVOID, ULONG, int);
+static const int kFileReplaceCompletionInformation = 61;
+
+// Resolved while the module initializes, before any worker can migrate a handle. VS2013 doesn't make function-local
+// statics thread-safe, so it can't be done lazily on first use. ntdll is mapped into every process.
+static const NtSetInformationFileFunction s_ntSetInformationFile = reinterpret_cast<NtSetInformationFileFunction>(GetProcAddress(GetModuleHandle(TEXT("ntdll.dll")), "NtSetInformationFile"));
+
+static bool replaceCompletionPort(HANDLE fileHandle, HANDLE port, CompletionKey* completionKey)
+{
+    if (!s_ntSetInformationFile)
+        return false;
+
+    FileCompletionInformation information = { port, completionKey };
+    IoStatusBlock ioStatus;
+    return s_ntSetInformationFile(fileHandle, &ioStatus, &information, sizeof(information), kFileReplaceCompletionInformation) >= 0;
+}
+
+bool CompletionPort::migrate(HANDLE fileHandle, std::shared_ptr<CompletionPort> to)
+{
+    ASSERT(to && to.get() != this);
+
+    if (to->m_error || to->m_shuttingDown)
+        return false;
+
+    std::shared_ptr<CompletionKey> completionKey;
+    KeyShard& shard = keyShard(fileHandle);
+    {
+        std::lock_guard<std::mutex> lock(shard.lock);
+        ASSERT(shard.keys.count(fileHandle) == 1);
+        completionKey = shard.keys[fileHandle];
+    }
+
+    // The key is registered with both ports for a moment, so it stays alive whichever of them is looked at.
+    KeyShard& toShard = to->keyShard(fileHandle);
+    {
+        std::lock_guard<std::mutex> lock(toShard.lock);
+        ASSERT(toShard.keys.count(fileHandle) == 0);
+        toShard.keys[fileHandle] = completionKey;
+    }
+
+    if (!replaceCompletionPort(fileHandle, to->m_port, completionKey.get())) {
+        std::lock_guard<std::mutex> lock(toShard.lock);
+        toShard.keys.erase(fileHandle);
         return false;
     }
 
+    {
+        std::lock_guard<std::mutex> lock(shard.lock);
+        shard.keys.erase(fileHandle);
+    }
+    --m_handleCount;
+    ++to->m_handleCount;
     return true;
 }
 
 bool CompletionPort::close(HANDLE fileHandle)
 {
     ASSERT(fileHandle);
-    ASSERT(m_keys.count(fileHandle) == 1);
 
-    if (!PostQueuedCompletionStatus(m_port, 0, reinterpret_cast<ULONG_PTR>(m_keys[fileHandle].get()), kPerformClose)) {
+    CompletionKey* completionKey;
+    {
+        KeyShard& shard = keyShard(fileHandle);
+        std::lock_guard<std::mutex> lock(shard.lock);
+        ASSERT(shard.keys.count(fileHandle) == 1);
+        completionKey = shard.keys[fileHandle].get();
+    }
+
+    if (!PostQueuedCompletionStatus(m_port, 0, reinterpret_cast<ULONG_PTR>(completionKey), kPerformClose)) {
         ASSERT_NOT_REACHED();
         handleError();
         return false;
@@ -75,61 +238,869 @@ bool CompletionPort::close(HANDLE fileHandle)
     return true;
 }
 
-void CompletionPort::didClose(HANDLE fileHandle)
+bool CompletionPort::postCompletion(CompletionKey* completionKey, CompletionStatus* status, DWORD numberOfBytesTransferred)
+{
+    ASSERT(completionKey && status);
+
+    if (!PostQueuedCompletionStatus(m_port, numberOfBytesTransferred, reinterpret_cast<ULONG_PTR>(completionKey), status)) {
+        handleError();
+        return false;
+    }
+
+    return true;
+}
+
+bool CompletionPort::closeKey(CompletionKey* completionKey)
+{
+    ASSERT(completionKey);
+
+    if (!PostQueuedCompletionStatus(m_port, 0, reinterpret_cast<ULONG_PTR>(completionKey), kPerformClose)) {
+        handleError();
+        return false;
+    }
+
+    return true;
+}
+
+std::shared_ptr<CompletionKey> CompletionPort::didClose(HANDLE fileHandle)
 {
     ASSERT(fileHandle);
-    ASSERT(m_keys.count(fileHandle) == 1);
 
-    m_keys.erase(fileHandle);
+    KeyShard& shard = keyShard(fileHandle);
+    std::lock_guard<std::mutex> lock(shard.lock);
+    ASSERT(shard.keys.count(fileHandle) == 1);
+
+    std::shared_ptr<CompletionKey> completionKey;
+    completionKey.swap(shard.keys[fileHandle]);
+    shard.keys.erase(fileHandle);
+    --m_handleCount;
+
+    // Handed back through an aliasing pointer, so that the port knows when the key has let go of it.
+    std::shared_ptr<ClosingKey> closingKey = std::make_shared<ClosingKey>(m_closingKeys, completionKey);
+    return std::shared_ptr<CompletionKey>(closingKey, completionKey.get());
 }
 
 void CompletionPort::terminate()
 {
-    ASSERT(m_keys.size() == 0);
+    if (!m_port)
+        return;
+
+    ASSERT(numberOfKeys() == 0);
+    stopWorkers();
+}
+
+bool CompletionPort::shutdown(DWORD milliseconds)
+{
+    // How long keys get to close once they've been told to close immediately.
+    static const DWORD kForcedCloseGracePeriod = 1000;
+
+    if (!m_port)
+        return true;
+
+    ASSERT(s_currentPort != this);
+    m_shuttingDown = true;
+
+    // Shutdown deadlines are wall clock time, even when the timers follow a clock of their own. The tasks keep the keys
+    // alive until their callbacks have run.
+    ULONGLONG deadline = systemTime() + milliseconds;
+    std::vector<std::pair<HANDLE, std::shared_ptr<CompletionKey>>> keys = registeredKeys();
+    for (size_t i = 0; i < keys.size(); ++i) {
+        std::shared_ptr<CompletionKey> key = keys[i].second;
+        post([key] { key->shutdownCallback(false); });
+    }
+    keys.clear();
+
+    bool drained = waitUntilDrained(deadline);
+    if (!drained) {
+        keys = registeredKeys();
+        for (size_t i = 0; i < keys.size(); ++i) {
+#if (_WIN32_WINNT >= 0x0600)
+            CancelIoEx(keys[i].first, NULL);
+#endif
+            std::shared_ptr<CompletionKey> key = keys[i].second;
+            post([key] { key->shutdownCallback(true); });
+        }
+        keys.clear();
+
+        drained = waitUntilDrained(systemTime() + kForcedCloseGracePeriod);
+    }
+
+    stopWorkers();
+    return drained;
+}
+
+void CompletionPort::stopWorkers()
+{
+    // Completions queued ahead of the terminate packets are still delivered.
+    for (size_t i = 0; i < m_threads.size(); ++i)
+        PostQueuedCompletionStatus(m_port, 0, 0, kPerformTerminate);
+
+    for (auto& thread : m_threads) {
+        ASSERT(thread.get_id() != std::this_thread::get_id());
+        thread.join();
+    }
+    m_threads.clear();
 
     CloseHandle(m_port);
+    m_port = 0;
 }
 
-int CompletionPort::threadMain()
+int CompletionPort::threadMain(unsigned index, DWORD_PTR affinityMask)
 {
+    if (affinityMask)
+        SetThreadAffinityMask(GetCurrentThread(), affinityMask);
+
+    s_currentPort = this;
+    s_currentWorkerIndex = index;
+
 #if (_WIN32_WINNT >= 0x0600)
-    static const ULONG maxRemoveEntries = 256;
+    static const ULONG maxRemoveEntries = kMaxBatchSize;
     ULONG removedEntries = 0;
+    ULONG carriedEntries = 0;
     OVERLAPPED_ENTRY overlappedEntries[maxRemoveEntries];
+    SpinState spinState = { 0, m_maxSpinTicks };
 
-    while (GetQueuedCompletionStatusEx(m_port, overlappedEntries, maxRemoveEntries, &removedEntries, INFINITE, TRUE)) {
-        for (ULONG i = 0; i < removedEntries; ++i) {
-            OVERLAPPED_ENTRY& entry = overlappedEntries[i];
-            CompletionKey* completionKey = reinterpret_cast<CompletionKey*>(entry.lpCompletionKey);
-            if (!completionKey)
-                continue;
+    for (;;) {
+        // Completions held over by fair dispatch are waiting already, so only take what has been queued behind them.
+        BOOL succeeded = TRUE;
+        removedEntries = 0;
+        if (!carriedEntries)
+            succeeded = waitForCompletions(index, overlappedEntries, maxRemoveEntries, removedEntries, spinState);
+        else if (carriedEntries < maxRemoveEntries)
+            succeeded = GetQueuedCompletionStatusEx(m_port, overlappedEntries + carriedEntries, maxRemoveEntries - carriedEntries, &removedEntries, 0, FALSE);
+        if (!succeeded) {
+            DWORD error = GetLastError();
+            if (error != WAIT_TIMEOUT && error != WAIT_IO_COMPLETION)
+                break;
+            removedEntries = 0;
+        }
 
-            if (entry.lpOverlapped == kPerformClose)
-                completionKey->destroyKeyCallback();
-            else
-                completionKey->completionCallback(reinterpret_cast<CompletionStatus*>(entry.lpOverlapped), entry.dwNumberOfBytesTransferred);
+        ULONG entryCount = carriedEntries + removedEntries;
+        unsigned terminatePackets = 0;
+        if (m_maxCompletionsPerKey || carriedEntries)
+            carriedEntries = dispatchFairly(index, overlappedEntries, entryCount, terminatePackets);
+        else
+            terminatePackets = dispatchBatch(index, overlappedEntries, entryCount);
+
+        // One batch can take the terminate packets meant for other workers as well. This worker keeps one and hands
+        // the rest back, or the others would never wake up to exit.
+        if (terminatePackets) {
+            while (--terminatePackets)
+                PostQueuedCompletionStatus(m_port, 0, 0, kPerformTerminate);
+            return 0;
         }
+
+#if ENABLE_STATISTICS
+        WorkerStatistics& statistics = *m_workerStatistics[index];
+        if (removedEntries) {
+            ++statistics.batches;
+            statistics.batchSize.record(removedEntries);
+        }
+        statistics.deferredCompletions += carriedEntries;
+#endif
+
+        fireTimers();
+        runTasks(index);
     }
 #else
     DWORD numberOfBytesTransferred;
     ULONG_PTR statusCompletionKey;
     LPOVERLAPPED overlapped;
 
-    while (GetQueuedCompletionStatus(m_port, &numberOfBytesTransferred, &statusCompletionKey, &overlapped, INFINITE)) {
-        CompletionKey* completionKey = reinterpret_cast<CompletionKey*>(statusCompletionKey);
-        if (!completionKey)
+    for (;;) {
+        overlapped = 0;
+        DWORD timeout = beginWait();
+        BOOL succeeded = GetQueuedCompletionStatus(m_port, &numberOfBytesTransferred, &statusCompletionKey, &overlapped, timeout);
+        endWait(timeout);
+
+        // A failed operation still dequeues its packet; only a missing overlapped means the wait itself failed.
+        if (!succeeded && !overlapped) {
+            if (GetLastError() != WAIT_TIMEOUT)
+                break;
+            fireTimers();
+            runTasks(index);
             continue;
+        }
 
-        if (overlapped == kPerformClose)
-            completionKey->destroyKeyCallback();
-        else
-            completionKey->completionCallback(reinterpret_cast<CompletionStatus*>(overlapped), numberOfBytesTransferred);
+        CompletionKey* completionKey = reinterpret_cast<CompletionKey*>(statusCompletionKey);
+        if (!completionKey) {
+            if (overlapped == kPerformTerminate)
+                break;
+            if (overlapped == kPerformDeliverMessages)
+                deliverMessages();
+        } else
+            dispatch(index, completionKey, overlapped, numberOfBytesTransferred);
+
+        fireTimers();
+        runTasks(index);
     }
 #endif
 
     return 0;
 }
 
+size_t CompletionPort::runOnce(DWORD milliseconds)
+{
+    ASSERT(m_threads.empty());
+
+    if (!m_port)
+        return 0;
+
+    // The caller stands in for worker 0 for the duration of the call.
+    CompletionPort* previousPort = s_currentPort;
+    unsigned previousWorkerIndex = s_currentWorkerIndex;
+    s_currentPort = this;
+    s_currentWorkerIndex = 0;
+
+    size_t dispatched = 0;
+    DWORD wait = beginWait();
+    DWORD timeout = std::min(milliseconds, wait);
+#if (_WIN32_WINNT >= 0x0600)
+    static const ULONG maxRemoveEntries = 256;
+    ULONG removedEntries = 0;
+    OVERLAPPED_ENTRY overlappedEntries[maxRemoveEntries];
+
+    BOOL succeeded = GetQueuedCompletionStatusEx(m_port, overlappedEntries, maxRemoveEntries, &removedEntries, timeout, FALSE);
+    endWait(wait);
+    if (!succeeded)
+        removedEntries = 0;
+
+    for (ULONG i = 0; i < removedEntries; ++i) {
+        OVERLAPPED_ENTRY& entry = overlappedEntries[i];
+        CompletionKey* completionKey = reinterpret_cast<CompletionKey*>(entry.lpCompletionKey);
+        if (!completionKey) {
+            if (entry.lpOverlapped == kPerformDeliverMessages)
+                deliverMessages();
+            continue;
+        }
+
+        dispatch(0, completionKey, entry.lpOverlapped, entry.dwNumberOfBytesTransferred);
+        ++dispatched;
+    }
+
+#if ENABLE_STATISTICS
+    if (removedEntries) {
+        WorkerStatistics& statistics = *m_workerStatistics[0];
+        ++statistics.batches;
+        statistics.batchSize.record(removedEntries);
+    }
+#endif
+#else
+    DWORD numberOfBytesTransferred;
+    ULONG_PTR statusCompletionKey;
+    LPOVERLAPPED overlapped = 0;
+
+    // Only the first packet is waited for; the rest of the batch is whatever is queued behind it, up to the batch size
+    // of the other path.
+    static const unsigned maxRemoveEntries = 256;
+    BOOL succeeded = GetQueuedCompletionStatus(m_port, &numberOfBytesTransferred, &statusCompletionKey, &overlapped, timeout);
+    endWait(wait);
+    for (unsigned removedEntries = 1; succeeded || overlapped; ++removedEntries) {
+        CompletionKey* completionKey = reinterpret_cast<CompletionKey*>(statusCompletionKey);
+        if (!completionKey) {
+            if (overlapped == kPerformDeliverMessages)
+                deliverMessages();
+        } else {
+            dispatch(0, completionKey, overlapped, numberOfBytesTransferred);
+            ++dispatched;
+        }
+
+        if (removedEntries == maxRemoveEntries)
+            break;
+        overlapped = 0;
+        succeeded = GetQueuedCompletionStatus(m_port, &numberOfBytesTransferred, &statusCompletionKey, &overlapped, 0);
+    }
+#endif
+
+    fireTimers();
+    runTasks(0);
+
+    s_currentPort = previousPort;
+    s_currentWorkerIndex = previousWorkerIndex;
+    return dispatched;
+}
+
+void CompletionPort::dispatch(unsigned index, CompletionKey* completionKey, LPOVERLAPPED overlapped, DWORD numberOfBytesTransferred)
+{
+    if (overlapped == kPerformClose) {
+        completionKey->destroyKeyCallback();
+        return;
+    }
+
+    CompletionStatus* status = reinterpret_cast<CompletionStatus*>(overlapped);
+#if ENABLE_STATISTICS
+    // The callback frees the status, so everything we need from it is read up front.
+    WorkerStatistics& statistics = *m_workerStatistics[index];
+    LONGLONG dispatchTime = currentTicks();
+    if (status->submitTime)
+        statistics.completionLatency.record(ticksToMicroseconds(dispatchTime - status->submitTime));
+    ++statistics.completions;
+    statistics.bytesTransferred += numberOfBytesTransferred;
+#endif
+
+    completionKey->completionCallback(status, numberOfBytesTransferred);
+
+#if ENABLE_STATISTICS
+    statistics.callbackDuration.record(ticksToMicroseconds(currentTicks() - dispatchTime));
+#endif
+}
+
+CompletionStatus* CompletionPort::allocateCompletionStatus()
+{
+    if (s_currentPort == this)
+        return m_statusPool.allocate(s_currentWorkerIndex);
+    return m_statusPool.allocate();
+}
+
+void CompletionPort::freeCompletionStatus(CompletionStatus* status)
+{
+    if (s_currentPort == this)
+        m_statusPool.free(s_currentWorkerIndex, status);
+    else
+        m_statusPool.free(status);
+}
+
+void CompletionPort::setWaitPolicy(WaitPolicy policy, DWORD maxSpinMicroseconds)
+{
+    m_maxSpinTicks = microsecondsToTicks(maxSpinMicroseconds);
+    m_waitPolicy = policy;
+}
+
+void CompletionPort::setFairDispatch(unsigned maxCompletionsPerKey, DWORD quantum)
+{
+    ASSERT(quantum > 0);
+    m_fairQuantum = quantum;
+    m_maxCompletionsPerKey = maxCompletionsPerKey;
+}
+
+#if (_WIN32_WINNT >= 0x0600)
+unsigned CompletionPort::dispatchBatch(unsigned index, OVERLAPPED_ENTRY* entries, ULONG count)
+{
+    unsigned terminatePackets = 0;
+    for (ULONG i = 0; i < count; ++i) {
+        OVERLAPPED_ENTRY& entry = entries[i];
+        CompletionKey* completionKey = reinterpret_cast<CompletionKey*>(entry.lpCompletionKey);
+        if (!completionKey) {
+            if (entry.lpOverlapped == kPerformTerminate)
+                ++terminatePackets;
+            else if (entry.lpOverlapped == kPerformDeliverMessages)
+                deliverMessages();
+            continue;
+        }
+
+        dispatch(index, completionKey, entry.lpOverlapped, entry.dwNumberOfBytesTransferred);
+    }
+
+    return terminatePackets;
+}
+
+ULONG CompletionPort::dispatchFairly(unsigned index, OVERLAPPED_ENTRY* entries, ULONG count, unsigned& terminatePackets)
+{
+    static const ULONG kEnd = ULONG_MAX;
+    static const ULONG kHashSize = kMaxBatchSize * 2;
+
+    // The entries of each key, linked in the order they were queued. The priority is read up front, since a key may
+    // be gone once its last completion has been dispatched.
+    struct KeyQueue {
+        CompletionKey::Priority priority;
+        ULONG head;
+        ULONG tail;
+        ULONG dispatched;
+        ULONGLONG deficit;
+    };
+
+    KeyQueue queues[kMaxBatchSize];
+    ULONG queueCount = 0;
+    ULONG next[kMaxBatchSize];
+    bool done[kMaxBatchSize];
+    USHORT slots[kHashSize] = { 0 };
+
+    // Packets for the port itself aren't scheduled.
+    for (ULONG i = 0; i < count; ++i) {
+        OVERLAPPED_ENTRY& entry = entries[i];
+        CompletionKey* completionKey = reinterpret_cast<CompletionKey*>(entry.lpCompletionKey);
+        done[i] = !completionKey;
+        if (!completionKey) {
+            if (entry.lpOverlapped == kPerformTerminate)
+                ++terminatePackets;
+            else if (entry.lpOverlapped == kPerformDeliverMessages)
+                deliverMessages();
+            continue;
+        }
+
+        ULONG slot = static_cast<ULONG>((entry.lpCompletionKey >> 4) * 2654435761u) & (kHashSize - 1);
+        while (slots[slot] && entries[queues[slots[slot] - 1].head].lpCompletionKey != entry.lpCompletionKey)
+            slot = (slot + 1) & (kHashSize - 1);
+
+        next[i] = kEnd;
+        if (!slots[slot]) {
+            KeyQueue queue = { completionKey->priority(), i, i, 0, 0 };
+            queues[queueCount++] = queue;
+            slots[slot] = static_cast<USHORT>(queueCount);
+        } else {
+            KeyQueue& queue = queues[slots[slot] - 1];
+            next[queue.tail] = i;
+            queue.tail = i;
+        }
+    }
+
+    // A worker that's been told to terminate doesn't hold anything over.
+    ULONG maxPerKey = m_maxCompletionsPerKey;
+    if (!maxPerKey || terminatePackets)
+        maxPerKey = ULONG_MAX;
+    ULONGLONG quantum = m_fairQuantum;
+
+    // Control keys are dispatched in full. Within the other classes, every key with entries left gets another quantum
+    // of bytes each round, in the order the keys first showed up in the batch, and dispatches entries until it has
+    // spent its deficit or reached its share of the batch.
+    for (int priority = CompletionKey::Control; priority <= CompletionKey::Bulk; ++priority) {
+        ULONG share = priority == CompletionKey::Control ? ULONG_MAX : maxPerKey;
+        ULONGLONG credit = priority == CompletionKey::Control ? ULLONG_MAX / 2 : quantum;
+        for (bool active = true; active;) {
+            active = false;
+            for (ULONG q = 0; q < queueCount; ++q) {
+                KeyQueue& queue = queues[q];
+                if (queue.priority != priority || queue.head == kEnd || queue.dispatched == share)
+                    continue;
+
+                queue.deficit += credit;
+                while (queue.head != kEnd && queue.dispatched < share && entries[queue.head].dwNumberOfBytesTransferred <= queue.deficit) {
+                    OVERLAPPED_ENTRY& entry = entries[queue.head];
+                    queue.deficit -= entry.dwNumberOfBytesTransferred;
+                    ++queue.dispatched;
+                    done[queue.head] = true;
+                    queue.head = next[queue.head];
+                    dispatch(index, reinterpret_cast<CompletionKey*>(entry.lpCompletionKey), entry.lpOverlapped, entry.dwNumberOfBytesTransferred);
+                }
+
+                if (queue.head != kEnd && queue.dispatched < share)
+                    active = true;
+            }
+        }
+    }
+
+    ULONG carried = 0;
+    for (ULONG i = 0; i < count; ++i) {
+        if (!done[i])
+            entries[carried++] = entries[i];
+    }
+    return carried;
+}
+
+BOOL CompletionPort::waitForCompletions(unsigned index, OVERLAPPED_ENTRY* entries, ULONG maxEntries, ULONG& removedEntries, SpinState& spinState)
+{
+    WaitPolicy policy = m_waitPolicy;
+    if (policy == Blocking) {
+        DWORD timeout = beginWait();
+        BOOL succeeded = GetQueuedCompletionStatusEx(m_port, entries, maxEntries, &removedEntries, timeout, TRUE);
+        endWait(timeout);
+        return succeeded;
+    }
+
+    // The spin ends early for a timer that's due or a task that's been posted. Keeping the scheduled wakeup up to date
+    // also makes armTimer() post a wakeup for any timer that's armed to expire sooner.
+    LONGLONG idleSince = currentTicks();
+    LONGLONG spinUntil = policy == BusyPoll ? LLONG_MAX : idleSince + spinState.budget;
+    DWORD timeout = nextTimeout();
+    if (timeout != INFINITE)
+        spinUntil = std::min(spinUntil, idleSince + microsecondsToTicks(timeout * 1000ULL));
+
+    for (LONGLONG now = idleSince; now < spinUntil && !m_pendingTasks; now = currentTicks()) {
+        if (GetQueuedCompletionStatusEx(m_port, entries, maxEntries, &removedEntries, 0, FALSE)) {
+#if ENABLE_STATISTICS
+            ++m_workerStatistics[index]->spinWakeups;
+#endif
+            didWake(spinState, currentTicks() - idleSince);
+            return TRUE;
+        }
+        if (GetLastError() != WAIT_TIMEOUT)
+            return FALSE;
+        YieldProcessor();
+    }
+
+    // Busy polling goes back to running timers and tasks; otherwise it's time to sleep.
+    if (policy == BusyPoll) {
+        removedEntries = 0;
+        SetLastError(WAIT_TIMEOUT);
+        return FALSE;
+    }
+
+    timeout = beginWait();
+    BOOL succeeded = GetQueuedCompletionStatusEx(m_port, entries, maxEntries, &removedEntries, timeout, TRUE);
+    endWait(timeout);
+    if (succeeded)
+        didWake(spinState, currentTicks() - idleSince);
+    return succeeded;
+}
+
+void CompletionPort::didWake(SpinState& spinState, LONGLONG gap)
+{
+    // Spinning only pays off when the next batch tends to show up before the spin limit; the gaps are smoothed with an
+    // exponentially weighted moving average so that a single outlier doesn't flip the decision.
+    LONGLONG maxSpin = m_maxSpinTicks;
+    spinState.averageGap += (gap - spinState.averageGap) / 8;
+    spinState.budget = spinState.averageGap <= maxSpin ? std::min(maxSpin, spinState.averageGap * 2) : 0;
+}
+#endif
+
+bool CompletionPort::reserveWriteBudget(size_t bytes)
+{
+    if (!m_writeBudget)
+        return true;
+
+    size_t used = m_writeBudgetUsed;
+    do {
+        // A single write larger than the whole budget still goes through when nothing else is queued.
+        if (used && used + bytes > m_writeBudget)
+            return false;
+    } while (!m_writeBudgetUsed.compare_exchange_weak(used, used + bytes));
+
+    return true;
+}
+
+void CompletionPort::releaseWriteBudget(size_t bytes)
+{
+    if (!m_writeBudget)
+        return;
+
+    size_t used = m_writeBudgetUsed -= bytes;
+    if (m_hasWriteBudgetWaiters && used <= m_writeBudget / 2)
+        wakeWriteBudgetWaiters();
+}
+
+void CompletionPort::waitForWriteBudget(std::weak_ptr<CompletionKey> waiter)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_writeBudgetLock);
+        m_writeBudgetWaiters.push_back(waiter);
+        m_hasWriteBudgetWaiters = true;
+    }
+
+    // The budget may have been released before the waiter was visible.
+    if (m_writeBudgetUsed <= m_writeBudget / 2)
+        wakeWriteBudgetWaiters();
+}
+
+void CompletionPort::wakeWriteBudgetWaiters()
+{
+    std::vector<std::weak_ptr<CompletionKey>> waiters;
+    {
+        std::lock_guard<std::mutex> lock(m_writeBudgetLock);
+        waiters.swap(m_writeBudgetWaiters);
+        m_hasWriteBudgetWaiters = false;
+    }
+
+    for (size_t i = 0; i < waiters.size(); ++i) {
+        std::weak_ptr<CompletionKey> waiter = waiters[i];
+        post([waiter] {
+            if (std::shared_ptr<CompletionKey> key = waiter.lock())
+                key->writeBudgetCallback();
+        });
+    }
+}
+
+#if ENABLE_STATISTICS
+PortStatistics CompletionPort::statistics() const
+{
+    PortStatistics statistics;
+    statistics.uptime = currentTime() - m_startTime;
+    statistics.statusPoolHits = m_statusPool.hits();
+    statistics.statusPoolMisses = m_statusPool.misses();
+    for (size_t i = 0; i < m_workerStatistics.size(); ++i)
+        statistics.add(*m_workerStatistics[i]);
+    return statistics;
+}
+#endif
+
+void CompletionPort::armTimer(Timer* timer, DWORD milliseconds, DWORD period)
+{
+    ULONGLONG expiration = currentTime() + milliseconds;
+    bool needsWakeup;
+    {
+        std::lock_guard<std::mutex> lock(m_timerLock);
+        timer->setPeriod(period);
+        m_timers.arm(timer, expiration);
+        needsWakeup = expiration < m_scheduledWakeup;
+        if (needsWakeup)
+            m_scheduledWakeup = expiration;
+    }
+
+    // Workers may be sleeping past the new expiration.
+    if (needsWakeup)
+        PostQueuedCompletionStatus(m_port, 0, 0, kPerformWakeup);
+}
+
+void CompletionPort::cancelTimer(Timer* timer)
+{
+    std::unique_lock<std::mutex> lock(m_timerLock);
+    m_timers.cancel(timer);
+
+    // An expiration that hasn't been fired yet is dropped. A callback that's running on another worker is waited for,
+    // since the caller may free the timer as soon as we return; the timer's own callback doesn't wait for itself.
+    for (;;) {
+        unsigned running = 0;
+        for (size_t i = 0; i < m_expiredTimers.size();) {
+            if (m_expiredTimers[i].timer != timer)
+                ++i;
+            else if (!m_expiredTimers[i].running)
+                m_expiredTimers.erase(m_expiredTimers.begin() + i);
+            else {
+                ++running;
+                ++i;
+            }
+        }
+
+        if (running <= (s_firingTimer == timer ? 1u : 0u))
+            return;
+        m_timerFired.wait(lock);
+    }
+}
+
+ULONGLONG CompletionPort::systemTime()
+{
+#if (_WIN32_WINNT >= 0x0600)
+    return GetTickCount64();
+#else
+    return GetTickCount();
+#endif
+}
+
+DWORD CompletionPort::nextTimeout()
+{
+    std::lock_guard<std::mutex> lock(m_timerLock);
+
+    m_scheduledWakeup = m_timers.nextExpiration();
+    if (m_scheduledWakeup == ULLONG_MAX)
+        return INFINITE;
+
+    ULONGLONG now = currentTime();
+    if (m_scheduledWakeup <= now)
+        return 0;
+
+    return static_cast<DWORD>(std::min<ULONGLONG>(m_scheduledWakeup - now, INFINITE - 1));
+}
+
+void CompletionPort::fireTimers()
+{
+    std::vector<Timer*> expired;
+    {
+        // One worker turning the wheel is enough.
+        std::unique_lock<std::mutex> lock(m_timerLock, std::try_to_lock);
+        if (!lock.owns_lock())
+            return;
+        m_timers.advance(currentTime(), expired);
+        for (size_t i = 0; i < expired.size(); ++i) {
+            ExpiredTimer entry = { expired[i], false };
+            m_expiredTimers.push_back(entry);
+        }
+    }
+
+    // Callbacks run without the lock, and cancelTimer() keeps track of them through m_expiredTimers.
+    for (size_t i = 0; i < expired.size(); ++i) {
+        Timer* timer = expired[i];
+        {
+            std::lock_guard<std::mutex> lock(m_timerLock);
+            auto entry = std::find_if(m_expiredTimers.begin(), m_expiredTimers.end(), [timer](const ExpiredTimer& entry) {
+                return entry.timer == timer && !entry.running;
+            });
+            if (entry == m_expiredTimers.end())
+                continue;
+            entry->running = true;
+        }
+
+        Timer* previousTimer = s_firingTimer;
+        s_firingTimer = timer;
+        timer->fire();
+        s_firingTimer = previousTimer;
+
+        {
+            std::lock_guard<std::mutex> lock(m_timerLock);
+            m_expiredTimers.erase(std::find_if(m_expiredTimers.begin(), m_expiredTimers.end(), [timer](const ExpiredTimer& entry) {
+                return entry.timer == timer && entry.running;
+            }));
+        }
+        m_timerFired.notify_all();
+    }
+}
+
+void CompletionPort::post(Task task)
+{
+    WorkerQueue* queue;
+    if (s_currentPort == this)
+        queue = m_workerQueues[s_currentWorkerIndex].get();
+    else
+        queue = m_workerQueues[m_nextWorkerQueue++ % m_workerQueues.size()].get();
+
+    {
+        std::lock_guard<std::mutex> lock(queue->lock);
+        queue->tasks.push_back(std::move(task));
+    }
+
+    // Pairs with beginWait(): either a worker about to sleep sees the task, or we see the sleeper.
+    ++m_pendingTasks;
+    if (m_sleepingWorkers)
+        PostQueuedCompletionStatus(m_port, 0, 0, kPerformWakeup);
+}
+
+void CompletionPort::post(CompletionKey* completionKey, void* payload)
+{
+    enqueueMessage(completionKey, payload);
+    scheduleMessages();
+}
+
+void CompletionPort::postBatch(const Message* messages, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        enqueueMessage(messages[i].key, messages[i].payload);
+
+    if (count)
+        scheduleMessages();
+}
+
+void CompletionPort::enqueueMessage(CompletionKey* completionKey, void* payload)
+{
+    ASSERT(completionKey);
+
+    QueuedMessage* message = reinterpret_cast<QueuedMessage*>(m_statusPool.allocate());
+    message->key = completionKey;
+    message->payload = payload;
+    InterlockedPushEntrySList(&m_messages, &message->entry);
+}
+
+void CompletionPort::scheduleMessages()
+{
+    if (!m_messagesScheduled.exchange(true))
+        PostQueuedCompletionStatus(m_port, 0, 0, kPerformDeliverMessages);
+}
+
+void CompletionPort::deliverMessages()
+{
+    std::lock_guard<std::mutex> lock(m_messageDeliveryLock);
+
+    // Clear the flag before taking the queue, so anything pushed after this schedules another delivery.
+    m_messagesScheduled = false;
+    PSLIST_ENTRY entry = InterlockedFlushSList(&m_messages);
+
+    // The list comes back newest first.
+    PSLIST_ENTRY ordered = nullptr;
+    while (entry) {
+        PSLIST_ENTRY next = entry->Next;
+        entry->Next = ordered;
+        ordered = entry;
+        entry = next;
+    }
+
+    while (ordered) {
+        QueuedMessage* message = reinterpret_cast<QueuedMessage*>(ordered);
+        ordered = ordered->Next;
+
+        CompletionKey* completionKey = message->key;
+        void* payload = message->payload;
+        m_statusPool.free(reinterpret_cast<CompletionStatus*>(message));
+        completionKey->messageCallback(payload);
+    }
+}
+
+DWORD CompletionPort::beginWait()
+{
+    DWORD timeout = nextTimeout();
+    if (!timeout)
+        return 0;
+
+    ++m_sleepingWorkers;
+    if (m_pendingTasks) {
+        --m_sleepingWorkers;
+        return 0;
+    }
+
+    return timeout;
+}
+
+void CompletionPort::endWait(DWORD timeout)
+{
+    if (timeout)
+        --m_sleepingWorkers;
+}
+
+bool CompletionPort::popTask(unsigned index, Task& task)
+{
+    if (!m_pendingTasks)
+        return false;
+
+    // The owner takes the most recently posted task, thieves take the oldest one.
+    for (size_t i = 0; i < m_workerQueues.size(); ++i) {
+        WorkerQueue& queue = *m_workerQueues[(index + i) % m_workerQueues.size()];
+        std::lock_guard<std::mutex> lock(queue.lock);
+        if (queue.tasks.empty())
+            continue;
+
+        if (!i) {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        } else {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+        --m_pendingTasks;
+        return true;
+    }
+
+    return false;
+}
+
+void CompletionPort::runTasks(unsigned index)
+{
+    // Bounded so that a flood of tasks doesn't hold back the completions queued behind them.
+    static const unsigned maxTasksPerBatch = 64;
+
+    Task task;
+    for (unsigned i = 0; i < maxTasksPerBatch && popTask(index, task); ++i)
+        task();
+}
+
+std::vector<std::pair<HANDLE, std::shared_ptr<CompletionKey>>> CompletionPort::registeredKeys()
+{
+    std::vector<std::pair<HANDLE, std::shared_ptr<CompletionKey>>> keys;
+    for (size_t i = 0; i < kKeyShardCount; ++i) {
+        std::lock_guard<std::mutex> lock(m_keyShards[i].lock);
+        keys.insert(keys.end(), m_keyShards[i].keys.begin(), m_keyShards[i].keys.end());
+    }
+    return keys;
+}
+
+bool CompletionPort::waitUntilDrained(ULONGLONG deadline)
+{
+    // Done when every key has closed, the completions of their aborted operations have all been delivered, and the
+    // tasks that did the closing have run.
+    while (numberOfKeys() || m_closingKeys || m_pendingTasks) {
+        if (systemTime() >= deadline)
+            return false;
+
+        // Nobody else is going to drain a manual port.
+        if (m_threads.empty())
+            runOnce(1);
+        else
+            Sleep(1);
+    }
+    return true;
+}
+
+CompletionPort::KeyShard& CompletionPort::keyShard(HANDLE fileHandle)
+{
+    // Kernel handle values are multiples of four.
+    return m_keyShards[(reinterpret_cast<ULONG_PTR>(fileHandle) >> 2) % kKeyShardCount];
+}
+
+size_t CompletionPort::numberOfKeys()
+{
+    size_t count = 0;
+    for (size_t i = 0; i < kKeyShardCount; ++i) {
+        std::lock_guard<std::mutex> lock(m_keyShards[i].lock);
+        count += m_keyShards[i].keys.size();
+    }
+    return count;
+}
+
 void CompletionPort::handleError()
 {
     m_error = GetLastError();
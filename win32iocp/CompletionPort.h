@@ -23,42 +23,315 @@
 #pragma once
 
 #include "includes.h"
+#include "CompletionStatusPool.h"
+#include "Statistics.h"
+#include "TimerWheel.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <new>
 #include <unordered_map>
+#include <vector>
+
+struct PooledBuffer;
 
 struct CompletionStatus : public OVERLAPPED {
     void* user;
+    PooledBuffer* buffer;
+    size_t sequence;
+    // Bytes of a send that count against its handle's write watermarks until the status is freed.
+    size_t queuedBytes;
+    void* context;
+#if ENABLE_STATISTICS
+    // Stamped by the issuer when the operation is submitted; zero leaves the completion out of the latency histogram.
+    LONGLONG submitTime;
+#endif
 };
 
 class CompletionKey : protected std::enable_shared_from_this<CompletionKey> {
 public:
+    // Only ports with fair dispatch look at it. Control is meant for the traffic that keeps connections going, like
+    // handshakes and heartbeats, and Bulk for transfers that can wait behind everything else.
+    enum Priority { Control, Interactive, Bulk };
+
+    CompletionKey()
+        : m_priority(Interactive)
+    {
+    }
+
+    Priority priority() const { return m_priority; }
+    void setPriority(Priority priority) { m_priority = priority; }
+
     virtual void completionCallback(CompletionStatus*, size_t) = 0;
     virtual void destroyKeyCallback() = 0;
+    virtual void messageCallback(void* payload) { }
+    virtual void writeBudgetCallback() { }
+
+    // The port is shutting down. The key should stop issuing operations and close once what it has in flight is
+    // done; when |immediately| is set the deadline has passed and it should close right away.
+    virtual void shutdownCallback(bool immediately) { }
+
+private:
+    std::atomic<Priority> m_priority;
 };
 
 class CompletionPort final {
 public:
-    static std::shared_ptr<CompletionPort> create()
+    // Each worker drains the same port; a non-zero affinity mask pins worker N to the Nth processor in the mask.
+    static std::shared_ptr<CompletionPort> create(unsigned numberOfThreads = 1, DWORD_PTR affinityMask = 0)
+    {
+        return std::shared_ptr<CompletionPort>(new CompletionPort(numberOfThreads, affinityMask, nullptr), &CompletionPort::destroy);
+    }
+
+    // A port without workers, driven by whoever calls runOnce(). Timers follow |clock|, in milliseconds, when one is
+    // given, so a test can step time forward instead of waiting for it. Run on a single thread, a manual port
+    // dispatches in exactly the order things were queued, which makes a run repeatable.
+    typedef std::function<ULONGLONG()> Clock;
+    static std::shared_ptr<CompletionPort> createManual(Clock clock = nullptr)
     {
-        return std::shared_ptr<CompletionPort>(new CompletionPort);
+        return std::shared_ptr<CompletionPort>(new CompletionPort(0, 0, clock), &CompletionPort::destroy);
     }
     ~CompletionPort();
 
+    // Fails once the port has started shutting down.
     bool add(HANDLE, std::shared_ptr<CompletionKey>);
     bool close(HANDLE);
 
-    void didClose(HANDLE);
+    // Moves a registered handle and its key to another port, whose workers get its completions from then on. Nothing
+    // may be pending on the handle. Needs Windows 8.1 or later; fails on older systems.
+    bool migrate(HANDLE, std::shared_ptr<CompletionPort>);
+
+    // Dispatches the completions queued on a manual port, waiting up to |milliseconds| for the first one, then fires
+    // due timers and runs posted tasks, all on the calling thread. Returns the number of completions dispatched.
+    size_t runOnce(DWORD milliseconds = 0);
 
+    // For keys that do their I/O themselves instead of through a handle. The completion is queued like one from the
+    // kernel, Internal and InternalHigh included, and the close is queued behind whatever is already on the port.
+    bool postCompletion(CompletionKey*, CompletionStatus*, DWORD numberOfBytesTransferred);
+    bool closeKey(CompletionKey*);
+
+    // Handles currently registered with this port.
+    size_t numberOfHandles() const { return m_handleCount; }
+
+    // Unregisters a handle that's being closed. The key has to hold on to the returned reference until the completions
+    // of its aborted operations have come back, and the port counts it as closing until then.
+    std::shared_ptr<CompletionKey> didClose(HANDLE);
+
+    // Stops the workers right away; every handle must have been closed already.
     void terminate();
 
+    // Stops the port gracefully. New handles are refused, and every registered key gets shutdownCallback() to finish
+    // its work and close. Whatever is still open at the deadline has its I/O cancelled and is told to close
+    // immediately. Once the keys are gone and the completions of their last operations have been delivered, the
+    // workers are joined. Returns false if some key still hadn't closed by then. Must not be called from a worker.
+    bool shutdown(DWORD milliseconds);
+
+    // Workers go through a cache of free statuses of their own before the pool's shared list.
+    CompletionStatus* allocateCompletionStatus();
+    void freeCompletionStatus(CompletionStatus*);
+    const CompletionStatusPool& statusPool() const { return m_statusPool; }
+
+    // Timers fire on a worker thread between completion batches; a non-zero period re-arms the timer after each
+    // expiration. The port doesn't own the timer, which has to stay alive until it's cancelled or has fired.
+    // cancelTimer() waits for a callback of the timer that's running on another worker, so a timer may be freed
+    // right after it's been cancelled; a callback mustn't cancel a timer whose own callback may be cancelling it.
+    typedef TimerWheel::Timer Timer;
+    void armTimer(Timer*, DWORD milliseconds, DWORD period = 0);
+    void cancelTimer(Timer*);
+
+    // The time timers follow, in milliseconds.
+    ULONGLONG currentTime() const { return m_clock ? m_clock() : systemTime(); }
+
+    // How idle workers wait for completions. Blocking, the default, sleeps in the kernel right away. SpinThenBlock polls
+    // the port first, so that a completion arriving shortly after the last batch is picked up without a wakeup and a
+    // context switch; each worker spins for about twice the average gap it has seen between batches, at most
+    // |maxSpinMicroseconds|, and not at all when batches arrive further apart than that. BusyPoll never sleeps and keeps
+    // every worker's processor busy. Spinning needs GetQueuedCompletionStatusEx; older systems always block.
+    enum WaitPolicy { Blocking, SpinThenBlock, BusyPoll };
+    void setWaitPolicy(WaitPolicy, DWORD maxSpinMicroseconds = 50);
+
+    // Workers dispatch each batch of completions in the order the kernel queued them, unless fair dispatch is on, so
+    // that a connection with lots of I/O in flight can take up whole batches. With fair dispatch, Control keys go
+    // first, then Interactive and then Bulk keys, each class by deficit round-robin over its keys with |quantum| bytes
+    // per round, and no key gets more than |maxCompletionsPerKey| of a batch dispatched. The rest is held over to the
+    // next batch, which takes whatever has been queued since without waiting. A key's completions stay in order only
+    // within one worker: with more than one, another worker may dispatch later completions of the same key before
+    // those held over, just as it may without fair dispatch. Zero turns it off, which is the default. Needs
+    // GetQueuedCompletionStatusEx; a manual port always dispatches in queue order.
+    void setFairDispatch(unsigned maxCompletionsPerKey, DWORD quantum = 64 * 1024);
+
+    // Runs |task| on one of the workers between completion batches. Tasks posted from a worker stay on its own
+    // queue, and idle workers steal from busy ones before they block waiting for completions.
+    typedef std::function<void()> Task;
+    void post(Task);
+
+    // Delivers |payload| to the key's messageCallback on a worker. Messages go through a lock-free queue and wake
+    // the port at most once per batch, and they're delivered in the order they were queued. The key must stay alive
+    // until its messages have been delivered.
+    struct Message {
+        CompletionKey* key;
+        void* payload;
+    };
+    void post(CompletionKey*, void* payload);
+    void postBatch(const Message*, size_t count);
+
+    // Caps the bytes all handles on this port may have queued for writing; zero, the default, means no cap. It has to
+    // be set before any handle starts writing. A key that was turned away by reserveWriteBudget() can wait for room,
+    // and its writeBudgetCallback runs on a worker once usage has dropped to half the budget.
+    void setWriteBudget(size_t bytes) { m_writeBudget = bytes; }
+    bool reserveWriteBudget(size_t bytes);
+    void releaseWriteBudget(size_t bytes);
+    void waitForWriteBudget(std::weak_ptr<CompletionKey>);
+
+#if ENABLE_STATISTICS
+    // Aggregates the per-worker counters and histograms on demand.
+    PortStatistics statistics() const;
+#endif
+
 private:
-    CompletionPort();
+    CompletionPort(unsigned numberOfThreads, DWORD_PTR affinityMask, Clock);
+
+    // Deleter for the references handed out by create(). The last one can go away in a callback on one of the port's
+    // own workers, which can't join itself; the port is torn down on a thread of its own then.
+    static void destroy(CompletionPort*);
+
+    // The key shards are cache line aligned, which plain new doesn't honor.
+    static void* operator new(size_t size)
+    {
+        void* memory = _aligned_malloc(size, __alignof(CompletionPort));
+        if (!memory)
+            throw std::bad_alloc();
+        return memory;
+    }
+    static void operator delete(void* memory) { _aligned_free(memory); }
 
-    int threadMain();
+    int threadMain(unsigned index, DWORD_PTR affinityMask);
 
     void handleError();
 
+    void dispatch(unsigned index, CompletionKey*, LPOVERLAPPED, DWORD numberOfBytesTransferred);
+
+    static ULONGLONG systemTime();
+    DWORD nextTimeout();
+    void fireTimers();
+
+    DWORD beginWait();
+    void endWait(DWORD timeout);
+
+#if (_WIN32_WINNT >= 0x0600)
+    struct SpinState {
+        LONGLONG averageGap;
+        LONGLONG budget;
+    };
+
+    BOOL waitForCompletions(unsigned index, OVERLAPPED_ENTRY*, ULONG maxEntries, ULONG& removedEntries, SpinState&);
+    void didWake(SpinState&, LONGLONG gap);
+
+    static const ULONG kMaxBatchSize = 256;
+
+    // Both dispatch the whole batch even when it holds terminate packets, and count those for the caller.
+    unsigned dispatchBatch(unsigned index, OVERLAPPED_ENTRY*, ULONG count);
+    // Returns the number of entries held over, which are moved to the front of the array.
+    ULONG dispatchFairly(unsigned index, OVERLAPPED_ENTRY*, ULONG count, unsigned& terminatePackets);
+#endif
+
+    // Allocated one at a time, so it brings its own aligned operator new.
+    struct __declspec(align(64)) WorkerQueue {
+        static void* operator new(size_t size)
+        {
+            void* memory = _aligned_malloc(size, __alignof(WorkerQueue));
+            if (!memory)
+                throw std::bad_alloc();
+            return memory;
+        }
+        static void operator delete(void* memory) { _aligned_free(memory); }
+
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+
+    bool popTask(unsigned index, Task&);
+    void runTasks(unsigned index);
+
+    void enqueueMessage(CompletionKey*, void* payload);
+    void scheduleMessages();
+    void deliverMessages();
+
+    void wakeWriteBudgetWaiters();
+
+    void stopWorkers();
+    std::vector<std::pair<HANDLE, std::shared_ptr<CompletionKey>>> registeredKeys();
+    bool waitUntilDrained(ULONGLONG deadline);
+
+    // Keeps a closed key alive on the port's books until the key lets go of the reference didClose() gave it.
+    struct ClosingKey {
+        ClosingKey(std::atomic<size_t>& counter, std::shared_ptr<CompletionKey> key)
+            : counter(counter)
+            , key(key)
+        {
+            ++counter;
+        }
+        ~ClosingKey()
+        {
+            --counter;
+        }
+
+        std::atomic<size_t>& counter;
+        std::shared_ptr<CompletionKey> key;
+    };
+
+    // Keys are spread over independently locked shards so that connection churn on different handles doesn't
+    // serialize on a single lock.
+    static const size_t kKeyShardCount = 64;
+
+    struct __declspec(align(64)) KeyShard {
+        std::mutex lock;
+        std::unordered_map<HANDLE, std::shared_ptr<CompletionKey>> keys;
+    };
+
+    KeyShard& keyShard(HANDLE);
+    size_t numberOfKeys();
+
     HANDLE m_port;
     DWORD m_error;
-    std::thread m_thread;
-    std::unordered_map<HANDLE, std::shared_ptr<CompletionKey>> m_keys;
+    std::vector<std::thread> m_threads;
+    CompletionStatusPool m_statusPool;
+    Clock m_clock;
+    // Timers that have expired, until their callbacks have returned.
+    struct ExpiredTimer {
+        Timer* timer;
+        bool running;
+    };
+
+    std::mutex m_timerLock;
+    std::condition_variable m_timerFired;
+    TimerWheel m_timers;
+    std::vector<ExpiredTimer> m_expiredTimers;
+    ULONGLONG m_scheduledWakeup;
+    std::vector<std::unique_ptr<WorkerQueue>> m_workerQueues;
+    std::atomic<size_t> m_pendingTasks;
+    std::atomic<unsigned> m_sleepingWorkers;
+    std::atomic<unsigned> m_nextWorkerQueue;
+    std::atomic<WaitPolicy> m_waitPolicy;
+    std::atomic<LONGLONG> m_maxSpinTicks;
+    std::atomic<unsigned> m_maxCompletionsPerKey;
+    std::atomic<DWORD> m_fairQuantum;
+    SLIST_HEADER m_messages;
+    std::atomic<bool> m_messagesScheduled;
+    std::mutex m_messageDeliveryLock;
+    KeyShard m_keyShards[kKeyShardCount];
+    std::atomic<size_t> m_handleCount;
+    std::atomic<bool> m_shuttingDown;
+    std::atomic<size_t> m_closingKeys;
+    size_t m_writeBudget;
+    std::atomic<size_t> m_writeBudgetUsed;
+    std::atomic<bool> m_hasWriteBudgetWaiters;
+    std::mutex m_writeBudgetLock;
+    std::vector<std::weak_ptr<CompletionKey>> m_writeBudgetWaiters;
+#if ENABLE_STATISTICS
+    ULONGLONG m_startTime;
+    std::vector<std::unique_ptr<WorkerStatistics>> m_workerStatistics;
+#endif
 };
@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2016 Daewoong Jang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "CompletionStatusPool.h"
+
+#include "CompletionPort.h"
+
+static const size_t kCacheLineSize = 64;
+static const size_t kSlotSize = (sizeof(CompletionStatus) + kCacheLineSize - 1) & ~(kCacheLineSize - 1);
+
+CompletionStatusPool::CompletionStatusPool()
+    : m_hits(0)
+    , m_misses(0)
+    , m_caches(nullptr)
+    , m_cacheCount(0)
+{
+    InitializeSListHead(&m_freeList);
+}
+
+CompletionStatusPool::~CompletionStatusPool()
+{
+    for (unsigned i = 0; i < m_cacheCount; ++i) {
+        for (size_t slot = 0; slot < m_caches[i].count; ++slot)
+            _aligned_free(m_caches[i].slots[slot]);
+    }
+    _aligned_free(m_caches);
+
+    PSLIST_ENTRY entry = InterlockedFlushSList(&m_freeList);
+    while (entry) {
+        PSLIST_ENTRY next = entry->Next;
+        _aligned_free(entry);
+        entry = next;
+    }
+}
+
+CompletionStatus* CompletionStatusPool::take()
+{
+    void* slot = InterlockedPopEntrySList(&m_freeList);
+    if (slot)
+        m_hits.fetch_add(1, std::memory_order_relaxed);
+    else {
+        m_misses.fetch_add(1, std::memory_order_relaxed);
+        slot = _aligned_malloc(kSlotSize, kCacheLineSize);
+        if (!slot)
+            CRASH();
+    }
+
+    return static_cast<CompletionStatus*>(slot);
+}
+
+CompletionStatus* CompletionStatusPool::allocate()
+{
+    CompletionStatus* status = take();
+    memset(status, 0, sizeof(CompletionStatus));
+    return status;
+}
+
+void CompletionStatusPool::free(CompletionStatus* status)
+{
+    if (!status)
+        return;
+
+    InterlockedPushEntrySList(&m_freeList, reinterpret_cast<PSLIST_ENTRY>(status));
+}
+
+void CompletionStatusPool::createCaches(unsigned count)
+{
+    static_assert(!(sizeof(Cache) % kCacheLineSize), "Caches must fill whole cache lines");
+    ASSERT(!m_caches);
+
+    m_caches = static_cast<Cache*>(_aligned_malloc(sizeof(Cache) * count, kCacheLineSize));
+    if (!m_caches)
+        CRASH();
+    memset(m_caches, 0, sizeof(Cache) * count);
+    m_cacheCount = count;
+}
+
+CompletionStatus* CompletionStatusPool::allocate(unsigned cache)
+{
+    ASSERT(cache < m_cacheCount);
+
+    Cache& owned = m_caches[cache];
+    CompletionStatus* status;
+    if (owned.count) {
+        ++owned.hits;
+        status = owned.slots[--owned.count];
+    } else
+        status = take();
+
+    memset(status, 0, sizeof(CompletionStatus));
+    return status;
+}
+
+void CompletionStatusPool::free(unsigned cache, CompletionStatus* status)
+{
+    ASSERT(cache < m_cacheCount);
+
+    if (!status)
+        return;
+
+    Cache& owned = m_caches[cache];
+    if (owned.count < kCacheCapacity)
+        owned.slots[owned.count++] = status;
+    else
+        free(status);
+}
+
+size_t CompletionStatusPool::hits() const
+{
+    size_t hits = m_hits;
+    for (unsigned i = 0; i < m_cacheCount; ++i)
+        hits += m_caches[i].hits;
+    return hits;
+}
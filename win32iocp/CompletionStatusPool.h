@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2016 Daewoong Jang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "includes.h"
+#include <atomic>
+
+struct CompletionStatus;
+
+// Recycles cache-line sized CompletionStatus slots through a lock-free list so that posting an operation doesn't
+// go through the global allocator.
+class CompletionStatusPool final {
+public:
+    CompletionStatusPool();
+    ~CompletionStatusPool();
+
+    CompletionStatus* allocate();
+    void free(CompletionStatus*);
+
+    // Puts a small private cache of free slots in front of the shared list for each of |count| threads, so that
+    // a thread recycling its own slots doesn't contend on the list. A thread passes the index of the cache it owns;
+    // no two threads may use the same cache at once. Slots move through the shared list when a cache runs empty or
+    // full. Must be called once, before any cache is used.
+    void createCaches(unsigned count);
+    CompletionStatus* allocate(unsigned cache);
+    void free(unsigned cache, CompletionStatus*);
+
+    // Read racily from the caches.
+    size_t hits() const;
+    size_t misses() const { return m_misses; }
+
+private:
+    CompletionStatusPool(const CompletionStatusPool&);
+    CompletionStatusPool& operator=(const CompletionStatusPool&);
+
+    // A multiple of the cache line size, so that caches laid out back to back don't share lines.
+    static const size_t kCacheCapacity = 30;
+    struct Cache {
+        size_t count;
+        size_t hits;
+        CompletionStatus* slots[kCacheCapacity];
+    };
+
+    CompletionStatus* take();
+
+    SLIST_HEADER m_freeList;
+    std::atomic<size_t> m_hits;
+    std::atomic<size_t> m_misses;
+    Cache* m_caches;
+    unsigned m_cacheCount;
+};
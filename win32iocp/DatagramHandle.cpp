@@ -0,0 +1,255 @@
+/*
+ * Copyright (C) 2016 Daewoong Jang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "DatagramHandle.h"
+
+#include <mstcpip.h>
+
+// Older SDKs don't know about UDP segmentation offload yet.
+#ifndef UDP_SEND_MSG_SIZE
+#define UDP_SEND_MSG_SIZE 2
+#endif
+
+std::shared_ptr<DatagramHandle> DatagramHandle::create(SOCKET socket, std::shared_ptr<CompletionPort> port, Client* client)
+{
+    std::shared_ptr<DatagramHandle> handle(new DatagramHandle(socket, port, client));
+    if (!port->add((HANDLE)socket, handle)) {
+        closesocket(socket);
+        handle->m_closed = true;
+        return nullptr;
+    }
+
+    // An ICMP port unreachable would otherwise fail the next receive with WSAECONNRESET.
+    BOOL reportConnectionReset = FALSE;
+    DWORD bytesReturned = 0;
+    WSAIoctl(socket, SIO_UDP_CONNRESET, &reportConnectionReset, sizeof(reportConnectionReset), NULL, 0, &bytesReturned, NULL, NULL);
+
+    return handle;
+}
+
+DatagramHandle::DatagramHandle(SOCKET socket, std::shared_ptr<CompletionPort> port, Client* client)
+    : m_socket(socket)
+    , m_port(port)
+    , m_client(client)
+    , m_receiveDepth(0)
+    , m_receiving(false)
+    , m_pendingOperations(0)
+    , m_closing(false)
+    , m_closed(false)
+    , m_didClose(false)
+{
+    ASSERT(socket && socket != INVALID_SOCKET);
+    ASSERT(m_client);
+    ASSERT(m_port);
+}
+
+DatagramHandle::~DatagramHandle()
+{
+    ASSERT(m_closed);
+}
+
+bool DatagramHandle::startReceiving(std::shared_ptr<BufferPool> pool, unsigned depth)
+{
+    ASSERT(!m_closing);
+
+    if (!pool || depth == 0)
+        return false;
+
+    if (!m_receives) {
+        m_receives.reset(new PendingReceive[depth]);
+        for (unsigned slot = 0; slot < depth; ++slot)
+            m_receives[slot].posted = false;
+        m_receiveDepth = depth;
+        m_receivePool = pool;
+    } else if (m_receivePool != pool || m_receiveDepth != depth)
+        return false;
+
+    m_receiving = true;
+    for (unsigned slot = 0; slot < m_receiveDepth; ++slot) {
+        if (!postReceive(slot))
+            break;
+    }
+
+    return true;
+}
+
+bool DatagramHandle::postReceive(size_t slot)
+{
+    PendingReceive& receive = m_receives[slot];
+
+    // Another thread may be reposting the same slot.
+    if (receive.posted.exchange(true))
+        return true;
+
+    PooledBuffer* buffer = m_receivePool->acquire();
+    if (!buffer) {
+        receive.posted = false;
+        return false;
+    }
+
+    receive.buffer = buffer;
+    receive.fromLength = sizeof(receive.from);
+    receive.flags = 0;
+
+    CompletionStatus* status = m_port->allocateCompletionStatus();
+    status->user = reinterpret_cast<void*>(static_cast<int>(Receive));
+    status->buffer = buffer;
+    status->sequence = slot;
+    ++m_pendingOperations;
+
+    WSABUF wsaBuffer = { static_cast<ULONG>(buffer->capacity), buffer->data };
+    DWORD bytesReceived = 0;
+    if (WSARecvFrom(m_socket, &wsaBuffer, 1, &bytesReceived, &receive.flags, reinterpret_cast<sockaddr*>(&receive.from), &receive.fromLength, status, NULL) == SOCKET_ERROR && WSAGetLastError() != WSA_IO_PENDING) {
+        --m_pendingOperations;
+        m_port->freeCompletionStatus(status);
+        buffer->pool->release(buffer);
+        receive.posted = false;
+        return false;
+    }
+
+    return true;
+}
+
+bool DatagramHandle::sendTo(PooledBuffer* buffer, size_t size, const sockaddr* address, int addressLength)
+{
+    ASSERT(!m_closing);
+
+    if (!buffer || size > buffer->capacity || !address)
+        return false;
+
+    CompletionStatus* status = m_port->allocateCompletionStatus();
+    status->user = reinterpret_cast<void*>(static_cast<int>(Send));
+    status->buffer = buffer;
+    ++m_pendingOperations;
+
+    WSABUF wsaBuffer = { static_cast<ULONG>(size), buffer->data };
+    DWORD bytesSent = 0;
+    if (WSASendTo(m_socket, &wsaBuffer, 1, &bytesSent, 0, address, addressLength, status, NULL) == SOCKET_ERROR && WSAGetLastError() != WSA_IO_PENDING) {
+        --m_pendingOperations;
+        m_port->freeCompletionStatus(status);
+        return false;
+    }
+
+    return true;
+}
+
+size_t DatagramHandle::sendEach(const Datagram* datagrams, size_t count)
+{
+    size_t sent = 0;
+    while (sent < count && sendTo(datagrams[sent].buffer, datagrams[sent].size, datagrams[sent].address, datagrams[sent].addressLength))
+        ++sent;
+
+    return sent;
+}
+
+bool DatagramHandle::setSendSegmentSize(DWORD segmentSize)
+{
+    return setsockopt(m_socket, IPPROTO_UDP, UDP_SEND_MSG_SIZE, reinterpret_cast<char*>(&segmentSize), sizeof(segmentSize)) != SOCKET_ERROR;
+}
+
+void DatagramHandle::close()
+{
+    if (m_closed || m_closing.exchange(true))
+        return;
+
+    m_receiving = false;
+
+    if (!m_port->close((HANDLE)m_socket))
+        m_closing = false;
+}
+
+void DatagramHandle::completionCallback(CompletionStatus* status, size_t)
+{
+    Operation operation = static_cast<Operation>(reinterpret_cast<int>(status->user));
+    PooledBuffer* buffer = status->buffer;
+    size_t slot = status->sequence;
+
+    DWORD bytesTransferred = 0;
+    DWORD flags = 0;
+    BOOL succeeded = !m_closed && WSAGetOverlappedResult(m_socket, status, &bytesTransferred, FALSE, &flags);
+    m_port->freeCompletionStatus(status);
+
+    if (operation == Send) {
+        buffer->pool->release(buffer);
+        if (succeeded)
+            m_client->handleDidSend(this, bytesTransferred);
+        didCompleteOperation();
+        return;
+    }
+
+    // The slot is reposted before the datagram is delivered, so its address has to be saved first.
+    PendingReceive& receive = m_receives[slot];
+    sockaddr_storage from = receive.from;
+    int fromLength = receive.fromLength;
+    receive.posted = false;
+
+    // m_closing stays set once the close has been queued, so nothing is posted on a socket that's being closed.
+    if (m_receiving && !m_closing)
+        postReceive(slot);
+
+    if (succeeded && !m_closing)
+        m_client->handleDidReceive(this, buffer, bytesTransferred, reinterpret_cast<sockaddr*>(&from), fromLength);
+    else
+        buffer->pool->release(buffer);
+
+    didCompleteOperation();
+}
+
+void DatagramHandle::didCompleteOperation()
+{
+    // The last operation aborted by closing the socket has come back.
+    if (!--m_pendingOperations && m_closed)
+        didClose();
+}
+
+void DatagramHandle::didClose()
+{
+    // Both the close and the last aborted operation may get here when they race on different workers.
+    if (m_didClose.exchange(true))
+        return;
+
+    std::shared_ptr<CompletionKey> protectedThis;
+    protectedThis.swap(m_protectedThis);
+    m_client->handleDidClose(this);
+}
+
+void DatagramHandle::destroyKeyCallback()
+{
+    // The local reference outlives a close finished early by the last aborted operation on another worker.
+    std::shared_ptr<CompletionKey> protectedThis = m_protectedThis = m_port->didClose((HANDLE)m_socket);
+
+    // The socket value is left alone, since completions of aborted operations may still be reading it; m_closed
+    // tells them it's gone.
+    m_closed = true;
+    closesocket(m_socket);
+
+    // Operations still in flight are aborted and come back through completionCallback, which finishes the close.
+    if (!m_pendingOperations)
+        didClose();
+}
+
+void DatagramHandle::shutdownCallback(bool)
+{
+    // There's nothing worth waiting for; sends already handed to the stack go out regardless.
+    close();
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2016 Daewoong Jang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "includes.h"
+#include "BufferPool.h"
+#include "CompletionPort.h"
+#include <atomic>
+#include <memory>
+#include <winsock2.h>
+
+// Sends and receives datagrams on an unconnected socket. Up to |depth| receives are kept posted into buffers
+// leased from a pool, so a burst of datagrams is drained by a single wakeup of the port, and every datagram is
+// handed to the client along with the address it came from. Receives complete on any worker and may be
+// delivered concurrently.
+class DatagramHandle final : public CompletionKey {
+public:
+    class Client {
+    public:
+        // Receives the lease of |buffer|; the client is responsible for releasing it.
+        virtual void handleDidReceive(DatagramHandle*, PooledBuffer* buffer, size_t, const sockaddr* from, int fromLength) = 0;
+        virtual void handleDidSend(DatagramHandle*, size_t) { }
+        virtual void handleDidClose(DatagramHandle*) = 0;
+    };
+
+    struct Datagram {
+        PooledBuffer* buffer;
+        size_t size;
+        const sockaddr* address;
+        int addressLength;
+    };
+
+    // Takes ownership of a bound datagram socket. Returns null, with the socket closed, once the port has started
+    // shutting down.
+    static std::shared_ptr<DatagramHandle> create(SOCKET, std::shared_ptr<CompletionPort>, Client*);
+    ~DatagramHandle();
+
+    // Receives are reposted as they complete. Slots that found the pool empty stay idle until startReceiving() is
+    // called again, which tops them up.
+    bool startReceiving(std::shared_ptr<BufferPool>, unsigned depth);
+    void stopReceiving() { m_receiving = false; }
+
+    // A send consumes the buffer lease, which goes back to its pool once the datagram is out. The address is only
+    // read during the call. sendEach() issues one send per datagram, so it saves the caller a loop but not any
+    // system calls; it stops at the first send that can't be started and returns how many were, and the leases of
+    // the rest stay with the caller.
+    bool sendTo(PooledBuffer*, size_t, const sockaddr*, int addressLength);
+    size_t sendEach(const Datagram*, size_t count);
+
+    // Lets the stack split each send into datagrams of |segmentSize| bytes (UDP segmentation offload). Fails where
+    // the system doesn't support it.
+    bool setSendSegmentSize(DWORD segmentSize);
+
+    void close();
+
+private:
+    DatagramHandle(SOCKET, std::shared_ptr<CompletionPort>, Client*);
+
+    enum Operation { Receive, Send };
+
+    struct PendingReceive {
+        std::atomic<bool> posted;
+        PooledBuffer* buffer;
+        sockaddr_storage from;
+        int fromLength;
+        DWORD flags;
+    };
+
+    bool postReceive(size_t slot);
+    void didCompleteOperation();
+    void didClose();
+
+    void completionCallback(CompletionStatus*, size_t) override;
+    void destroyKeyCallback() override;
+    void shutdownCallback(bool immediately) override;
+
+    SOCKET m_socket;
+    std::shared_ptr<CompletionPort> m_port;
+    Client* m_client;
+    std::shared_ptr<BufferPool> m_receivePool;
+    std::unique_ptr<PendingReceive[]> m_receives;
+    unsigned m_receiveDepth;
+    std::atomic<bool> m_receiving;
+    std::atomic<unsigned> m_pendingOperations;
+    std::atomic<bool> m_closing;
+    std::atomic<bool> m_closed;
+    std::atomic<bool> m_didClose;
+    std::shared_ptr<CompletionKey> m_protectedThis;
+};
@@ -0,0 +1,278 @@
+/*
+ * Copyright (C) 2016 Daewoong Jang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "Framing.h"
+
+// A 64-bit length never needs more than ten groups of seven bits.
+static const size_t kMaxVarintSize = 10;
+
+static size_t varintSize(ULONGLONG value)
+{
+    size_t size = 1;
+    while (value >>= 7)
+        ++size;
+    return size;
+}
+
+FrameFormat FrameFormat::fixedLength(unsigned lengthSize, size_t maxFrameSize)
+{
+    ASSERT(lengthSize == 1 || lengthSize == 2 || lengthSize == 4);
+    ASSERT(lengthSize == 4 || maxFrameSize < (1u << (lengthSize * 8)));
+
+    FrameFormat format = { FixedLength, lengthSize, { 0 }, 0, maxFrameSize };
+    return format;
+}
+
+FrameFormat FrameFormat::varint(size_t maxFrameSize)
+{
+    FrameFormat format = { Varint, 0, { 0 }, 0, maxFrameSize };
+    return format;
+}
+
+FrameFormat FrameFormat::delimited(const char* delimiter, size_t delimiterLength, size_t maxFrameSize)
+{
+    FrameFormat format = { Delimited, 0, { 0 }, delimiterLength, maxFrameSize };
+    ASSERT(delimiterLength > 0 && delimiterLength <= sizeof(format.delimiter));
+    memcpy(format.delimiter, delimiter, delimiterLength);
+    return format;
+}
+
+FrameDecoder::FrameDecoder(const FrameFormat& format, Client* client, size_t bufferSize)
+    : m_format(format)
+    , m_client(client)
+    , m_buffer(bufferSize)
+    , m_begin(0)
+    , m_end(0)
+    , m_scanned(0)
+    , m_needed(0)
+    , m_failed(false)
+{
+    ASSERT(m_client);
+    ASSERT(bufferSize > 0);
+}
+
+std::pair<char*, size_t> FrameDecoder::readBuffer()
+{
+    // Moving a partial frame is cheap next to a read, but there's no point doing it for every little bit of room.
+    if (m_begin && (m_buffer.size() - m_end < m_buffer.size() / 4 || m_needed > m_buffer.size() - m_begin)) {
+        memmove(&m_buffer[0], &m_buffer[m_begin], m_end - m_begin);
+        m_end -= m_begin;
+        m_begin = 0;
+    }
+
+    // Grow to fit a frame whose length is known, or, for delimited frames, one that has filled the whole buffer.
+    size_t frameLimit = m_format.maxFrameSize + std::max(kMaxVarintSize, m_format.delimiterLength);
+    if (m_needed > m_buffer.size())
+        m_buffer.resize(m_needed);
+    else if (m_end == m_buffer.size())
+        m_buffer.resize(std::max(m_buffer.size() + 1, std::min(m_buffer.size() * 2, frameLimit)));
+
+    return std::make_pair(&m_buffer[m_end], m_buffer.size() - m_end);
+}
+
+bool FrameDecoder::didRead(size_t size)
+{
+    ASSERT(size <= m_buffer.size() - m_end);
+
+    if (m_failed)
+        return false;
+
+    m_end += size;
+    decode();
+    return !m_failed;
+}
+
+bool FrameDecoder::feed(const char* data, size_t size)
+{
+    while (size && !m_failed) {
+        std::pair<char*, size_t> space = readBuffer();
+        size_t chunk = std::min(size, space.second);
+        memcpy(space.first, data, chunk);
+        didRead(chunk);
+        data += chunk;
+        size -= chunk;
+    }
+
+    return !m_failed;
+}
+
+void FrameDecoder::decode()
+{
+    while (!m_failed && m_begin < m_end) {
+        const char* data = &m_buffer[m_begin];
+        size_t available = m_end - m_begin;
+        size_t headerSize = 0;
+        size_t frameSize;
+        size_t trailerSize = 0;
+
+        if (m_format.kind == FrameFormat::Delimited) {
+            if (!findDelimiter(data, available, frameSize))
+                break;
+            trailerSize = m_format.delimiterLength;
+        } else if (!parseLength(data, available, headerSize, frameSize))
+            break;
+
+        if (frameSize > m_format.maxFrameSize) {
+            fail();
+            break;
+        }
+
+        size_t totalSize = headerSize + frameSize + trailerSize;
+        if (available < totalSize) {
+            m_needed = totalSize;
+            break;
+        }
+
+        m_begin += totalSize;
+        m_scanned = 0;
+        m_needed = 0;
+        m_client->handleDidDecodeFrame(this, data + headerSize, frameSize);
+    }
+
+    // Everything was consumed, so the next read can start at the front without moving anything.
+    if (m_begin == m_end)
+        m_begin = m_end = 0;
+}
+
+bool FrameDecoder::parseLength(const char* data, size_t available, size_t& headerSize, size_t& frameSize)
+{
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+
+    if (m_format.kind == FrameFormat::FixedLength) {
+        if (available < m_format.lengthSize)
+            return false;
+
+        frameSize = 0;
+        for (unsigned i = 0; i < m_format.lengthSize; ++i)
+            frameSize = frameSize << 8 | bytes[i];
+        headerSize = m_format.lengthSize;
+        return true;
+    }
+
+    ULONGLONG length = 0;
+    for (size_t i = 0; i < std::min(available, kMaxVarintSize); ++i) {
+        length |= static_cast<ULONGLONG>(bytes[i] & 0x7f) << (i * 7);
+        if (bytes[i] & 0x80)
+            continue;
+
+        // Anything the frame limit can't hold is rejected before it's narrowed to size_t.
+        frameSize = length > m_format.maxFrameSize ? m_format.maxFrameSize + 1 : static_cast<size_t>(length);
+        headerSize = i + 1;
+        return true;
+    }
+
+    if (available >= kMaxVarintSize)
+        fail();
+    return false;
+}
+
+bool FrameDecoder::findDelimiter(const char* data, size_t available, size_t& frameSize)
+{
+    // memchr is vectorized in the C runtime, so it covers the bulk of the scan and only candidates get compared in
+    // full. The scan picks up where the previous read left it.
+    const char* end = data + available;
+    const char* candidate = data + m_scanned;
+    while ((candidate = static_cast<const char*>(memchr(candidate, m_format.delimiter[0], end - candidate)))) {
+        if (static_cast<size_t>(end - candidate) < m_format.delimiterLength)
+            break;
+        if (!memcmp(candidate, m_format.delimiter, m_format.delimiterLength)) {
+            frameSize = candidate - data;
+            return true;
+        }
+        ++candidate;
+    }
+
+    // A delimiter may be starting at the very end; it's looked at again once the rest of it has arrived.
+    m_scanned = candidate ? candidate - data : available;
+    if (m_scanned > m_format.maxFrameSize)
+        fail();
+    return false;
+}
+
+FrameEncoder::FrameEncoder(const FrameFormat& format)
+    : m_format(format)
+    , m_size(0)
+    , m_reservedHeaderSize(0)
+    , m_reservedSize(0)
+{
+}
+
+size_t FrameEncoder::headerSize(size_t frameSize) const
+{
+    switch (m_format.kind) {
+    case FrameFormat::FixedLength:
+        return m_format.lengthSize;
+    case FrameFormat::Varint:
+        return varintSize(frameSize);
+    default:
+        return 0;
+    }
+}
+
+char* FrameEncoder::reserve(size_t maximumSize)
+{
+    ASSERT(maximumSize <= m_format.maxFrameSize);
+
+    m_reservedHeaderSize = headerSize(maximumSize);
+    m_reservedSize = maximumSize;
+
+    size_t needed = m_size + m_reservedHeaderSize + maximumSize + m_format.delimiterLength;
+    if (m_buffer.size() < needed)
+        m_buffer.resize(std::max(needed, m_buffer.size() * 2));
+
+    return &m_buffer[m_size + m_reservedHeaderSize];
+}
+
+void FrameEncoder::commit(size_t size)
+{
+    ASSERT(size <= m_reservedSize);
+
+    unsigned char* header = reinterpret_cast<unsigned char*>(&m_buffer[m_size]);
+    switch (m_format.kind) {
+    case FrameFormat::FixedLength:
+        for (unsigned i = 0; i < m_format.lengthSize; ++i)
+            header[i] = static_cast<unsigned char>(size >> ((m_format.lengthSize - 1 - i) * 8));
+        break;
+    case FrameFormat::Varint: {
+        ULONGLONG length = size;
+        for (size_t i = 0; i < m_reservedHeaderSize; ++i) {
+            header[i] = static_cast<unsigned char>(length & 0x7f) | (i + 1 < m_reservedHeaderSize ? 0x80 : 0);
+            length >>= 7;
+        }
+        break;
+    }
+    case FrameFormat::Delimited:
+        memcpy(header + size, m_format.delimiter, m_format.delimiterLength);
+        break;
+    }
+
+    m_size += m_reservedHeaderSize + size + m_format.delimiterLength;
+    m_reservedHeaderSize = 0;
+    m_reservedSize = 0;
+}
+
+void FrameEncoder::append(const void* payload, size_t size)
+{
+    memcpy(reserve(size), payload, size);
+    commit(size);
+}
@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2016 Daewoong Jang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "includes.h"
+#include <vector>
+
+// How frames are laid out on a byte stream: behind a fixed-size big-endian length, behind a varint (LEB128) length, or
+// ended by a delimiter of up to four bytes such as "\r\n" or a single NUL. Frames larger than maxFrameSize, not
+// counting the length or the delimiter, are a violation of the format.
+struct FrameFormat {
+    enum Kind { FixedLength, Varint, Delimited };
+
+    static FrameFormat fixedLength(unsigned lengthSize, size_t maxFrameSize);
+    static FrameFormat varint(size_t maxFrameSize);
+    static FrameFormat delimited(const char* delimiter, size_t delimiterLength, size_t maxFrameSize);
+
+    Kind kind;
+    unsigned lengthSize;
+    char delimiter[4];
+    size_t delimiterLength;
+    size_t maxFrameSize;
+};
+
+// Reassembles frames from a stream that arrives in arbitrary pieces. Reads go straight into the decoder's buffer,
+// and every complete frame is handed to the client as a view into that buffer, so nothing is copied on the way.
+// What's left of a partial frame is moved to the front of the buffer when the room behind it runs short, and the
+// buffer grows when a single frame needs more than it holds.
+//
+//     std::pair<char*, size_t> space = decoder.readBuffer();
+//     handle->read(space.first, space.second, handler);
+//     ...
+//     if (!decoder.didRead(bytesRead))
+//         handle->close();
+class FrameDecoder final {
+public:
+    class Client {
+    public:
+        // |frame| points into the decoder's buffer and is only valid until the call returns, which must not feed the
+        // decoder any more data.
+        virtual void handleDidDecodeFrame(FrameDecoder*, const char* frame, size_t size) = 0;
+    };
+
+    FrameDecoder(const FrameFormat&, Client*, size_t bufferSize = 64 * 1024);
+
+    // Where the next read should go. Only valid until the next call into the decoder.
+    std::pair<char*, size_t> readBuffer();
+
+    // Decodes |size| bytes that were read into readBuffer() and delivers the frames they complete. Returns false once
+    // the stream has violated the format; nothing is decoded after that.
+    bool didRead(size_t size);
+
+    // Copies data that arrived in a buffer of its own into the decoder, and decodes it.
+    bool feed(const char*, size_t);
+
+    size_t bufferedBytes() const { return m_end - m_begin; }
+    bool failed() const { return m_failed; }
+
+private:
+    void decode();
+    bool parseLength(const char* data, size_t available, size_t& headerSize, size_t& frameSize);
+    bool findDelimiter(const char* data, size_t available, size_t& frameSize);
+    void fail() { m_failed = true; }
+
+    FrameFormat m_format;
+    Client* m_client;
+    std::vector<char> m_buffer;
+    size_t m_begin;
+    size_t m_end;
+    // Delimited frames: how far the current frame has already been scanned without finding the delimiter.
+    size_t m_scanned;
+    // Length-prefixed frames: how many bytes the current frame takes up in total, once its length is known.
+    size_t m_needed;
+    bool m_failed;
+};
+
+// Builds frames for a format in an outbound buffer. reserve() leaves room in front of the payload for the largest
+// length it could need, so the payload can be produced in place and commit() only fills in the header. Frames are
+// appended back to back, ready to go out with a single write.
+class FrameEncoder final {
+public:
+    explicit FrameEncoder(const FrameFormat&);
+
+    // Returns room for a payload of up to |maximumSize| bytes, valid until commit().
+    char* reserve(size_t maximumSize);
+
+    // Finishes the reserved frame with a payload of |size| bytes. A varint shorter than the room reserved for it is
+    // padded with continuation bytes, which FrameDecoder and other LEB128 readers accept.
+    void commit(size_t size);
+
+    void append(const void* payload, size_t size);
+
+    const char* data() const { return m_buffer.empty() ? nullptr : &m_buffer[0]; }
+    size_t size() const { return m_size; }
+    void clear() { m_size = 0; }
+
+private:
+    size_t headerSize(size_t frameSize) const;
+
+    FrameFormat m_format;
+    std::vector<char> m_buffer;
+    size_t m_size;
+    size_t m_reservedHeaderSize;
+    size_t m_reservedSize;
+};
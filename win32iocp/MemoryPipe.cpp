@@ -0,0 +1,432 @@
+/*
+ * Copyright (C) 2016 Daewoong Jang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "MemoryPipe.h"
+
+#include <algorithm>
+#include <mutex>
+#include <random>
+#include <vector>
+
+// What the kernel leaves in Internal for the outcomes a pipe can have.
+static const ULONG_PTR kStatusSuccess = 0;
+static const ULONG_PTR kStatusCancelled = 0xC0000120;
+static const ULONG_PTR kStatusConnectionReset = 0xC000020D;
+
+// A completion held back by a fault. It queues itself when its timer fires. The connection owns it, and frees it once
+// it has fired or the pipe it belongs to has closed, whichever comes first.
+struct DelayedCompletion {
+    DelayedCompletion(CompletionPort* port, CompletionKey* key, CompletionStatus* status, DWORD numberOfBytesTransferred)
+        : timer([this] { fire(); })
+        , port(port)
+        , key(key)
+        , status(status)
+        , numberOfBytesTransferred(numberOfBytesTransferred)
+        , fired(false)
+    {
+    }
+
+    void fire()
+    {
+        if (!port->postCompletion(key, status, numberOfBytesTransferred))
+            ASSERT_NOT_REACHED();
+        fired = true;
+    }
+
+    CompletionPort::Timer timer;
+    CompletionPort* port;
+    CompletionKey* key;
+    CompletionStatus* status;
+    DWORD numberOfBytesTransferred;
+    std::atomic<bool> fired;
+};
+
+// The state both ends share, all of it guarded by a single lock.
+struct MemoryPipe::Connection {
+    struct PendingOperation {
+        MemoryPipe* owner;
+        CompletionStatus* status;
+        char* buffer;
+        const char* data;
+        size_t size;
+        size_t transferred;
+    };
+
+    // The bytes flowing from one side to the other, in a ring buffer, and the operations waiting on them.
+    struct Direction {
+        size_t take(char* destination, size_t count);
+        size_t give(const char* source, size_t count);
+
+        std::vector<char> buffer;
+        size_t head;
+        size_t size;
+        PendingOperation read;
+        PendingOperation write;
+        bool senderClosed;
+        bool receiverClosed;
+    };
+
+    Connection(std::shared_ptr<CompletionPort> port, size_t bufferSize, const FaultPlan* faultPlan, unsigned seed)
+        : port(port)
+        , reset(false)
+        , hasFaults(!!faultPlan)
+        , random(seed)
+    {
+        if (faultPlan)
+            faults = *faultPlan;
+
+        for (unsigned side = 0; side < 2; ++side) {
+            Direction& direction = directions[side];
+            direction.buffer.resize(bufferSize);
+            direction.head = direction.size = 0;
+            direction.read.status = direction.write.status = nullptr;
+            direction.senderClosed = direction.receiverClosed = false;
+        }
+    }
+
+    // Draws a fault; the generator only advances for faults that are part of the plan.
+    bool draw(double chance)
+    {
+        return hasFaults && chance > 0 && random() < chance * 4294967296.0;
+    }
+
+    ~Connection();
+
+    void pump();
+    void complete(PendingOperation&, ULONG_PTR result, size_t numberOfBytesTransferred);
+    void freeFiredCompletions();
+    void cancelDelayedCompletions(MemoryPipe* owner);
+
+    std::mutex lock;
+    std::shared_ptr<CompletionPort> port;
+    Direction directions[2];
+    std::vector<std::unique_ptr<DelayedCompletion>> delayed;
+    bool reset;
+    bool hasFaults;
+    FaultPlan faults;
+    std::mt19937 random;
+};
+
+MemoryPipe::Connection::~Connection()
+{
+    // Both ends have closed, so everything left has fired, though a callback may still be on its way out.
+    for (size_t i = 0; i < delayed.size(); ++i)
+        port->cancelTimer(&delayed[i]->timer);
+}
+
+size_t MemoryPipe::Connection::Direction::take(char* destination, size_t count)
+{
+    size_t taken = std::min(count, size);
+    size_t first = std::min(taken, buffer.size() - head);
+    memcpy(destination, &buffer[head], first);
+    memcpy(destination + first, &buffer[0], taken - first);
+    head = (head + taken) % buffer.size();
+    size -= taken;
+    return taken;
+}
+
+size_t MemoryPipe::Connection::Direction::give(const char* source, size_t count)
+{
+    size_t given = std::min(count, buffer.size() - size);
+    size_t tail = (head + size) % buffer.size();
+    size_t first = std::min(given, buffer.size() - tail);
+    memcpy(&buffer[tail], source, first);
+    memcpy(&buffer[0], source + first, given - first);
+    size += given;
+    return given;
+}
+
+void MemoryPipe::Connection::pump()
+{
+    // Moves whatever can move in each direction, from the pending write through the buffer to the pending read, and
+    // completes the operations that are done.
+    for (unsigned side = 0; side < 2; ++side) {
+        Direction& direction = directions[side];
+        PendingOperation& read = direction.read;
+        PendingOperation& write = direction.write;
+
+        if (reset) {
+            complete(read, kStatusConnectionReset, 0);
+            complete(write, kStatusConnectionReset, 0);
+            continue;
+        }
+
+        // Nobody is going to read what's written anymore.
+        if (direction.receiverClosed) {
+            direction.size = 0;
+            complete(write, kStatusConnectionReset, 0);
+            continue;
+        }
+
+        if (read.status) {
+            read.transferred = direction.take(read.buffer, read.size);
+
+            // The buffer has run dry, so the rest goes straight from the writer to the reader.
+            if (read.transferred < read.size && write.status) {
+                size_t count = std::min(read.size - read.transferred, write.size - write.transferred);
+                memcpy(read.buffer + read.transferred, write.data + write.transferred, count);
+                read.transferred += count;
+                write.transferred += count;
+            }
+        }
+
+        if (write.status) {
+            write.transferred += direction.give(write.data + write.transferred, write.size - write.transferred);
+            if (write.transferred == write.size)
+                complete(write, kStatusSuccess, write.size);
+        }
+
+        if (read.status && (read.transferred || (direction.senderClosed && !direction.size)))
+            complete(read, kStatusSuccess, read.transferred);
+    }
+}
+
+void MemoryPipe::Connection::complete(PendingOperation& operation, ULONG_PTR result, size_t numberOfBytesTransferred)
+{
+    CompletionStatus* status = operation.status;
+    if (!status)
+        return;
+    operation.status = nullptr;
+
+    status->Internal = result;
+    status->InternalHigh = numberOfBytesTransferred;
+    DWORD bytes = static_cast<DWORD>(numberOfBytesTransferred);
+
+    if (draw(faults.delay) && faults.maxDelay) {
+        freeFiredCompletions();
+        delayed.push_back(std::unique_ptr<DelayedCompletion>(new DelayedCompletion(port.get(), operation.owner, status, bytes)));
+        port->armTimer(&delayed.back()->timer, 1 + random() % faults.maxDelay);
+        return;
+    }
+
+    if (!port->postCompletion(operation.owner, status, bytes))
+        ASSERT_NOT_REACHED();
+}
+
+// Cancelling the timer of one that has fired waits for its callback to return, should it still be running.
+void MemoryPipe::Connection::freeFiredCompletions()
+{
+    for (size_t i = 0; i < delayed.size();) {
+        if (!delayed[i]->fired) {
+            ++i;
+            continue;
+        }
+
+        port->cancelTimer(&delayed[i]->timer);
+        delayed[i] = std::move(delayed.back());
+        delayed.pop_back();
+    }
+}
+
+// The completions of |owner| still held back are queued right away as aborted, like its other operations.
+void MemoryPipe::Connection::cancelDelayedCompletions(MemoryPipe* owner)
+{
+    for (size_t i = 0; i < delayed.size();) {
+        DelayedCompletion& completion = *delayed[i];
+        if (completion.key != owner) {
+            ++i;
+            continue;
+        }
+
+        port->cancelTimer(&completion.timer);
+        if (!completion.fired) {
+            completion.status->Internal = kStatusCancelled;
+            completion.status->InternalHigh = 0;
+            if (!port->postCompletion(owner, completion.status, 0))
+                ASSERT_NOT_REACHED();
+        }
+        delayed[i] = std::move(delayed.back());
+        delayed.pop_back();
+    }
+}
+
+std::pair<std::shared_ptr<MemoryPipe>, std::shared_ptr<MemoryPipe>> MemoryPipe::createPair(std::shared_ptr<CompletionPort> port, Client* first, Client* second, size_t bufferSize, const FaultPlan* faultPlan, unsigned seed)
+{
+    ASSERT(port && bufferSize);
+
+    std::shared_ptr<Connection> connection = std::make_shared<Connection>(port, bufferSize, faultPlan, seed);
+    std::shared_ptr<MemoryPipe> ends[2] = {
+        std::shared_ptr<MemoryPipe>(new MemoryPipe(connection, 0, port, first)),
+        std::shared_ptr<MemoryPipe>(new MemoryPipe(connection, 1, port, second)),
+    };
+
+    // Each end holds on to itself until it has closed, the way the port holds on to a registered handle's key.
+    ends[0]->m_protectedThis = ends[0];
+    ends[1]->m_protectedThis = ends[1];
+    return std::make_pair(ends[0], ends[1]);
+}
+
+MemoryPipe::MemoryPipe(std::shared_ptr<Connection> connection, unsigned side, std::shared_ptr<CompletionPort> port, Client* client)
+    : m_connection(connection)
+    , m_side(side)
+    , m_port(port)
+    , m_client(client)
+    , m_closing(false)
+    , m_pendingOperations(0)
+    , m_closed(false)
+    , m_didClose(false)
+{
+}
+
+MemoryPipe::~MemoryPipe()
+{
+    ASSERT(!m_pendingOperations);
+}
+
+std::pair<MemoryPipe::ErrorCode, size_t> MemoryPipe::read(void* buffer, size_t size, CompletionHandler* handler)
+{
+    // A zero byte read would be indistinguishable from the end of the stream.
+    if (m_closing || !size)
+        return std::make_pair(NonblockIoHandle::InvalidOperation, 0);
+
+    Connection& connection = *m_connection;
+    std::lock_guard<std::mutex> lock(connection.lock);
+    Connection::PendingOperation& read = connection.directions[!m_side].read;
+    if (read.status)
+        return std::make_pair(NonblockIoHandle::InvalidOperation, 0);
+
+    if (connection.draw(connection.faults.reset))
+        connection.reset = true;
+
+    Connection::PendingOperation operation = { this, allocateCompletionStatus(NonblockIoHandle::Read, handler), static_cast<char*>(buffer), nullptr, size, 0 };
+    read = operation;
+    connection.pump();
+    return std::make_pair(NonblockIoHandle::Pending, size);
+}
+
+std::pair<MemoryPipe::ErrorCode, size_t> MemoryPipe::write(const void* data, size_t size, CompletionHandler* handler)
+{
+    if (m_closing || !size)
+        return std::make_pair(NonblockIoHandle::InvalidOperation, 0);
+
+    Connection& connection = *m_connection;
+    std::lock_guard<std::mutex> lock(connection.lock);
+    Connection::PendingOperation& write = connection.directions[m_side].write;
+    if (write.status)
+        return std::make_pair(NonblockIoHandle::InvalidOperation, 0);
+
+    if (connection.draw(connection.faults.reset))
+        connection.reset = true;
+    else if (size > 1 && connection.draw(connection.faults.partialWrite))
+        size = 1 + connection.random() % (size - 1);
+
+    Connection::PendingOperation operation = { this, allocateCompletionStatus(NonblockIoHandle::Write, handler), nullptr, static_cast<const char*>(data), size, 0 };
+    write = operation;
+    connection.pump();
+    return std::make_pair(NonblockIoHandle::Pending, size);
+}
+
+void MemoryPipe::close()
+{
+    if (m_closing.exchange(true))
+        return;
+
+    if (!m_port->closeKey(this))
+        m_closing = false;
+}
+
+CompletionStatus* MemoryPipe::allocateCompletionStatus(NonblockIoHandle::Operation operation, CompletionHandler* handler)
+{
+    CompletionStatus* status = m_port->allocateCompletionStatus();
+    status->user = reinterpret_cast<void*>(static_cast<int>(operation));
+    status->buffer = nullptr;
+    status->context = handler;
+#if ENABLE_STATISTICS
+    status->submitTime = currentTicks();
+#endif
+
+    ++m_pendingOperations;
+    return status;
+}
+
+void MemoryPipe::didCompleteOperation()
+{
+    ASSERT(m_pendingOperations);
+
+    // The last operation aborted by closing has come back.
+    if (!--m_pendingOperations && m_closed)
+        didClose();
+}
+
+void MemoryPipe::completionCallback(CompletionStatus* passedStatus, size_t bytesTransferred)
+{
+    CompletionStatus status(*passedStatus);
+    m_port->freeCompletionStatus(passedStatus);
+
+    NonblockIoHandle::Operation operation = static_cast<NonblockIoHandle::Operation>(reinterpret_cast<int>(status.user));
+    CompletionHandler* handler = static_cast<CompletionHandler*>(status.context);
+
+    // The same outcomes a socket reports for aborted and reset operations. A reset closes the pipe, and the client
+    // hears about it once the close is through.
+    if (status.Internal == kStatusCancelled) {
+        if (handler)
+            handler->handleCompletion(this, NonblockIoHandle::UnhandledError, ERROR_OPERATION_ABORTED);
+    } else if (status.Internal == kStatusConnectionReset) {
+        if (handler)
+            handler->handleCompletion(this, NonblockIoHandle::Shutdown, 0);
+        else
+            close();
+    } else if (handler)
+        handler->handleCompletion(this, NonblockIoHandle::Complete, bytesTransferred);
+    else if (operation == NonblockIoHandle::Read)
+        m_client->handleDidRead(this, bytesTransferred);
+    else
+        m_client->handleDidWrite(this, bytesTransferred);
+
+    // Counted down only after the completion has been handled, since the last one after a close releases this.
+    didCompleteOperation();
+}
+
+void MemoryPipe::destroyKeyCallback()
+{
+    // The local reference keeps this alive should the last aborted operation finish the close on another worker
+    // before we're done here.
+    std::shared_ptr<CompletionKey> protectedThis = m_protectedThis;
+    {
+        Connection& connection = *m_connection;
+        std::lock_guard<std::mutex> lock(connection.lock);
+        Connection::Direction& inbound = connection.directions[!m_side];
+        Connection::Direction& outbound = connection.directions[m_side];
+        connection.complete(inbound.read, kStatusCancelled, 0);
+        connection.complete(outbound.write, kStatusCancelled, 0);
+        inbound.receiverClosed = true;
+        outbound.senderClosed = true;
+        connection.pump();
+        connection.cancelDelayedCompletions(this);
+    }
+
+    m_closed = true;
+    if (!m_pendingOperations)
+        didClose();
+}
+
+void MemoryPipe::didClose()
+{
+    // Both the close and the last aborted operation may get here when they race on different workers.
+    if (m_didClose.exchange(true))
+        return;
+
+    std::shared_ptr<CompletionKey> protectedThis;
+    protectedThis.swap(m_protectedThis);
+    m_client->handleDidClose(this);
+}
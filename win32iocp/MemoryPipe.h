@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2016 Daewoong Jang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "includes.h"
+#include "CompletionPort.h"
+#include "NonblockIoHandle.h"
+#include <atomic>
+#include <memory>
+
+// One end of an in-process byte stream, for measuring the library's own dispatch cost without the network stack in the
+// way, and for making races reproducible. It keeps the completion contract of NonblockIoHandle, with a fixed-size
+// buffer per direction standing in for the socket buffers, except that nothing completes inline: every result is
+// queued on the port, with Internal and InternalHigh filled in, and reaches the client through completionCallback like
+// any other completion. At most one read and one write may be outstanding at a time.
+//
+// A FaultPlan makes the pair misbehave the way real connections do. Its faults are drawn from a generator seeded per
+// pair, in the order operations are issued, so a pair on a manual port driven from one thread replays the same run
+// for the same seed.
+class MemoryPipe final : public CompletionKey {
+public:
+    typedef NonblockIoHandle::ErrorCode ErrorCode;
+
+    class Client {
+    public:
+        virtual void handleDidClose(MemoryPipe*) = 0;
+        virtual void handleDidRead(MemoryPipe*, size_t) = 0;
+        virtual void handleDidWrite(MemoryPipe*, size_t) = 0;
+    };
+
+    class CompletionHandler {
+    public:
+        virtual void handleCompletion(MemoryPipe*, ErrorCode, size_t) = 0;
+    };
+
+    // Each chance is between zero and one. A partial write accepts only part of what it was given, a reset fails
+    // every operation on both ends from then on, and a delayed completion is held back for up to |maxDelay|
+    // milliseconds of the port's clock before it's queued.
+    struct FaultPlan {
+        double partialWrite;
+        double reset;
+        double delay;
+        DWORD maxDelay;
+    };
+
+    static std::pair<std::shared_ptr<MemoryPipe>, std::shared_ptr<MemoryPipe>> createPair(std::shared_ptr<CompletionPort>, Client*, Client*, size_t bufferSize = 64 * 1024, const FaultPlan* = nullptr, unsigned seed = 0);
+    ~MemoryPipe();
+
+    // A read completes as soon as any data has arrived, and with zero bytes once the other end has closed and
+    // everything it wrote has been read. A write completes once all of it is buffered.
+    std::pair<ErrorCode, size_t> read(void*, size_t, CompletionHandler* = nullptr);
+    std::pair<ErrorCode, size_t> write(const void*, size_t, CompletionHandler* = nullptr);
+
+    // Queued behind the completions already on the port, like closing a handle. Outstanding operations are aborted,
+    // the other end reads what's left and then the end of the stream, and Client::handleDidClose follows once the
+    // aborted operations have come back. The pipe stays alive until then, whoever else holds on to it.
+    void close();
+
+    unsigned pendingOperations() const { return m_pendingOperations; }
+
+private:
+    struct Connection;
+
+    MemoryPipe(std::shared_ptr<Connection>, unsigned side, std::shared_ptr<CompletionPort>, Client*);
+
+    CompletionStatus* allocateCompletionStatus(NonblockIoHandle::Operation, CompletionHandler*);
+    void didCompleteOperation();
+
+    void completionCallback(CompletionStatus*, size_t) override;
+    void destroyKeyCallback() override;
+    void didClose();
+
+    std::shared_ptr<Connection> m_connection;
+    unsigned m_side;
+    std::shared_ptr<CompletionPort> m_port;
+    Client* m_client;
+    std::atomic<bool> m_closing;
+    std::atomic<unsigned> m_pendingOperations;
+    std::atomic<bool> m_closed;
+    std::atomic<bool> m_didClose;
+    std::shared_ptr<CompletionKey> m_protectedThis;
+};
@@ -22,7 +22,7 @@
 
 #include "NonblockIoHandle.h"
 
-#include <mutex>
+#include <mswsock.h>
 
 std::shared_ptr<NonblockIoHandle> NonblockIoHandle::create(HANDLE handle, std::shared_ptr<CompletionPort> port, Client* client)
 {
@@ -34,13 +34,107 @@ std::shared_ptr<NonblockIoHandle> NonblockIoHandle::create(SOCKET socket, std::s
     return activate(std::shared_ptr<NonblockIoHandle>(new NonblockIoHandle(socket, port, client)));
 }
 
+// The errors a peer that went away shows up as: a reset or abort, either way round, a pipe with nobody on the other
+// end, or the end of a file.
+static bool isEndOfStream(DWORD error)
+{
+    switch (error) {
+    case ERROR_BROKEN_PIPE:
+    case ERROR_NETNAME_DELETED:
+    case ERROR_CONNECTION_ABORTED:
+    case WSAECONNRESET:
+    case WSAECONNABORTED:
+    case WSAESHUTDOWN:
+    case ERROR_HANDLE_EOF:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// File streams start with this many reads in flight and deepen as the client catches up with them.
+static const unsigned kInitialReadAhead = 2;
+
+// Unbuffered I/O has to be aligned to the sector size the device prefers. Without a way to ask, 4KB covers both
+// legacy and advanced format disks.
+static DWORD querySectorSize(HANDLE file)
+{
+#if (_WIN32_WINNT >= 0x0602)
+    FILE_STORAGE_INFO storageInfo;
+    if (GetFileInformationByHandleEx(file, FileStorageInfo, &storageInfo, sizeof(storageInfo)))
+        return storageInfo.PhysicalBytesPerSectorForPerformance;
+#endif
+    return 4096;
+}
+
+std::shared_ptr<NonblockIoHandle> NonblockIoHandle::openFile(LPCTSTR path, DWORD desiredAccess, DWORD creationDisposition, unsigned flags, std::shared_ptr<CompletionPort> port, Client* client)
+{
+    DWORD attributes = FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED;
+    if (flags & Unbuffered)
+        attributes |= FILE_FLAG_NO_BUFFERING;
+    if (flags & WriteThrough)
+        attributes |= FILE_FLAG_WRITE_THROUGH;
+    if (flags & SequentialScan)
+        attributes |= FILE_FLAG_SEQUENTIAL_SCAN;
+    if (flags & RandomAccess)
+        attributes |= FILE_FLAG_RANDOM_ACCESS;
+
+    HANDLE handle = CreateFile(path, desiredAccess, FILE_SHARE_READ, NULL, creationDisposition, attributes, NULL);
+    if (handle == INVALID_HANDLE_VALUE)
+        return nullptr;
+
+    // create() has already closed the handle when the port wouldn't take it.
+    std::shared_ptr<NonblockIoHandle> file = create(handle, port, client);
+    if (!file) {
+        SetLastError(ERROR_OPERATION_ABORTED);
+        return nullptr;
+    }
+
+    file->m_unbuffered = !!(flags & Unbuffered);
+    file->m_sectorSize = querySectorSize(handle);
+    return file;
+}
+
 NonblockIoHandle::NonblockIoHandle(HANDLE handle, std::shared_ptr<CompletionPort> port, Client* client)
     : m_handle(handle)
     , m_isSocket(false)
     , m_port(port)
     , m_client(client)
     , m_closing(false)
+    , m_skipCompletionPortOnSuccess(false)
+    , m_unbuffered(false)
+    , m_sectorSize(0)
+    , m_pendingOperations(0)
+    , m_closed(false)
+    , m_shuttingDown(false)
+    , m_operationTimeout(0)
+    , m_idleTimeout(0)
+    , m_lastActivity(0)
+    , m_operationTimer([this] { operationTimerFired(); })
+    , m_idleTimer([this] { idleTimerFired(); })
+    , m_coalescing(false)
+    , m_corked(false)
+    , m_flushInFlight(false)
+    , m_lowWatermark(0)
+    , m_highWatermark(0)
+    , m_queuedBytes(0)
+    , m_peakQueuedBytes(0)
+    , m_throttledWrites(0)
+    , m_throttled(false)
+    , m_throttledSince(0)
+    , m_throttledMicroseconds(0)
+    , m_readDepth(0)
+    , m_maxReadDepth(0)
+    , m_nextReadOffset(0)
+    , m_readsOutstanding(0)
+    , m_nextReadSequence(0)
+    , m_nextDeliverSequence(0)
+    , m_deliveringReads(false)
+    , m_streamEnded(false)
 {
+    m_coalescingStatistics.writes = 0;
+    m_coalescingStatistics.sends = 0;
+
     ASSERT(handle && handle != INVALID_HANDLE_VALUE);
     ASSERT(m_client);
     ASSERT(m_port);
@@ -52,7 +146,40 @@ NonblockIoHandle::NonblockIoHandle(SOCKET socket, std::shared_ptr<CompletionPort
     , m_port(port)
     , m_client(client)
     , m_closing(false)
+    , m_skipCompletionPortOnSuccess(false)
+    , m_unbuffered(false)
+    , m_sectorSize(0)
+    , m_pendingOperations(0)
+    , m_closed(false)
+    , m_shuttingDown(false)
+    , m_operationTimeout(0)
+    , m_idleTimeout(0)
+    , m_lastActivity(0)
+    , m_operationTimer([this] { operationTimerFired(); })
+    , m_idleTimer([this] { idleTimerFired(); })
+    , m_coalescing(false)
+    , m_corked(false)
+    , m_flushInFlight(false)
+    , m_lowWatermark(0)
+    , m_highWatermark(0)
+    , m_queuedBytes(0)
+    , m_peakQueuedBytes(0)
+    , m_throttledWrites(0)
+    , m_throttled(false)
+    , m_throttledSince(0)
+    , m_throttledMicroseconds(0)
+    , m_readDepth(0)
+    , m_maxReadDepth(0)
+    , m_nextReadOffset(0)
+    , m_readsOutstanding(0)
+    , m_nextReadSequence(0)
+    , m_nextDeliverSequence(0)
+    , m_deliveringReads(false)
+    , m_streamEnded(false)
 {
+    m_coalescingStatistics.writes = 0;
+    m_coalescingStatistics.sends = 0;
+
     ASSERT(socket && socket != INVALID_SOCKET);
     ASSERT(m_client);
     ASSERT(m_port);
@@ -60,53 +187,435 @@ NonblockIoHandle::NonblockIoHandle(SOCKET socket, std::shared_ptr<CompletionPort
 
 NonblockIoHandle::~NonblockIoHandle()
 {
-    ASSERT(!m_handle);
+    ASSERT(m_closed);
+    m_port->cancelTimer(&m_operationTimer);
+    m_port->cancelTimer(&m_idleTimer);
     close();
 }
 
 std::shared_ptr<NonblockIoHandle> NonblockIoHandle::activate(std::shared_ptr<NonblockIoHandle> file)
 {
-    if (!file->m_port->add(file->m_handle, file))
-        CRASH();
+    file->m_weakThis = file;
+
+    if (!file->m_port->add(file->m_handle, file)) {
+        file->m_closing = true;
+        file->closeNow();
+        file->m_closed = true;
+        return nullptr;
+    }
+
+#if (_WIN32_WINNT >= 0x0600)
+    // Operations that complete synchronously are reported through the return value of read() and write(),
+    // so there's no need to pay for a completion packet and a trip through the completion thread as well.
+    if (file->canSkipCompletionPortOnSuccess())
+        file->m_skipCompletionPortOnSuccess = !!SetFileCompletionNotificationModes(file->m_handle, FILE_SKIP_COMPLETION_PORT_ON_SUCCESS | FILE_SKIP_SET_EVENT_ON_HANDLE);
+#endif
 
     return file;
 }
 
+bool NonblockIoHandle::canSkipCompletionPortOnSuccess() const
+{
+    if (!m_isSocket)
+        return true;
+
+    // Non-IFS layered service providers may still queue a completion for an operation that succeeded inline.
+    WSAPROTOCOL_INFO protocolInfo;
+    int protocolInfoSize = sizeof(protocolInfo);
+    if (getsockopt((SOCKET)m_handle, SOL_SOCKET, SO_PROTOCOL_INFO, reinterpret_cast<char*>(&protocolInfo), &protocolInfoSize) == SOCKET_ERROR)
+        return false;
+
+    return !!(protocolInfo.dwServiceFlags1 & XP1_IFS_HANDLES);
+}
+
 std::pair<NonblockIoHandle::ErrorCode, size_t> NonblockIoHandle::read(void* buffer, size_t bufferSize)
+{
+    return read(buffer, bufferSize, nullptr);
+}
+
+std::pair<NonblockIoHandle::ErrorCode, size_t> NonblockIoHandle::write(const void* buffer, size_t bufferSize)
+{
+    return write(buffer, bufferSize, nullptr);
+}
+
+std::pair<NonblockIoHandle::ErrorCode, size_t> NonblockIoHandle::read(void* buffer, size_t bufferSize, CompletionHandler* handler)
 {
     ASSERT(!m_closing);
 
+    if (m_shuttingDown)
+        return std::make_pair(Shutdown, 0);
+
     if (!buffer || bufferSize == 0)
         return std::make_pair(InvalidOperation, 0);
 
+    CompletionStatus* status = allocateCompletionStatus(Read, nullptr, handler);
     DWORD bytesRead = 0;
-    if (!ReadFile(m_handle, buffer, bufferSize, &bytesRead, allocateCompletionStatus(Read)))
-        return handleError(Read, bytesRead);
-
-    return std::make_pair(Complete, bytesRead);
+    BOOL succeeded = ReadFile(m_handle, buffer, bufferSize, &bytesRead, status);
+    return didStartOperation(status, succeeded, bytesRead);
 }
 
-std::pair<NonblockIoHandle::ErrorCode, size_t> NonblockIoHandle::write(const void* buffer, size_t bufferSize)
+std::pair<NonblockIoHandle::ErrorCode, size_t> NonblockIoHandle::write(const void* buffer, size_t bufferSize, CompletionHandler* handler)
 {
     ASSERT(!m_closing);
 
+    if (m_shuttingDown)
+        return std::make_pair(Shutdown, 0);
+
     if (!buffer || bufferSize == 0)
         return std::make_pair(InvalidOperation, 0);
 
+    if (!acquireWriteCredit(bufferSize))
+        return std::make_pair(Throttled, 0);
+
+    if (!handler && (m_coalescing || m_corked)) {
+        // A flush that went out inline has no completion to report it, so it's reported here, outside the write lock.
+        std::pair<ErrorCode, size_t> result = enqueueWrite(buffer, bufferSize);
+        if (result.first == Complete && m_skipCompletionPortOnSuccess)
+            m_client->handleDidWrite(this, result.second);
+        return result;
+    }
+
+    CompletionStatus* status = allocateCompletionStatus(Write, nullptr, handler);
+    status->queuedBytes = bufferSize;
     DWORD bytesSent = 0;
-    if (!WriteFile(m_handle, buffer, bufferSize, &bytesSent, allocateCompletionStatus(Write)))
-        return handleError(Write, bytesSent);
+    BOOL succeeded = WriteFile(m_handle, buffer, bufferSize, &bytesSent, status);
+    return didStartOperation(status, succeeded, bytesSent);
+}
 
-    return std::make_pair(Complete, bytesSent);
+static void setOffset(CompletionStatus* status, ULONGLONG offset)
+{
+    status->Offset = static_cast<DWORD>(offset);
+    status->OffsetHigh = static_cast<DWORD>(offset >> 32);
+}
+
+bool NonblockIoHandle::isAligned(ULONGLONG offset, const void* buffer, size_t size) const
+{
+    if (!m_unbuffered)
+        return true;
+
+    return !(offset % m_sectorSize) && !(reinterpret_cast<ULONG_PTR>(buffer) % m_sectorSize) && !(size % m_sectorSize);
+}
+
+std::pair<NonblockIoHandle::ErrorCode, size_t> NonblockIoHandle::readAt(ULONGLONG offset, void* buffer, size_t bufferSize, CompletionHandler* handler)
+{
+    ASSERT(!m_closing);
+
+    if (m_shuttingDown)
+        return std::make_pair(Shutdown, 0);
+
+    if (!buffer || bufferSize == 0 || m_isSocket || !isAligned(offset, buffer, bufferSize))
+        return std::make_pair(InvalidOperation, 0);
+
+    CompletionStatus* status = allocateCompletionStatus(Read, nullptr, handler);
+    setOffset(status, offset);
+    DWORD bytesRead = 0;
+    BOOL succeeded = ReadFile(m_handle, buffer, bufferSize, &bytesRead, status);
+    return didStartOperation(status, succeeded, bytesRead);
+}
+
+std::pair<NonblockIoHandle::ErrorCode, size_t> NonblockIoHandle::writeAt(ULONGLONG offset, const void* buffer, size_t bufferSize, CompletionHandler* handler)
+{
+    ASSERT(!m_closing);
+
+    if (m_shuttingDown)
+        return std::make_pair(Shutdown, 0);
+
+    if (!buffer || bufferSize == 0 || m_isSocket || !isAligned(offset, buffer, bufferSize))
+        return std::make_pair(InvalidOperation, 0);
+
+    if (!acquireWriteCredit(bufferSize))
+        return std::make_pair(Throttled, 0);
+
+    CompletionStatus* status = allocateCompletionStatus(Write, nullptr, handler);
+    status->queuedBytes = bufferSize;
+    setOffset(status, offset);
+    DWORD bytesWritten = 0;
+    BOOL succeeded = WriteFile(m_handle, buffer, bufferSize, &bytesWritten, status);
+    return didStartOperation(status, succeeded, bytesWritten);
+}
+
+std::pair<NonblockIoHandle::ErrorCode, size_t> NonblockIoHandle::read(BufferPool& pool)
+{
+    ASSERT(!m_closing);
+
+    if (m_shuttingDown)
+        return std::make_pair(Shutdown, 0);
+
+    PooledBuffer* buffer = pool.acquire();
+    if (!buffer)
+        return std::make_pair(UnhandledError, ERROR_NOT_ENOUGH_MEMORY);
+
+    CompletionStatus* status = allocateCompletionStatus(Read, buffer);
+    DWORD bytesRead = 0;
+    BOOL succeeded = ReadFile(m_handle, buffer->data, buffer->capacity, &bytesRead, status);
+    return didStartOperation(status, succeeded, bytesRead);
+}
+
+std::pair<NonblockIoHandle::ErrorCode, size_t> NonblockIoHandle::write(PooledBuffer* buffer, size_t bufferSize)
+{
+    ASSERT(!m_closing);
+
+    if (m_shuttingDown)
+        return std::make_pair(Shutdown, 0);
+
+    if (!buffer || bufferSize == 0 || bufferSize > buffer->capacity)
+        return std::make_pair(InvalidOperation, 0);
+
+    if (!acquireWriteCredit(bufferSize))
+        return std::make_pair(Throttled, 0);
+
+    CompletionStatus* status = allocateCompletionStatus(Write, buffer);
+    status->queuedBytes = bufferSize;
+    DWORD bytesSent = 0;
+    BOOL succeeded = WriteFile(m_handle, buffer->data, bufferSize, &bytesSent, status);
+    return didStartOperation(status, succeeded, bytesSent);
+}
+
+std::pair<NonblockIoHandle::ErrorCode, size_t> NonblockIoHandle::readv(const WSABUF* buffers, size_t bufferCount)
+{
+    ASSERT(!m_closing);
+
+    if (m_shuttingDown)
+        return std::make_pair(Shutdown, 0);
+
+    if (!m_isSocket || !buffers || bufferCount == 0)
+        return std::make_pair(InvalidOperation, 0);
+
+    CompletionStatus* status = allocateCompletionStatus(Read);
+    DWORD bytesRead = 0;
+    DWORD flags = 0;
+    BOOL succeeded = WSARecv((SOCKET)m_handle, const_cast<WSABUF*>(buffers), bufferCount, &bytesRead, &flags, status, NULL) != SOCKET_ERROR;
+    return didStartOperation(status, succeeded, bytesRead);
+}
+
+std::pair<NonblockIoHandle::ErrorCode, size_t> NonblockIoHandle::writev(const WSABUF* buffers, size_t bufferCount)
+{
+    ASSERT(!m_closing);
+
+    if (m_shuttingDown)
+        return std::make_pair(Shutdown, 0);
+
+    if (!m_isSocket || !buffers || bufferCount == 0)
+        return std::make_pair(InvalidOperation, 0);
+
+    size_t bufferSize = 0;
+    for (size_t i = 0; i < bufferCount; ++i)
+        bufferSize += buffers[i].len;
+    if (!acquireWriteCredit(bufferSize))
+        return std::make_pair(Throttled, 0);
+
+    CompletionStatus* status = allocateCompletionStatus(Write);
+    status->queuedBytes = bufferSize;
+    DWORD bytesSent = 0;
+    BOOL succeeded = WSASend((SOCKET)m_handle, const_cast<WSABUF*>(buffers), bufferCount, &bytesSent, 0, status, NULL) != SOCKET_ERROR;
+    return didStartOperation(status, succeeded, bytesSent);
+}
+
+void NonblockIoHandle::cork()
+{
+    std::lock_guard<std::mutex> lock(m_writeLock);
+    m_corked = true;
+}
+
+void NonblockIoHandle::uncork()
+{
+    size_t bytesSent;
+    {
+        std::lock_guard<std::mutex> lock(m_writeLock);
+        m_corked = false;
+        bytesSent = flushOutbound();
+    }
+
+    // Nobody else hears about a flush that completed inline.
+    if (bytesSent)
+        m_client->handleDidWrite(this, bytesSent);
+}
+
+NonblockIoHandle::WriteCoalescingStatistics NonblockIoHandle::writeCoalescingStatistics()
+{
+    std::lock_guard<std::mutex> lock(m_writeLock);
+    return m_coalescingStatistics;
+}
+
+std::pair<NonblockIoHandle::ErrorCode, size_t> NonblockIoHandle::transmit(HANDLE file, ULONGLONG offset, DWORD length, const WSABUF* header, const WSABUF* trailer, CompletionHandler* handler)
+{
+    ASSERT(!m_closing);
+
+    if (m_shuttingDown)
+        return std::make_pair(Shutdown, 0);
+
+    if (!m_isSocket || !file || file == INVALID_HANDLE_VALUE)
+        return std::make_pair(InvalidOperation, 0);
+
+    SOCKET socket = (SOCKET)m_handle;
+    LPFN_TRANSMITFILE transmitFile = nullptr;
+    GUID transmitFileGuid = WSAID_TRANSMITFILE;
+    DWORD bytesReturned = 0;
+    if (WSAIoctl(socket, SIO_GET_EXTENSION_FUNCTION_POINTER, &transmitFileGuid, sizeof(transmitFileGuid), &transmitFile, sizeof(transmitFile), &bytesReturned, NULL, NULL) == SOCKET_ERROR)
+        return std::make_pair(UnhandledError, WSAGetLastError());
+
+    TRANSMIT_FILE_BUFFERS buffers;
+    memset(&buffers, 0, sizeof(buffers));
+    if (header) {
+        buffers.Head = header->buf;
+        buffers.HeadLength = header->len;
+    }
+    if (trailer) {
+        buffers.Tail = trailer->buf;
+        buffers.TailLength = trailer->len;
+    }
+
+    CompletionStatus* status = allocateCompletionStatus(Transmit, nullptr, handler);
+    setOffset(status, offset);
+    BOOL succeeded = transmitFile(socket, file, length, 0, status, (header || trailer) ? &buffers : NULL, 0);
+
+    // TransmitFile doesn't say how much it sent when it finishes inline; the status has it until it's released.
+    DWORD bytesSent = 0;
+    if (succeeded)
+        ::GetOverlappedResult(m_handle, status, &bytesSent, FALSE);
+    return didStartOperation(status, succeeded, bytesSent);
+}
+
+std::pair<NonblockIoHandle::ErrorCode, size_t> NonblockIoHandle::connect(const sockaddr* address, int addressLength)
+{
+    ASSERT(!m_closing);
+
+    if (m_shuttingDown)
+        return std::make_pair(Shutdown, 0);
+
+    if (!m_isSocket || !address)
+        return std::make_pair(InvalidOperation, 0);
+
+    SOCKET socket = (SOCKET)m_handle;
+    LPFN_CONNECTEX connectEx = nullptr;
+    GUID connectExGuid = WSAID_CONNECTEX;
+    DWORD bytesReturned = 0;
+    if (WSAIoctl(socket, SIO_GET_EXTENSION_FUNCTION_POINTER, &connectExGuid, sizeof(connectExGuid), &connectEx, sizeof(connectEx), &bytesReturned, NULL, NULL) == SOCKET_ERROR)
+        return std::make_pair(UnhandledError, WSAGetLastError());
+
+    sockaddr_storage localAddress;
+    memset(&localAddress, 0, sizeof(localAddress));
+    localAddress.ss_family = address->sa_family;
+    if (bind(socket, reinterpret_cast<sockaddr*>(&localAddress), addressLength) == SOCKET_ERROR && WSAGetLastError() != WSAEINVAL)
+        return std::make_pair(UnhandledError, WSAGetLastError());
+
+    CompletionStatus* status = allocateCompletionStatus(Connect);
+    BOOL succeeded = connectEx(socket, address, addressLength, NULL, 0, NULL, status);
+    return didStartOperation(status, succeeded, 0);
+}
+
+bool NonblockIoHandle::startReading(std::shared_ptr<BufferPool> pool, unsigned depth)
+{
+    ASSERT(!m_closing);
+
+    if (m_shuttingDown)
+        return false;
+
+    if (!pool || depth == 0 || !isAligned(0, nullptr, pool->bufferSize()))
+        return false;
+
+    {
+        std::lock_guard<std::mutex> lock(m_readLock);
+        if (m_readPool != pool || m_streamSlots.size() != depth) {
+            if (m_readsOutstanding)
+                return false;
+
+            StreamSlot emptySlot = { false, nullptr, 0 };
+            m_streamSlots.assign(depth, emptySlot);
+            m_readPool = pool;
+        }
+
+        // Sockets have no way to read ahead of the data, so they get the full depth right away.
+        m_maxReadDepth = depth;
+        if (m_isSocket || !m_readDepth)
+            m_readDepth = m_isSocket ? depth : std::min(depth, kInitialReadAhead);
+        postStreamReads();
+    }
+
+    deliverStreamReads();
+    return true;
+}
+
+bool NonblockIoHandle::startReadingAt(ULONGLONG offset, std::shared_ptr<BufferPool> pool, unsigned depth)
+{
+    if (m_isSocket)
+        return false;
+
+    {
+        std::lock_guard<std::mutex> lock(m_readLock);
+        if (m_readsOutstanding || !isAligned(offset, nullptr, 0))
+            return false;
+
+        m_nextReadOffset = offset;
+        m_readDepth = 0;
+        m_streamEnded = false;
+    }
+
+    return startReading(pool, depth);
+}
+
+void NonblockIoHandle::stopReading()
+{
+    std::lock_guard<std::mutex> lock(m_readLock);
+    m_readDepth = 0;
+}
+
+void NonblockIoHandle::setOperationTimeout(DWORD milliseconds)
+{
+    m_operationTimeout = milliseconds;
+    if (!milliseconds)
+        m_port->cancelTimer(&m_operationTimer);
+    else if (pendingOperations())
+        m_port->armTimer(&m_operationTimer, milliseconds);
+}
+
+void NonblockIoHandle::setIdleTimeout(DWORD milliseconds)
+{
+    m_lastActivity = m_port->currentTime();
+    m_idleTimeout = milliseconds;
+    if (!milliseconds)
+        m_port->cancelTimer(&m_idleTimer);
+    else
+        m_port->armTimer(&m_idleTimer, milliseconds);
+}
+
+bool NonblockIoHandle::migrate(std::shared_ptr<CompletionPort> port)
+{
+    ASSERT(port);
+
+    if (port == m_port)
+        return true;
+
+    if (m_closing || m_closed || pendingOperations() || m_queuedBytes || m_throttled)
+        return false;
+
+    {
+        std::lock_guard<std::mutex> lock(m_readLock);
+        if (m_readDepth || m_readsOutstanding)
+            return false;
+    }
+
+    // Timers run on the port's workers as well. Cancelling them first waits for an idle timeout that's firing on the
+    // old port, which uses m_port and may have closed the handle by the time it's done.
+    m_port->cancelTimer(&m_operationTimer);
+    m_port->cancelTimer(&m_idleTimer);
+    if (m_closing || !m_port->migrate(m_handle, port)) {
+        if (m_idleTimeout && !m_closing)
+            m_port->armTimer(&m_idleTimer, m_idleTimeout);
+        return false;
+    }
+
+    m_port = port;
+    if (m_idleTimeout)
+        m_port->armTimer(&m_idleTimer, m_idleTimeout);
+    return true;
 }
 
 void NonblockIoHandle::close()
 {
-    if (m_closing ||!m_handle)
+    if (m_closed || m_closing.exchange(true))
         return;
 
-    m_closing = true;
-
     if (!m_port->close(m_handle))
         m_closing = false;
 }
@@ -119,54 +628,529 @@ void NonblockIoHandle::closeNow()
         closesocket((SOCKET)m_handle);
     else
         CloseHandle(m_handle);
-
-    m_handle = 0;
-    m_closing = false;
 }
 
-CompletionStatus* NonblockIoHandle::allocateCompletionStatus(Operation operation)
+CompletionStatus* NonblockIoHandle::allocateCompletionStatus(Operation operation, PooledBuffer* buffer, CompletionHandler* handler)
 {
-    CompletionStatus* status = new CompletionStatus;
-    memset(status, 0, sizeof(CompletionStatus));
+    CompletionStatus* status = m_port->allocateCompletionStatus();
     status->user = reinterpret_cast<void*>(static_cast<int>(operation));
+    status->buffer = buffer;
+    status->context = handler;
+#if ENABLE_STATISTICS
+    status->submitTime = currentTicks();
+#endif
+
+    // Counted before the operation is issued, since its completion may be dequeued before the call returns.
+    willPostOperation();
     return status;
 }
 
 void NonblockIoHandle::freeCompletionStatus(CompletionStatus* status)
 {
-    delete status;
+    // Whatever happened to a send, its bytes have left the queue once its status is gone.
+    size_t queuedBytes = status->queuedBytes;
+    m_port->freeCompletionStatus(status);
+
+    if (queuedBytes)
+        releaseWriteCredit(queuedBytes);
+}
+
+void NonblockIoHandle::setWriteWatermarks(size_t low, size_t high)
+{
+    ASSERT(!high || low < high);
+    m_lowWatermark = low;
+    m_highWatermark = high;
+}
+
+NonblockIoHandle::FlowControlStatistics NonblockIoHandle::flowControlStatistics() const
+{
+    FlowControlStatistics statistics;
+    statistics.queuedBytes = m_queuedBytes;
+    statistics.peakQueuedBytes = m_peakQueuedBytes;
+    statistics.throttledWrites = m_throttledWrites;
+
+    std::lock_guard<std::mutex> lock(m_throttleLock);
+    statistics.throttledMicroseconds = m_throttledMicroseconds;
+    if (m_throttled)
+        statistics.throttledMicroseconds += ticksToMicroseconds(currentTicks() - m_throttledSince);
+    return statistics;
+}
+
+bool NonblockIoHandle::acquireWriteCredit(size_t size)
+{
+    size_t alreadyQueued = m_queuedBytes;
+    bool overWatermark = m_highWatermark && alreadyQueued && alreadyQueued + size > m_highWatermark;
+    if (!overWatermark && m_port->reserveWriteBudget(size)) {
+        size_t queuedBytes = m_queuedBytes += size;
+        size_t peakQueuedBytes = m_peakQueuedBytes;
+        while (queuedBytes > peakQueuedBytes && !m_peakQueuedBytes.compare_exchange_weak(peakQueuedBytes, queuedBytes)) { }
+        return true;
+    }
+
+    ++m_throttledWrites;
+    {
+        std::lock_guard<std::mutex> lock(m_throttleLock);
+        if (!m_throttled.exchange(true))
+            m_throttledSince = currentTicks();
+    }
+
+    if (!overWatermark) {
+        m_port->waitForWriteBudget(shared_from_this());
+        return false;
+    }
+
+    // The queue may have drained between the check and raising the flag, leaving nobody to report it.
+    if (m_queuedBytes <= m_lowWatermark) {
+        std::weak_ptr<CompletionKey> weakThis = shared_from_this();
+        m_port->post([weakThis] {
+            if (std::shared_ptr<CompletionKey> key = weakThis.lock())
+                static_cast<NonblockIoHandle*>(key.get())->becameWritable();
+        });
+    }
+
+    return false;
+}
+
+void NonblockIoHandle::releaseWriteCredit(size_t size)
+{
+    size_t queuedBytes = m_queuedBytes -= size;
+    m_port->releaseWriteBudget(size);
+
+    if (m_throttled && queuedBytes <= m_lowWatermark)
+        becameWritable();
+
+    // The last queued write has gone out, so the handle can close now.
+    if (m_shuttingDown && !queuedBytes)
+        close();
+}
+
+void NonblockIoHandle::becameWritable()
+{
+    if (m_closing || m_closed)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(m_throttleLock);
+        if (!m_throttled.exchange(false))
+            return;
+        m_throttledMicroseconds += ticksToMicroseconds(currentTicks() - m_throttledSince);
+    }
+    m_client->handleWritable(this);
+}
+
+void NonblockIoHandle::writeBudgetCallback()
+{
+    if (m_queuedBytes <= m_lowWatermark || !m_highWatermark)
+        becameWritable();
+}
+
+std::pair<NonblockIoHandle::ErrorCode, size_t> NonblockIoHandle::enqueueWrite(const void* buffer, size_t bufferSize)
+{
+    std::lock_guard<std::mutex> lock(m_writeLock);
+
+    const char* data = static_cast<const char*>(buffer);
+    m_outbound.insert(m_outbound.end(), data, data + bufferSize);
+    ++m_coalescingStatistics.writes;
+
+    if (m_flushInFlight || m_corked)
+        return std::make_pair(Pending, bufferSize);
+
+    std::pair<ErrorCode, size_t> result = startFlush();
+    if (result.first == Complete || result.first == Pending)
+        result.second = bufferSize;
+    return result;
+}
+
+std::pair<NonblockIoHandle::ErrorCode, size_t> NonblockIoHandle::startFlush()
+{
+    ASSERT(!m_flushInFlight && !m_outbound.empty());
+
+    m_sending.swap(m_outbound);
+    m_outbound.clear();
+    m_flushInFlight = true;
+    ++m_coalescingStatistics.sends;
+
+    CompletionStatus* status = allocateCompletionStatus(Flush);
+    status->queuedBytes = m_sending.size();
+    DWORD bytesSent = 0;
+    BOOL succeeded = WriteFile(m_handle, m_sending.data(), m_sending.size(), &bytesSent, status);
+    std::pair<ErrorCode, size_t> result = didStartOperation(status, succeeded, bytesSent);
+
+    // The flush stays in flight only while a completion packet is on its way.
+    if (result.first != Pending && (result.first != Complete || m_skipCompletionPortOnSuccess)) {
+        m_sending.clear();
+        m_flushInFlight = false;
+    }
+
+    return result;
+}
+
+size_t NonblockIoHandle::flushOutbound()
+{
+    size_t bytesSent = 0;
+    while (!m_flushInFlight && !m_corked && !m_outbound.empty()) {
+        size_t bytesToSend = m_outbound.size();
+        std::pair<ErrorCode, size_t> result = startFlush();
+        if (result.first != Complete || m_flushInFlight)
+            break;
+        bytesSent += bytesToSend;
+    }
+    return bytesSent;
+}
+
+void NonblockIoHandle::didFlush(size_t bytesTransferred)
+{
+    size_t bytesSent = bytesTransferred;
+    {
+        std::lock_guard<std::mutex> lock(m_writeLock);
+        m_sending.clear();
+        m_flushInFlight = false;
+        bytesSent += flushOutbound();
+    }
+
+    m_client->handleDidWrite(this, bytesSent);
+}
+
+void NonblockIoHandle::postStreamReads()
+{
+    while (m_readDepth && m_readsOutstanding < m_readDepth && !m_closing) {
+        PooledBuffer* buffer = m_readPool->acquire();
+        if (!buffer)
+            break;
+
+        size_t sequence = m_nextReadSequence++;
+        ++m_readsOutstanding;
+
+        CompletionStatus* status = allocateCompletionStatus(StreamRead, buffer);
+        status->sequence = sequence;
+        if (!m_isSocket) {
+            setOffset(status, m_nextReadOffset);
+            m_nextReadOffset += buffer->capacity;
+        }
+        DWORD bytesRead = 0;
+        BOOL succeeded = ReadFile(m_handle, buffer->data, buffer->capacity, &bytesRead, status);
+        std::pair<ErrorCode, size_t> result = didStartOperation(status, succeeded, bytesRead);
+        if (result.first == Pending || (result.first == Complete && !m_skipCompletionPortOnSuccess))
+            continue;
+
+        // Completed inline or failed; either way the slot is filled now so that delivery stays in order.
+        StreamSlot& slot = m_streamSlots[sequence % m_streamSlots.size()];
+        slot.completed = true;
+        slot.buffer = result.first == Complete ? buffer : nullptr;
+        slot.size = result.first == Complete ? bytesRead : 0;
+        if (result.first != Complete) {
+            buffer->pool->release(buffer);
+            m_readDepth = 0;
+        }
+    }
+}
+
+void NonblockIoHandle::didStreamRead(size_t sequence, PooledBuffer* buffer, size_t bytesTransferred)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_readLock);
+        StreamSlot& slot = m_streamSlots[sequence % m_streamSlots.size()];
+        ASSERT(!slot.completed);
+        slot.completed = true;
+        slot.buffer = buffer;
+        slot.size = bytesTransferred;
+    }
+
+    deliverStreamReads();
+}
+
+void NonblockIoHandle::deliverStreamReads()
+{
+    std::unique_lock<std::mutex> lock(m_readLock);
+
+    // Completions may be dequeued on several workers at once; only one of them delivers, in sequence order.
+    if (m_deliveringReads)
+        return;
+
+    m_deliveringReads = true;
+    while (!m_streamSlots.empty()) {
+        StreamSlot& slot = m_streamSlots[m_nextDeliverSequence % m_streamSlots.size()];
+        if (!slot.completed) {
+            // Everything read ahead has been consumed and the client is waiting on the device.
+            if (m_readDepth && m_readDepth < m_maxReadDepth && m_readsOutstanding == m_readDepth) {
+                m_readDepth = std::min(m_readDepth * 2, m_maxReadDepth);
+                postStreamReads();
+            }
+            break;
+        }
+
+        PooledBuffer* buffer = slot.buffer;
+        size_t size = slot.size;
+        slot.completed = false;
+        ++m_nextDeliverSequence;
+        --m_readsOutstanding;
+
+        // Reads that were still outstanding behind the end of the stream come back empty or aborted, and the client
+        // has already heard about it.
+        bool endOfStream = !buffer || !size;
+        bool reportEnd = endOfStream && !m_streamEnded;
+        if (endOfStream) {
+            m_readDepth = 0;
+            m_streamEnded = true;
+        } else if (m_streamEnded) {
+            buffer->pool->release(buffer);
+            continue;
+        }
+
+        lock.unlock();
+        if (endOfStream) {
+            if (buffer)
+                buffer->pool->release(buffer);
+            if (reportEnd)
+                m_client->handleDidRead(this, 0);
+        } else
+            m_client->handleDidReadBuffer(this, buffer, size);
+        lock.lock();
+
+        postStreamReads();
+    }
+    m_deliveringReads = false;
+}
+
+std::pair<NonblockIoHandle::ErrorCode, size_t> NonblockIoHandle::didStartOperation(CompletionStatus* status, BOOL succeeded, DWORD bytesTransferred)
+{
+    Operation operation = static_cast<Operation>(reinterpret_cast<int>(status->user));
+    PooledBuffer* buffer = status->buffer;
+
+    if (!succeeded) {
+        std::pair<ErrorCode, size_t> result = handleError(operation, bytesTransferred);
+        if (result.first != Pending) {
+            if (buffer && operation != StreamRead)
+                buffer->pool->release(buffer);
+            freeCompletionStatus(status);
+            didCompleteOperation();
+        }
+        return result;
+    }
+
+    if (m_skipCompletionPortOnSuccess)
+        didCompleteOperation();
+
+    if (!m_skipCompletionPortOnSuccess)
+        return std::make_pair(Complete, bytesTransferred);
+
+    // Without a completion packet to carry it, the result is delivered right here, so that the client hears about
+    // every operation whichever way the handle is registered. Stream reads and flushes report through their callers.
+    CompletionHandler* handler = static_cast<CompletionHandler*>(status->context);
+    freeCompletionStatus(status);
+    if (operation == StreamRead || operation == Flush)
+        return std::make_pair(Complete, bytesTransferred);
+
+    if (handler) {
+        handler->handleCompletion(this, Complete, bytesTransferred);
+        return std::make_pair(Complete, bytesTransferred);
+    }
+
+    switch (operation) {
+    case NonblockIoHandle::Read:
+        if (buffer)
+            m_client->handleDidReadBuffer(this, buffer, bytesTransferred);
+        else
+            m_client->handleDidRead(this, bytesTransferred);
+        break;
+    case NonblockIoHandle::Transmit:
+    case NonblockIoHandle::Write:
+        if (buffer)
+            buffer->pool->release(buffer);
+        m_client->handleDidWrite(this, bytesTransferred);
+        break;
+    case NonblockIoHandle::Connect:
+        if (!m_closed)
+            setsockopt((SOCKET)m_handle, SOL_SOCKET, SO_UPDATE_CONNECT_CONTEXT, NULL, 0);
+        m_client->handleDidConnect(this, 0);
+        break;
+    default:
+        break;
+    }
+
+    return std::make_pair(Complete, bytesTransferred);
+}
+
+void NonblockIoHandle::willPostOperation()
+{
+    if (m_idleTimeout)
+        m_lastActivity = m_port->currentTime();
+
+    if (!m_pendingOperations++ && m_operationTimeout)
+        m_port->armTimer(&m_operationTimer, m_operationTimeout);
+}
+
+void NonblockIoHandle::didCompleteOperation()
+{
+    ASSERT(m_pendingOperations & ~kClosedFlag);
+
+    // The idle timer looks at this when it fires, so that operations don't have to go through the port's timer lock.
+    if (m_idleTimeout)
+        m_lastActivity = m_port->currentTime();
+
+    // Progress pushes the operation deadline out. The timer has to be touched after the count is down, when a close
+    // finishing on another worker may release the last reference to this.
+    if (m_operationTimeout) {
+        std::shared_ptr<CompletionKey> protectedThis = shared_from_this();
+        unsigned remaining = --m_pendingOperations;
+        if (!(remaining & ~kClosedFlag))
+            m_port->cancelTimer(&m_operationTimer);
+        else if (!(remaining & kClosedFlag))
+            m_port->armTimer(&m_operationTimer, m_operationTimeout);
+
+        if (remaining == kClosedFlag)
+            didClose();
+        return;
+    }
+
+    // Nothing may touch the handle once the count is down, except whoever takes it down to the closed flag alone:
+    // that's the last operation aborted by closing the handle coming back, and nobody else finishes the close then.
+    if (--m_pendingOperations == kClosedFlag)
+        didClose();
+}
+
+void NonblockIoHandle::didAbortOperation(CompletionStatus& status, Operation operation)
+{
+    switch (operation) {
+    case NonblockIoHandle::StreamRead:
+        status.buffer->pool->release(status.buffer);
+        didStreamRead(status.sequence, nullptr, 0);
+        break;
+    case NonblockIoHandle::Flush: {
+        std::lock_guard<std::mutex> lock(m_writeLock);
+        m_sending.clear();
+        m_flushInFlight = false;
+        break;
+    }
+    default:
+        if (status.buffer)
+            status.buffer->pool->release(status.buffer);
+        break;
+    }
+}
+
+void NonblockIoHandle::operationTimerFired()
+{
+    // Timer callbacks hold on to the handle while they run, and leave one that's already being destroyed alone; its
+    // destructor is waiting in cancelTimer() for us to return.
+    std::shared_ptr<CompletionKey> protectedThis = m_weakThis.lock();
+    if (!protectedThis || !pendingOperations() || m_closed || m_closing)
+        return;
+
+#if (_WIN32_WINNT >= 0x0600)
+    CancelIoEx(m_handle, NULL);
+#endif
+    m_client->handleDidTimeout(this);
+}
+
+void NonblockIoHandle::idleTimerFired()
+{
+    std::shared_ptr<CompletionKey> protectedThis = m_weakThis.lock();
+    if (!protectedThis || m_closing || !m_idleTimeout)
+        return;
+
+    // There's been activity since the timer was armed; wait out the rest of the timeout from the last of it.
+    ULONGLONG idle = m_port->currentTime() - m_lastActivity;
+    if (idle < m_idleTimeout) {
+        m_port->armTimer(&m_idleTimer, static_cast<DWORD>(m_idleTimeout - idle));
+        return;
+    }
+
+    close();
 }
 
-void NonblockIoHandle::completionCallback(CompletionStatus* passedStatus, size_t bytesTransferred)
+void NonblockIoHandle::completionCallback(CompletionStatus* status, size_t bytesTransferred)
+{
+    dispatchCompletion(status, bytesTransferred);
+
+    // Counted down only after the completion has been handled, since the last one after a close releases this.
+    didCompleteOperation();
+}
+
+void NonblockIoHandle::dispatchCompletion(CompletionStatus* passedStatus, size_t bytesTransferred)
 {
     CompletionStatus status(*passedStatus);
     freeCompletionStatus(passedStatus);
 
     Operation operation = static_cast<Operation>(reinterpret_cast<int>(status.user));
+    CompletionHandler* handler = static_cast<CompletionHandler*>(status.context);
 
     DWORD numberOfBytesTransferred = 0;
     while (!::GetOverlappedResult(m_handle, &status, &numberOfBytesTransferred, FALSE)) {
-        switch (DWORD error = GetLastError()) {
-        case ERROR_BROKEN_PIPE:
-        case WSAECONNRESET:
-        case WSAESHUTDOWN:
-            m_client->handleDidClose(this);
+        DWORD error = GetLastError();
+        if (operation == Connect && error != ERROR_OPERATION_ABORTED) {
+            m_client->handleDidConnect(this, error);
+            return;
+        }
+
+        if (handler) {
+            ErrorCode errorCode = UnhandledError;
+            if (isEndOfStream(error))
+                errorCode = Shutdown;
+            handler->handleCompletion(this, errorCode, errorCode == Shutdown ? 0 : error);
+            return;
+        }
+
+        // A failed stream read still retires its sequence number, or the reads behind it would never be delivered.
+        // Whatever the error, a reset, an aborted connection or a deleted network name among the usual ones, the
+        // client sees the end of the stream once everything read before the failure has been handed over. Only the
+        // end of a file leaves the handle open.
+        if (operation == StreamRead && error != ERROR_OPERATION_ABORTED) {
+            status.buffer->pool->release(status.buffer);
+            if (error != ERROR_HANDLE_EOF)
+                close();
+            didStreamRead(status.sequence, nullptr, 0);
+            return;
+        }
+
+        // Anything but an abort or the end of a file means the connection is gone, however the peer went away.
+        switch (error) {
+        case ERROR_HANDLE_EOF:
+            if (status.buffer)
+                status.buffer->pool->release(status.buffer);
+            m_client->handleDidRead(this, 0);
+            return;
+        case ERROR_OPERATION_ABORTED:
+            didAbortOperation(status, operation);
             return;
-        case ERROR_IO_INCOMPLETE:
-        case ERROR_IO_PENDING:
         default:
-            ASSERT_NOT_REACHED();
+            ASSERT(error != ERROR_IO_INCOMPLETE && error != ERROR_IO_PENDING);
+            if (status.buffer)
+                status.buffer->pool->release(status.buffer);
+            close();
             return;
         }
     }
 
+    if (handler) {
+        handler->handleCompletion(this, Complete, numberOfBytesTransferred);
+        return;
+    }
+
     switch (operation) {
     case NonblockIoHandle::Read:
-        m_client->handleDidRead(this, numberOfBytesTransferred);
+        if (status.buffer)
+            m_client->handleDidReadBuffer(this, status.buffer, numberOfBytesTransferred);
+        else
+            m_client->handleDidRead(this, numberOfBytesTransferred);
         break;
+    case NonblockIoHandle::Transmit:
     case NonblockIoHandle::Write:
+        if (status.buffer)
+            status.buffer->pool->release(status.buffer);
         m_client->handleDidWrite(this, numberOfBytesTransferred);
         break;
+    case NonblockIoHandle::Flush:
+        didFlush(numberOfBytesTransferred);
+        break;
+    case NonblockIoHandle::StreamRead:
+        didStreamRead(status.sequence, status.buffer, numberOfBytesTransferred);
+        break;
+    case NonblockIoHandle::Connect:
+        if (!m_closed)
+            setsockopt((SOCKET)m_handle, SOL_SOCKET, SO_UPDATE_CONNECT_CONTEXT, NULL, 0);
+        m_client->handleDidConnect(this, 0);
+        break;
     default:
         ASSERT_NOT_REACHED();
         break;
@@ -175,11 +1159,52 @@ void NonblockIoHandle::completionCallback(CompletionStatus* passedStatus, size_t
 
 void NonblockIoHandle::destroyKeyCallback()
 {
-    HANDLE closingHandle = m_handle;
-    Client* closingClient = m_client;
+    // Unregister before the handle value is released and can be reused by another add(). The local reference keeps
+    // this alive should the last aborted operation finish the close on another worker before we're done here.
+    std::shared_ptr<CompletionKey> protectedThis = m_protectedThis = m_port->didClose(m_handle);
+    m_port->cancelTimer(&m_operationTimer);
+    m_port->cancelTimer(&m_idleTimer);
+
+    // The handle value is left alone, since completions of aborted operations may still be reading it; m_closed
+    // tells everyone else it's gone.
+    m_closed = true;
     closeNow();
-    m_port->didClose(closingHandle);
-    closingClient->handleDidClose(this);
+
+    // Writes still waiting for a flush never will be sent now.
+    size_t unsentBytes;
+    {
+        std::lock_guard<std::mutex> lock(m_writeLock);
+        unsentBytes = m_outbound.size();
+        m_outbound.clear();
+    }
+    if (unsentBytes)
+        releaseWriteCredit(unsentBytes);
+
+    // Operations still in flight are aborted and come back through completionCallback, and the last of them finishes
+    // the close. Flagging the count and reading it in one go leaves exactly one of us to do it.
+    if (!m_pendingOperations.fetch_or(kClosedFlag))
+        didClose();
+}
+
+void NonblockIoHandle::didClose()
+{
+    // Only one of the close and the last aborted operation gets here. The reference it was holding for the port goes
+    // once the client has heard.
+    std::shared_ptr<CompletionKey> protectedThis;
+    protectedThis.swap(m_protectedThis);
+    m_client->handleDidClose(this);
+}
+
+void NonblockIoHandle::shutdownCallback(bool immediately)
+{
+    m_shuttingDown = true;
+    stopReading();
+
+    // Corked writes go out too, and the last queued write to finish closes the handle.
+    if (!immediately && m_corked)
+        uncork();
+    if (immediately || !m_queuedBytes)
+        close();
 }
 
 std::pair<NonblockIoHandle::ErrorCode, size_t> NonblockIoHandle::handleError(Operation operation, size_t size)
@@ -187,12 +1212,10 @@ std::pair<NonblockIoHandle::ErrorCode, size_t> NonblockIoHandle::handleError(Ope
     switch (DWORD error = GetLastError()) {
     case ERROR_IO_PENDING:
         return std::make_pair(Pending, size);
-    case ERROR_BROKEN_PIPE:
-    case WSAECONNRESET:
-    case WSAESHUTDOWN:
-        return std::make_pair(Shutdown, size);
     case ERROR_IO_INCOMPLETE:
     default:
+        if (isEndOfStream(error))
+            return std::make_pair(Shutdown, size);
         return std::make_pair(UnhandledError, error);
     }
 }
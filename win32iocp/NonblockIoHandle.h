@@ -23,28 +23,172 @@
 #pragma once
 
 #include "includes.h"
+#include "BufferPool.h"
 #include "CompletionPort.h"
+#include <atomic>
+#include <mutex>
+#include <vector>
 #include <winsock2.h>
 
 class NonblockIoHandle final : public CompletionKey {
 public:
-    enum Operation { Read, Write };
-    enum ErrorCode { Complete, Pending, Shutdown, InvalidOperation, UnhandledError };
+    enum Operation { Read, Write, Flush, StreamRead, Connect, Transmit };
+    enum ErrorCode { Complete, Pending, Shutdown, InvalidOperation, UnhandledError, Throttled };
 
+    // Reports the operations started without a handler that returned Complete or Pending. One that finished right
+    // away is reported inline, before the call that started it returns.
     class Client {
     public:
         virtual void handleDidClose(NonblockIoHandle*) = 0;
         virtual void handleDidRead(NonblockIoHandle*, size_t) = 0;
         virtual void handleDidWrite(NonblockIoHandle*, size_t) = 0;
+
+        // Receives the lease of a read(BufferPool&); the client is responsible for releasing it.
+        virtual void handleDidReadBuffer(NonblockIoHandle*, PooledBuffer* buffer, size_t)
+        {
+            buffer->pool->release(buffer);
+        }
+
+        // Reports the outcome of connect(); zero means the socket is connected.
+        virtual void handleDidConnect(NonblockIoHandle*, DWORD error) { }
+
+        // Pending operations made no progress within the operation timeout and have been cancelled.
+        virtual void handleDidTimeout(NonblockIoHandle*) { }
+
+        // A write was turned away with Throttled, and the queue has since drained to the low watermark.
+        virtual void handleWritable(NonblockIoHandle*) { }
+    };
+
+    // A continuation for a single operation, owned by the caller and kept alive until it has run. It's invoked
+    // exactly once, on the completion thread or inline when the operation finishes right away, whenever starting
+    // the operation returned Complete or Pending.
+    class CompletionHandler {
+    public:
+        virtual void handleCompletion(NonblockIoHandle*, ErrorCode, size_t) = 0;
+    };
+
+    template<typename Function>
+    class CompletionFunction final : public CompletionHandler {
+    public:
+        explicit CompletionFunction(Function function)
+            : m_function(function)
+        {
+        }
+
+        void handleCompletion(NonblockIoHandle* handle, ErrorCode error, size_t size) override
+        {
+            m_function(handle, error, size);
+        }
+
+    private:
+        Function m_function;
     };
 
+    template<typename Function>
+    static CompletionFunction<Function> completionFunction(Function function)
+    {
+        return CompletionFunction<Function>(function);
+    }
+
+    struct WriteCoalescingStatistics {
+        size_t writes;
+        size_t sends;
+    };
+
+    struct FlowControlStatistics {
+        size_t queuedBytes;
+        size_t peakQueuedBytes;
+        size_t throttledWrites;
+        ULONGLONG throttledMicroseconds;
+    };
+
+    // Both return null once the port has started shutting down; the handle is closed then.
     static std::shared_ptr<NonblockIoHandle> create(HANDLE, std::shared_ptr<CompletionPort>, Client*);
     static std::shared_ptr<NonblockIoHandle> create(SOCKET, std::shared_ptr<CompletionPort>, Client*);
+
+    // Opens a file for overlapped I/O. Unbuffered files bypass the system cache; their offsets, sizes and buffer
+    // addresses must all be multiples of sectorSize(). Returns null with the error in GetLastError() on failure.
+    enum FileFlags { Unbuffered = 1 << 0, WriteThrough = 1 << 1, SequentialScan = 1 << 2, RandomAccess = 1 << 3 };
+    static std::shared_ptr<NonblockIoHandle> openFile(LPCTSTR path, DWORD desiredAccess, DWORD creationDisposition, unsigned flags, std::shared_ptr<CompletionPort>, Client*);
     ~NonblockIoHandle();
 
     std::pair<ErrorCode, size_t> read(void*, size_t);
     std::pair<ErrorCode, size_t> write(const void*, size_t);
 
+    // Same as above, but the result goes to |handler| instead of the client. Writes with a handler bypass
+    // coalescing.
+    std::pair<ErrorCode, size_t> read(void*, size_t, CompletionHandler*);
+    std::pair<ErrorCode, size_t> write(const void*, size_t, CompletionHandler*);
+
+    // Reads into a buffer leased from the pool, which is handed to Client::handleDidReadBuffer. Writing a leased
+    // buffer consumes the lease; it goes back to its pool once the write completes.
+    std::pair<ErrorCode, size_t> read(BufferPool&);
+    std::pair<ErrorCode, size_t> write(PooledBuffer*, size_t);
+
+    // Positional reads and writes for files. Reading at or past the end of the file reports Shutdown.
+    std::pair<ErrorCode, size_t> readAt(ULONGLONG offset, void*, size_t, CompletionHandler* = nullptr);
+    std::pair<ErrorCode, size_t> writeAt(ULONGLONG offset, const void*, size_t, CompletionHandler* = nullptr);
+
+    bool isUnbuffered() const { return m_unbuffered; }
+    DWORD sectorSize() const { return m_sectorSize; }
+
+    // Scatter/gather variants for sockets; the whole buffer array completes as a single operation.
+    std::pair<ErrorCode, size_t> readv(const WSABUF*, size_t bufferCount);
+    std::pair<ErrorCode, size_t> writev(const WSABUF*, size_t bufferCount);
+
+    // Sends |length| bytes of |file| from |offset|, framed by the optional header and trailer, through TransmitFile
+    // so the data never passes through user space. A zero length sends the rest of the file. Everything passed in
+    // has to stay valid until the single completion, which reports the total sent; without a handler that's
+    // handleDidWrite. There's no progress report before then, so send huge files in chunks to track them.
+    std::pair<ErrorCode, size_t> transmit(HANDLE file, ULONGLONG offset, DWORD length, const WSABUF* header = nullptr, const WSABUF* trailer = nullptr, CompletionHandler* = nullptr);
+
+    // In coalescing mode write(const void*, size_t) copies into an outbound buffer, and everything written while
+    // a send is in flight goes out as one send when it completes. Corking holds all writes back until uncork().
+    void setWriteCoalescing(bool coalescing) { m_coalescing = coalescing; }
+    void cork();
+    void uncork();
+    WriteCoalescingStatistics writeCoalescingStatistics();
+
+    // Bytes handed to write(), writev() and writeAt() count as queued until their send completes. A write that would
+    // take them past the high watermark, or over the port's write budget, fails with Throttled and queues nothing,
+    // and Client::handleWritable follows when the queue is back down to the low watermark. A write bigger than the
+    // high watermark is let through when nothing else is queued. A zero high watermark
+    // leaves the handle unbounded, which is the default. transmit() isn't counted: the kernel reads the file as it
+    // sends, so nothing of it is held in memory on our side.
+    void setWriteWatermarks(size_t low, size_t high);
+    FlowControlStatistics flowControlStatistics() const;
+
+    // Operations issued on this handle whose completions haven't been processed yet.
+    unsigned pendingOperations() const { return m_pendingOperations & ~kClosedFlag; }
+
+    // Keeps up to |depth| receives into buffers from |pool| outstanding and hands the data to
+    // Client::handleDidReadBuffer in stream order. End of stream is reported once, as handleDidRead with zero bytes,
+    // after the data received before it has been delivered. So is any error, and the handle closes itself on any
+    // error other than the end of a file.
+    // Reads are reposted as data is delivered; call startReading() again to top up after returning leases late.
+    bool startReading(std::shared_ptr<BufferPool>, unsigned depth);
+
+    // Streams a file from |offset| the same way. Read-ahead starts shallow and doubles, up to |depth|, whenever the
+    // client has consumed everything that was read ahead and has to wait for the disk.
+    bool startReadingAt(ULONGLONG offset, std::shared_ptr<BufferPool>, unsigned depth);
+    void stopReading();
+
+    // Once operations are pending, the operation timeout cancels all of them if none completes for that long. The
+    // idle timeout closes the handle after that long without any activity. Zero disables either one.
+    void setOperationTimeout(DWORD milliseconds);
+    void setIdleTimeout(DWORD milliseconds);
+
+    // Moves the handle to another port, so that its completions run on that port's workers from then on. Only an idle
+    // handle can move: nothing may be pending, queued, throttled or read in the background, and nothing else may use
+    // the handle during the call. Needs Windows 8.1 or later.
+    bool migrate(std::shared_ptr<CompletionPort>);
+
+    // Connects a socket through ConnectEx, binding it to the wildcard address first if it isn't bound yet.
+    std::pair<ErrorCode, size_t> connect(const sockaddr*, int addressLength);
+
+    // Client::handleDidClose follows once the operations aborted by closing have all come back. When the port shuts
+    // down, the handle stops reading, refuses new operations with Shutdown, and closes itself after its queued writes
+    // have gone out.
     void close();
 
 private:
@@ -53,13 +197,41 @@ private:
 
     static std::shared_ptr<NonblockIoHandle> activate(std::shared_ptr<NonblockIoHandle>);
 
+    bool canSkipCompletionPortOnSuccess() const;
+    bool isAligned(ULONGLONG offset, const void*, size_t) const;
+
     void closeNow();
 
-    CompletionStatus* allocateCompletionStatus(Operation);
+    CompletionStatus* allocateCompletionStatus(Operation, PooledBuffer* = nullptr, CompletionHandler* = nullptr);
     void freeCompletionStatus(CompletionStatus*);
 
+    std::pair<ErrorCode, size_t> didStartOperation(CompletionStatus*, BOOL succeeded, DWORD bytesTransferred);
+
+    void willPostOperation();
+    void didCompleteOperation();
+    void didAbortOperation(CompletionStatus&, Operation);
+    void operationTimerFired();
+    void idleTimerFired();
+
+    bool acquireWriteCredit(size_t);
+    void releaseWriteCredit(size_t);
+    void becameWritable();
+    void writeBudgetCallback() override;
+
+    std::pair<ErrorCode, size_t> enqueueWrite(const void*, size_t);
+    std::pair<ErrorCode, size_t> startFlush();
+    size_t flushOutbound();
+    void didFlush(size_t);
+
+    void postStreamReads();
+    void didStreamRead(size_t sequence, PooledBuffer*, size_t);
+    void deliverStreamReads();
+
     void completionCallback(CompletionStatus*, size_t) override;
+    void dispatchCompletion(CompletionStatus*, size_t);
     void destroyKeyCallback() override;
+    void shutdownCallback(bool immediately) override;
+    void didClose();
 
     std::pair<ErrorCode, size_t> handleError(Operation, size_t);
 
@@ -67,5 +239,60 @@ private:
     bool m_isSocket;
     std::shared_ptr<CompletionPort> m_port;
     Client* m_client;
-    bool m_closing;
+    std::atomic<bool> m_closing;
+    bool m_skipCompletionPortOnSuccess;
+    bool m_unbuffered;
+    DWORD m_sectorSize;
+
+    // The count carries a flag once the handle has been closed, so that the close and the last operation coming back
+    // can tell which of them is the last.
+    static const unsigned kClosedFlag = 0x80000000;
+    std::atomic<unsigned> m_pendingOperations;
+    std::atomic<bool> m_closed;
+    std::atomic<bool> m_shuttingDown;
+    std::shared_ptr<CompletionKey> m_protectedThis;
+    std::weak_ptr<CompletionKey> m_weakThis;
+    DWORD m_operationTimeout;
+    DWORD m_idleTimeout;
+    std::atomic<ULONGLONG> m_lastActivity;
+    CompletionPort::Timer m_operationTimer;
+    CompletionPort::Timer m_idleTimer;
+
+    std::mutex m_writeLock;
+    bool m_coalescing;
+    bool m_corked;
+    bool m_flushInFlight;
+    std::vector<char> m_outbound;
+    std::vector<char> m_sending;
+    WriteCoalescingStatistics m_coalescingStatistics;
+
+    size_t m_lowWatermark;
+    size_t m_highWatermark;
+    std::atomic<size_t> m_queuedBytes;
+    std::atomic<size_t> m_peakQueuedBytes;
+    std::atomic<size_t> m_throttledWrites;
+    std::atomic<bool> m_throttled;
+
+    // Raising and clearing m_throttled take the lock too, so that the time it's raised stays with the flag.
+    mutable std::mutex m_throttleLock;
+    LONGLONG m_throttledSince;
+    ULONGLONG m_throttledMicroseconds;
+
+    struct StreamSlot {
+        bool completed;
+        PooledBuffer* buffer;
+        size_t size;
+    };
+
+    std::mutex m_readLock;
+    std::shared_ptr<BufferPool> m_readPool;
+    unsigned m_readDepth;
+    unsigned m_maxReadDepth;
+    ULONGLONG m_nextReadOffset;
+    unsigned m_readsOutstanding;
+    size_t m_nextReadSequence;
+    size_t m_nextDeliverSequence;
+    bool m_deliveringReads;
+    bool m_streamEnded;
+    std::vector<StreamSlot> m_streamSlots;
 };
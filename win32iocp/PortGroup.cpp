@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2016 Daewoong Jang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "PortGroup.h"
+
+#include <climits>
+
+std::shared_ptr<PortGroup> PortGroup::create(DWORD_PTR affinityMask)
+{
+    if (!affinityMask) {
+        DWORD_PTR systemAffinityMask;
+        if (!GetProcessAffinityMask(GetCurrentProcess(), &affinityMask, &systemAffinityMask))
+            return nullptr;
+    }
+
+    std::shared_ptr<PortGroup> group(new PortGroup);
+    for (unsigned processor = 0; processor < sizeof(DWORD_PTR) * CHAR_BIT; ++processor) {
+        DWORD_PTR processorMask = static_cast<DWORD_PTR>(1) << processor;
+        if (!(affinityMask & processorMask))
+            continue;
+
+        UCHAR numaNode;
+        if (!GetNumaProcessorNode(static_cast<UCHAR>(processor), &numaNode) || numaNode == 0xff)
+            numaNode = 0;
+
+        Member member = { CompletionPort::create(1, processorMask), processor, numaNode };
+        group->m_ports.push_back(member);
+    }
+
+    return group->m_ports.empty() ? nullptr : group;
+}
+
+void PortGroup::setWaitPolicy(CompletionPort::WaitPolicy policy, DWORD maxSpinMicroseconds)
+{
+    for (size_t i = 0; i < m_ports.size(); ++i)
+        m_ports[i].port->setWaitPolicy(policy, maxSpinMicroseconds);
+}
+
+size_t PortGroup::select(Placement placement, const sockaddr* peer, int peerLength) const
+{
+    switch (placement) {
+    case PeerHash:
+        if (peer && peerLength > 0) {
+            // FNV-1a over the whole address; the unused tail of a sockaddr is zero and doesn't disturb it.
+            const unsigned char* bytes = reinterpret_cast<const unsigned char*>(peer);
+            unsigned hash = 2166136261u;
+            for (int i = 0; i < peerLength; ++i)
+                hash = (hash ^ bytes[i]) * 16777619u;
+            return hash % m_ports.size();
+        }
+        break;
+    case LocalNode: {
+        UCHAR numaNode;
+        if (GetNumaProcessorNode(static_cast<UCHAR>(GetCurrentProcessorNumber()), &numaNode) && numaNode != 0xff)
+            return leastLoaded(numaNode);
+        break;
+    }
+    default:
+        break;
+    }
+
+    return leastLoaded(-1);
+}
+
+size_t PortGroup::leastLoaded(int numaNode) const
+{
+    // Falls back to the whole group when none of the ports is on the node.
+    size_t best = m_ports.size();
+    size_t bestLoad = 0;
+    for (size_t i = 0; i < m_ports.size(); ++i) {
+        if (numaNode >= 0 && m_ports[i].numaNode != numaNode)
+            continue;
+
+        size_t load = m_ports[i].port->numberOfHandles();
+        if (best == m_ports.size() || load < bestLoad) {
+            best = i;
+            bestLoad = load;
+        }
+    }
+
+    return best < m_ports.size() ? best : leastLoaded(-1);
+}
+
+std::shared_ptr<NonblockIoHandle> PortGroup::create(SOCKET socket, NonblockIoHandle::Client* client, Placement placement)
+{
+    sockaddr_storage peer;
+    int peerLength = sizeof(peer);
+    if (placement != PeerHash || getpeername(socket, reinterpret_cast<sockaddr*>(&peer), &peerLength) == SOCKET_ERROR)
+        peerLength = 0;
+
+    return NonblockIoHandle::create(socket, m_ports[select(placement, reinterpret_cast<sockaddr*>(&peer), peerLength)].port, client);
+}
+
+bool PortGroup::migrate(NonblockIoHandle& handle, size_t index)
+{
+    return handle.migrate(m_ports[index].port);
+}
+
+bool PortGroup::shutdown(DWORD milliseconds)
+{
+    std::vector<std::thread> threads;
+    std::atomic<bool> drained(true);
+    for (size_t i = 0; i < m_ports.size(); ++i) {
+        std::shared_ptr<CompletionPort> port = m_ports[i].port;
+        threads.push_back(std::thread([port, milliseconds, &drained] {
+            if (!port->shutdown(milliseconds))
+                drained = false;
+        }));
+    }
+
+    for (size_t i = 0; i < threads.size(); ++i)
+        threads[i].join();
+    return drained;
+}
+
+void PortGroup::terminate()
+{
+    for (size_t i = 0; i < m_ports.size(); ++i)
+        m_ports[i].port->terminate();
+}
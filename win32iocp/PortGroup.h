@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2016 Daewoong Jang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "includes.h"
+#include "CompletionPort.h"
+#include "NonblockIoHandle.h"
+#include <vector>
+#include <winsock2.h>
+
+// A shared-nothing set of completion ports: one port per processor, each drained by a single worker pinned to that
+// processor. A handle placed on a port has all of its completions run on the same core, so its state stays in that
+// core's cache instead of bouncing between workers.
+class PortGroup final {
+public:
+    // LeastLoaded picks the port with the fewest handles. PeerHash always picks the same port for the same peer
+    // address and port. LocalNode picks the least loaded port on the NUMA node of the calling thread's processor.
+    enum Placement { LeastLoaded, PeerHash, LocalNode };
+
+    // Creates a port for every processor in |affinityMask|, or for every processor the process may run on when it's
+    // zero. Only the processor group the process runs in is covered.
+    static std::shared_ptr<PortGroup> create(DWORD_PTR affinityMask = 0);
+
+    size_t size() const { return m_ports.size(); }
+    std::shared_ptr<CompletionPort> port(size_t index) const { return m_ports[index].port; }
+    unsigned processor(size_t index) const { return m_ports[index].processor; }
+    UCHAR numaNode(size_t index) const { return m_ports[index].numaNode; }
+
+    void setWaitPolicy(CompletionPort::WaitPolicy, DWORD maxSpinMicroseconds = 50);
+
+    size_t select(Placement, const sockaddr* peer = nullptr, int peerLength = 0) const;
+
+    // Registers a connected socket with the port that |placement| picks for its peer.
+    std::shared_ptr<NonblockIoHandle> create(SOCKET, NonblockIoHandle::Client*, Placement = LeastLoaded);
+
+    // Moves an idle handle to the port at |index|; see NonblockIoHandle::migrate().
+    bool migrate(NonblockIoHandle&, size_t index);
+
+    // Shuts every port down at the same time, with the same deadline.
+    bool shutdown(DWORD milliseconds);
+    void terminate();
+
+private:
+    PortGroup() { }
+
+    size_t leastLoaded(int numaNode) const;
+
+    struct Member {
+        std::shared_ptr<CompletionPort> port;
+        unsigned processor;
+        UCHAR numaNode;
+    };
+
+    std::vector<Member> m_ports;
+};
@@ -0,0 +1,204 @@
+/*
+ * Copyright (C) 2016 Daewoong Jang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "Statistics.h"
+
+static LONGLONG queryPerformanceFrequency()
+{
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    return frequency.QuadPart;
+}
+
+static const LONGLONG s_ticksPerSecond = queryPerformanceFrequency();
+
+LONGLONG currentTicks()
+{
+    LARGE_INTEGER ticks;
+    QueryPerformanceCounter(&ticks);
+    return ticks.QuadPart;
+}
+
+ULONGLONG ticksToMicroseconds(LONGLONG ticks)
+{
+    if (ticks <= 0)
+        return 0;
+
+    return static_cast<ULONGLONG>(ticks / s_ticksPerSecond * 1000000 + ticks % s_ticksPerSecond * 1000000 / s_ticksPerSecond);
+}
+
+LONGLONG microsecondsToTicks(ULONGLONG microseconds)
+{
+    return static_cast<LONGLONG>(microseconds / 1000000 * s_ticksPerSecond + microseconds % 1000000 * s_ticksPerSecond / 1000000);
+}
+
+static unsigned mostSignificantBit(ULONGLONG value)
+{
+    unsigned long index;
+    if (_BitScanReverse(&index, static_cast<unsigned long>(value >> 32)))
+        return index + 32;
+
+    _BitScanReverse(&index, static_cast<unsigned long>(value));
+    return index;
+}
+
+Histogram::Histogram()
+    : m_count(0)
+    , m_sum(0)
+    , m_max(0)
+{
+    memset(m_buckets, 0, sizeof(m_buckets));
+}
+
+unsigned Histogram::bucketIndex(ULONGLONG value)
+{
+    if (value < 4)
+        return static_cast<unsigned>(value);
+
+    unsigned msb = mostSignificantBit(value);
+    return (msb - 1) * 4 + static_cast<unsigned>((value >> (msb - 2)) & 3);
+}
+
+ULONGLONG Histogram::bucketUpperBound(unsigned index)
+{
+    if (index < 4)
+        return index;
+
+    unsigned msb = index / 4 + 1;
+    return ((5ULL + index % 4) << (msb - 2)) - 1;
+}
+
+void Histogram::record(ULONGLONG value)
+{
+    ++m_buckets[bucketIndex(value)];
+    ++m_count;
+    m_sum += value;
+    if (value > m_max)
+        m_max = value;
+}
+
+void Histogram::merge(const Histogram& other)
+{
+    for (unsigned i = 0; i < kBucketCount; ++i)
+        m_buckets[i] += other.m_buckets[i];
+    m_count += other.m_count;
+    m_sum += other.m_sum;
+    if (other.m_max > m_max)
+        m_max = other.m_max;
+}
+
+ULONGLONG Histogram::percentile(double percentile) const
+{
+    if (!m_count)
+        return 0;
+
+    ULONGLONG rank = static_cast<ULONGLONG>(percentile / 100 * m_count + 0.5);
+    if (!rank)
+        rank = 1;
+
+    ULONGLONG seen = 0;
+    for (unsigned i = 0; i < kBucketCount; ++i) {
+        seen += m_buckets[i];
+        if (seen >= rank)
+            return bucketUpperBound(i) < m_max ? bucketUpperBound(i) : m_max;
+    }
+
+    return m_max;
+}
+
+#if ENABLE_STATISTICS
+
+void PortStatistics::add(const WorkerStatistics& worker)
+{
+    batches += worker.batches;
+    spinWakeups += worker.spinWakeups;
+    deferredCompletions += worker.deferredCompletions;
+    completions += worker.completions;
+    bytesTransferred += worker.bytesTransferred;
+    batchSize.merge(worker.batchSize);
+    completionLatency.merge(worker.completionLatency);
+    callbackDuration.merge(worker.callbackDuration);
+}
+
+static const double kPercentiles[] = { 50, 90, 99, 99.9 };
+
+static void writePrometheusSummary(FILE* file, const char* name, const Histogram& histogram)
+{
+    fprintf(file, "# TYPE %s summary\n", name);
+    for (size_t i = 0; i < sizeof(kPercentiles) / sizeof(kPercentiles[0]); ++i)
+        fprintf(file, "%s{quantile=\"%g\"} %llu\n", name, kPercentiles[i] / 100, histogram.percentile(kPercentiles[i]));
+    fprintf(file, "%s_sum %llu\n", name, histogram.sum());
+    fprintf(file, "%s_count %llu\n", name, histogram.count());
+}
+
+static void writeJSONHistogram(FILE* file, const char* name, const Histogram& histogram, bool last)
+{
+    fprintf(file, "  \"%s\": { \"count\": %llu, \"sum\": %llu, \"max\": %llu", name, histogram.count(), histogram.sum(), histogram.max());
+    for (size_t i = 0; i < sizeof(kPercentiles) / sizeof(kPercentiles[0]); ++i)
+        fprintf(file, ", \"p%g\": %llu", kPercentiles[i], histogram.percentile(kPercentiles[i]));
+    fprintf(file, " }%s\n", last ? "" : ",");
+}
+
+void PortStatistics::write(FILE* file, Format format) const
+{
+    if (format == Prometheus) {
+        fprintf(file, "# TYPE iocp_uptime_milliseconds gauge\niocp_uptime_milliseconds %llu\n", uptime);
+        fprintf(file, "# TYPE iocp_batches_total counter\niocp_batches_total %llu\n", batches);
+        fprintf(file, "# TYPE iocp_spin_wakeups_total counter\niocp_spin_wakeups_total %llu\n", spinWakeups);
+        fprintf(file, "# TYPE iocp_deferred_completions_total counter\niocp_deferred_completions_total %llu\n", deferredCompletions);
+        fprintf(file, "# TYPE iocp_completions_total counter\niocp_completions_total %llu\n", completions);
+        fprintf(file, "# TYPE iocp_bytes_transferred_total counter\niocp_bytes_transferred_total %llu\n", bytesTransferred);
+        fprintf(file, "# TYPE iocp_status_pool_hits_total counter\niocp_status_pool_hits_total %llu\n", statusPoolHits);
+        fprintf(file, "# TYPE iocp_status_pool_misses_total counter\niocp_status_pool_misses_total %llu\n", statusPoolMisses);
+        writePrometheusSummary(file, "iocp_batch_size", batchSize);
+        writePrometheusSummary(file, "iocp_completion_latency_microseconds", completionLatency);
+        writePrometheusSummary(file, "iocp_callback_duration_microseconds", callbackDuration);
+        return;
+    }
+
+    fprintf(file, "{\n");
+    fprintf(file, "  \"uptimeMilliseconds\": %llu,\n", uptime);
+    fprintf(file, "  \"batches\": %llu,\n", batches);
+    fprintf(file, "  \"spinWakeups\": %llu,\n", spinWakeups);
+    fprintf(file, "  \"deferredCompletions\": %llu,\n", deferredCompletions);
+    fprintf(file, "  \"completions\": %llu,\n", completions);
+    fprintf(file, "  \"bytesTransferred\": %llu,\n", bytesTransferred);
+    fprintf(file, "  \"statusPoolHits\": %llu,\n", statusPoolHits);
+    fprintf(file, "  \"statusPoolMisses\": %llu,\n", statusPoolMisses);
+    writeJSONHistogram(file, "batchSize", batchSize, false);
+    writeJSONHistogram(file, "completionLatencyMicroseconds", completionLatency, false);
+    writeJSONHistogram(file, "callbackDurationMicroseconds", callbackDuration, true);
+    fprintf(file, "}\n");
+}
+
+bool PortStatistics::saveToFile(const char* path, Format format) const
+{
+    FILE* file = nullptr;
+    if (fopen_s(&file, path, "w"))
+        return false;
+
+    write(file, format);
+    return !fclose(file);
+}
+
+#endif
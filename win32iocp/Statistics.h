@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2016 Daewoong Jang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "includes.h"
+#include <new>
+
+// A log-linear histogram in the spirit of HdrHistogram: every power of two is split into four linear sub-buckets,
+// so any recorded value is known to within 25% with a fixed 2KB footprint and no allocation.
+class Histogram {
+public:
+    Histogram();
+
+    void record(ULONGLONG value);
+    void merge(const Histogram&);
+
+    ULONGLONG count() const { return m_count; }
+    ULONGLONG sum() const { return m_sum; }
+    ULONGLONG max() const { return m_max; }
+    ULONGLONG percentile(double) const;
+
+    static const unsigned kBucketCount = 256;
+    static ULONGLONG bucketUpperBound(unsigned index);
+    ULONGLONG bucket(unsigned index) const { return m_buckets[index]; }
+
+private:
+    static unsigned bucketIndex(ULONGLONG value);
+
+    ULONGLONG m_buckets[kBucketCount];
+    ULONGLONG m_count;
+    ULONGLONG m_sum;
+    ULONGLONG m_max;
+};
+
+LONGLONG currentTicks();
+ULONGLONG ticksToMicroseconds(LONGLONG);
+LONGLONG microsecondsToTicks(ULONGLONG);
+
+#if ENABLE_STATISTICS
+
+// Written only by the worker that owns it, so recording needs no synchronization. Snapshots read it racily and
+// may be off by the operations in flight at that moment.
+struct __declspec(align(64)) WorkerStatistics {
+    // Allocated one per worker, so it brings its own aligned operator new.
+    static void* operator new(size_t size)
+    {
+        void* memory = _aligned_malloc(size, __alignof(WorkerStatistics));
+        if (!memory)
+            throw std::bad_alloc();
+        return memory;
+    }
+    static void operator delete(void* memory) { _aligned_free(memory); }
+
+    WorkerStatistics()
+        : batches(0)
+        , spinWakeups(0)
+        , deferredCompletions(0)
+        , completions(0)
+        , bytesTransferred(0)
+    {
+    }
+
+    ULONGLONG batches;
+    // Batches that were picked up by polling the port rather than after sleeping in it.
+    ULONGLONG spinWakeups;
+    // Completions that fair dispatch held over, counted once for every batch they had to sit out.
+    ULONGLONG deferredCompletions;
+    ULONGLONG completions;
+    ULONGLONG bytesTransferred;
+    Histogram batchSize;
+    Histogram completionLatency;
+    Histogram callbackDuration;
+};
+
+// An aggregate of all workers of a port. Latencies and durations are in microseconds.
+struct PortStatistics {
+    enum Format { Prometheus, JSON };
+
+    PortStatistics()
+        : uptime(0)
+        , batches(0)
+        , spinWakeups(0)
+        , deferredCompletions(0)
+        , completions(0)
+        , bytesTransferred(0)
+        , statusPoolHits(0)
+        , statusPoolMisses(0)
+    {
+    }
+
+    void add(const WorkerStatistics&);
+
+    void write(FILE*, Format) const;
+    bool saveToFile(const char* path, Format) const;
+
+    ULONGLONG uptime;
+    ULONGLONG batches;
+    ULONGLONG spinWakeups;
+    ULONGLONG deferredCompletions;
+    ULONGLONG completions;
+    ULONGLONG bytesTransferred;
+    ULONGLONG statusPoolHits;
+    ULONGLONG statusPoolMisses;
+    Histogram batchSize;
+    Histogram completionLatency;
+    Histogram callbackDuration;
+};
+
+#endif
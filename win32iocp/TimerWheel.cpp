@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2016 Daewoong Jang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "TimerWheel.h"
+
+#include <algorithm>
+#include <climits>
+
+TimerWheel::TimerWheel(ULONGLONG now)
+    : m_current(now)
+    , m_count(0)
+{
+    for (unsigned level = 0; level < kLevelCount; ++level) {
+        m_levelCounts[level] = 0;
+        for (unsigned slot = 0; slot < kSlotCount; ++slot)
+            m_slots[level][slot].next = m_slots[level][slot].prev = &m_slots[level][slot];
+    }
+}
+
+void TimerWheel::arm(Timer* timer, ULONGLONG expiration)
+{
+    if (timer->isArmed())
+        unlink(timer);
+
+    timer->m_expiration = expiration;
+    insert(timer, std::max(expiration, m_current + 1));
+}
+
+void TimerWheel::cancel(Timer* timer)
+{
+    if (timer->isArmed())
+        unlink(timer);
+}
+
+void TimerWheel::advance(ULONGLONG now, std::vector<Timer*>& expired)
+{
+    while (m_current < now) {
+        if (!m_count) {
+            m_current = now;
+            break;
+        }
+
+        // Skip straight to the next cascade point while the lowest level is empty.
+        if (!m_levelCounts[0])
+            m_current = std::min(now, m_current | kSlotMask);
+        if (m_current == now)
+            break;
+
+        ++m_current;
+
+        for (unsigned level = 1; level < kLevelCount; ++level) {
+            if (m_current & ((1ULL << (level * kSlotBits)) - 1))
+                break;
+            cascade(level, (m_current >> (level * kSlotBits)) & kSlotMask);
+        }
+
+        Node* head = &m_slots[0][m_current & kSlotMask];
+        while (head->next != head) {
+            Timer* timer = static_cast<Timer*>(head->next);
+            unlink(timer);
+            if (timer->m_period) {
+                timer->m_expiration = m_current + timer->m_period;
+                insert(timer, timer->m_expiration);
+            }
+            expired.push_back(timer);
+        }
+    }
+}
+
+ULONGLONG TimerWheel::nextExpiration() const
+{
+    if (!m_count)
+        return ULLONG_MAX;
+
+    // Timers on the upper levels come down at the next cascade point, and may be due right after it, ahead of
+    // anything on the lowest level that's due later.
+    ULONGLONG cascadePoint = (m_current | kSlotMask) + 1;
+    if (m_levelCounts[0]) {
+        for (ULONGLONG tick = m_current + 1; tick <= m_current + kSlotCount; ++tick) {
+            const Node* head = &m_slots[0][tick & kSlotMask];
+            if (head->next != head)
+                return m_count == m_levelCounts[0] ? tick : std::min(tick, cascadePoint);
+        }
+    }
+
+    return cascadePoint;
+}
+
+void TimerWheel::insert(Timer* timer, ULONGLONG due)
+{
+    ASSERT(due >= m_current);
+
+    ULONGLONG delta = due - m_current;
+    unsigned level = 0;
+    while (level < kLevelCount - 1 && delta >= (1ULL << ((level + 1) * kSlotBits)))
+        ++level;
+
+    // Anything beyond the range of the wheel parks in the farthest slot and is re-examined when that cascades.
+    if (delta >> (kLevelCount * kSlotBits))
+        due = m_current + (1ULL << (kLevelCount * kSlotBits)) - 1;
+
+    Node* head = &m_slots[level][(due >> (level * kSlotBits)) & kSlotMask];
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+    timer->m_level = level;
+
+    ++m_levelCounts[level];
+    ++m_count;
+}
+
+void TimerWheel::unlink(Timer* timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer->prev = nullptr;
+
+    --m_levelCounts[timer->m_level];
+    --m_count;
+}
+
+void TimerWheel::cascade(unsigned level, unsigned slot)
+{
+    Node* head = &m_slots[level][slot];
+    while (head->next != head) {
+        Timer* timer = static_cast<Timer*>(head->next);
+        unlink(timer);
+        insert(timer, std::max(timer->m_expiration, m_current));
+    }
+}
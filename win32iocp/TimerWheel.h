@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2016 Daewoong Jang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "includes.h"
+#include <functional>
+#include <vector>
+
+// A hierarchical timing wheel with millisecond ticks. Arming and cancelling a timer is O(1); timers further out
+// than the lowest level sit in coarser slots and are cascaded down as the wheel turns. Not thread safe.
+class TimerWheel final {
+public:
+    struct Node {
+        Node* next;
+        Node* prev;
+    };
+
+    class Timer : private Node {
+    public:
+        explicit Timer(std::function<void()> callback)
+            : m_callback(callback)
+            , m_expiration(0)
+            , m_period(0)
+            , m_level(0)
+        {
+            next = prev = nullptr;
+        }
+
+        bool isArmed() const { return !!prev; }
+        ULONGLONG expiration() const { return m_expiration; }
+        DWORD period() const { return m_period; }
+        void setPeriod(DWORD period) { m_period = period; }
+
+        void fire() { m_callback(); }
+
+    private:
+        friend class TimerWheel;
+
+        std::function<void()> m_callback;
+        ULONGLONG m_expiration;
+        DWORD m_period;
+        unsigned m_level;
+    };
+
+    explicit TimerWheel(ULONGLONG now);
+
+    void arm(Timer*, ULONGLONG expiration);
+    void cancel(Timer*);
+
+    // Turns the wheel up to |now| and appends every timer that expired on the way. Periodic timers are re-armed
+    // before they're returned.
+    void advance(ULONGLONG now, std::vector<Timer*>& expired);
+
+    // The earliest tick at which advance() may have work to do, or ULLONG_MAX if nothing is armed.
+    ULONGLONG nextExpiration() const;
+
+    ULONGLONG now() const { return m_current; }
+    size_t size() const { return m_count; }
+
+private:
+    TimerWheel(const TimerWheel&);
+    TimerWheel& operator=(const TimerWheel&);
+
+    static const unsigned kLevelCount = 4;
+    static const unsigned kSlotBits = 8;
+    static const unsigned kSlotCount = 1 << kSlotBits;
+    static const ULONGLONG kSlotMask = kSlotCount - 1;
+
+    void insert(Timer*, ULONGLONG due);
+    void unlink(Timer*);
+    void cascade(unsigned level, unsigned slot);
+
+    ULONGLONG m_current;
+    size_t m_count;
+    size_t m_levelCounts[kLevelCount];
+    Node m_slots[kLevelCount][kSlotCount];
+};
@@ -22,77 +22,53 @@
 
 #include "includes.h"
 
-#include <future>
-
-static const USHORT kLoopbackPort = 4444;
-
 static int process_socket_error(int code)
 {
     DWORD lastError = GetLastError();
     return code;
 }
 
-struct connect_thread_return {
-    std::promise<SOCKET> result;
-};
-
-int connect_thread_main(connect_thread_return* r)
-{
-    SOCKET s = WSASocket(AF_INET, SOCK_STREAM, IPPROTO_TCP, NULL, 0, WSA_FLAG_OVERLAPPED);
-    if (s == INVALID_SOCKET) {
-        r->result.set_value(SOCKET_ERROR);
-        return process_socket_error(SOCKET_ERROR);
-    }
-
-    sockaddr_in addr;
-    memset(&addr, 0, sizeof(sockaddr_in));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-    addr.sin_port = htons(kLoopbackPort);
-
-    if (WSAConnect(s, (sockaddr*)&addr, sizeof(sockaddr_in), NULL, NULL, NULL, NULL) == SOCKET_ERROR) {
-        r->result.set_value(SOCKET_ERROR);
-        return process_socket_error(SOCKET_ERROR);
-    }
-
-    r->result.set_value(s);
-
-    return 0;
-}
-
 int WSASocketPair(int domain, int type, int protocol, SOCKET socket_vector[2])
 {
-    SOCKET s = WSASocket(domain, type, protocol, NULL, 0, WSA_FLAG_OVERLAPPED);
-    if (s == INVALID_SOCKET)
+    SOCKET listener = WSASocket(domain, type, protocol, NULL, 0, WSA_FLAG_OVERLAPPED);
+    if (listener == INVALID_SOCKET)
         return process_socket_error(SOCKET_ERROR);
 
+    // Let the system pick a free loopback port instead of relying on a fixed one.
     sockaddr_in addr;
     memset(&addr, 0, sizeof(sockaddr_in));
     addr.sin_family = domain;
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    addr.sin_port = htons(kLoopbackPort);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
 
-    if (bind(s, (sockaddr*)&addr, sizeof(sockaddr_in)) == SOCKET_ERROR)
+    int addrlen = sizeof(sockaddr_in);
+    if (bind(listener, (sockaddr*)&addr, sizeof(sockaddr_in)) == SOCKET_ERROR
+        || getsockname(listener, (sockaddr*)&addr, &addrlen) == SOCKET_ERROR
+        || listen(listener, 1) == SOCKET_ERROR) {
+        closesocket(listener);
         return process_socket_error(SOCKET_ERROR);
+    }
 
-    if (listen(s, SOMAXCONN) == SOCKET_ERROR)
+    SOCKET client = WSASocket(domain, type, protocol, NULL, 0, WSA_FLAG_OVERLAPPED);
+    if (client == INVALID_SOCKET) {
+        closesocket(listener);
         return process_socket_error(SOCKET_ERROR);
+    }
 
-    connect_thread_return r;
-    std::thread connect_thread(&connect_thread_main, &r);
-
-    SOCKET server = 0;
-    if ((server = WSAAccept(s, NULL, 0, NULL, NULL)) == INVALID_SOCKET)
+    // The handshake completes against the listen backlog, so a blocking connect doesn't need anyone accepting on
+    // another thread.
+    if (WSAConnect(client, (sockaddr*)&addr, sizeof(sockaddr_in), NULL, NULL, NULL, NULL) == SOCKET_ERROR) {
+        closesocket(client);
+        closesocket(listener);
         return process_socket_error(SOCKET_ERROR);
+    }
 
-    std::future<SOCKET> f = r.result.get_future();
-    shutdown(s, SD_BOTH);
-    closesocket(s);
-    connect_thread.join();
-
-    SOCKET client = f.get();
-    if (client == SOCKET_ERROR)
+    SOCKET server = WSAAccept(listener, NULL, 0, NULL, NULL);
+    closesocket(listener);
+    if (server == INVALID_SOCKET) {
+        closesocket(client);
         return process_socket_error(SOCKET_ERROR);
+    }
 
     socket_vector[0] = server;
     socket_vector[1] = client;
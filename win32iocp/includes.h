@@ -32,14 +32,21 @@
 #include <conio.h>
 #include <stdio.h>
 #include <tchar.h>
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 #include <memory>
 #include <thread>
 #define _WINSOCKAPI_
+#define NOMINMAX
 #include <windows.h>
 #include <winsock2.h>
 
+// Completion port counters and latency histograms. Define as 0 to compile them out entirely.
+#ifndef ENABLE_STATISTICS
+#define ENABLE_STATISTICS 1
+#endif
+
 #define ASSERT assert
 #define ASSERT_NOT_REACHED() ASSERT(0)
 #define CRASH() { *((int*)0xdeadbeef) = 0; }
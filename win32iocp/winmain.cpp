@@ -33,26 +33,65 @@ static int process_error(int code)
     return code;
 }
 
+class SocketClient : public NonblockIoHandle::Client {
+public:
+    SocketClient()
+        : closed(CreateEvent(NULL, TRUE, FALSE, NULL))
+    {
+    }
+    ~SocketClient()
+    {
+        CloseHandle(closed);
+    }
+
+    void handleDidClose(NonblockIoHandle*)
+    {
+        SetEvent(closed);
+    }
+    void handleDidRead(NonblockIoHandle*, size_t numberOfBytesTransferred)
+    {
+    }
+    void handleDidWrite(NonblockIoHandle*, size_t numberOfBytesTransferred)
+    {
+    }
+
+    HANDLE closed;
+};
+
+class CompletionEvent : public NonblockIoHandle::CompletionHandler {
+public:
+    CompletionEvent()
+        : m_event(CreateEvent(NULL, TRUE, FALSE, NULL))
+        , m_bytesTransferred(0)
+    {
+    }
+    ~CompletionEvent()
+    {
+        CloseHandle(m_event);
+    }
+
+    size_t wait(std::pair<NonblockIoHandle::ErrorCode, size_t> result)
+    {
+        if (result.first > NonblockIoHandle::Pending)
+            return 0;
+
+        WaitForSingleObject(m_event, INFINITE);
+        return m_bytesTransferred;
+    }
+
+    void handleCompletion(NonblockIoHandle*, NonblockIoHandle::ErrorCode, size_t bytesTransferred) override
+    {
+        m_bytesTransferred = bytesTransferred;
+        SetEvent(m_event);
+    }
+
+private:
+    HANDLE m_event;
+    size_t m_bytesTransferred;
+};
+
 int client_thread_main(SOCKET s)
 {
-    class SocketClient : public NonblockIoHandle::Client {
-    public:
-        void handleDidClose(NonblockIoHandle*)
-        {
-            closed = true;
-        }
-        void handleDidRead(NonblockIoHandle*, size_t numberOfBytesTransferred)
-        {
-        }
-        void handleDidWrite(NonblockIoHandle*, size_t numberOfBytesTransferred)
-        {
-            processing = false;
-        }
-
-        bool processing = false;
-        bool closed = false;
-    };
-
     SocketClient client;
 
     std::shared_ptr<CompletionPort> iocp = CompletionPort::create();
@@ -60,16 +99,12 @@ int client_thread_main(SOCKET s)
 
     static const char message[] = "Hello, World!";
 
-    Sleep(500);
-
-    if (file->write(message, sizeof(message)).first <= NonblockIoHandle::Pending)
-        client.processing = true;
-
-    while (client.processing) { }
+    CompletionEvent didWrite;
+    didWrite.wait(file->write(message, sizeof(message), &didWrite));
 
     file->close();
 
-    while (!client.closed) { }
+    WaitForSingleObject(client.closed, INFINITE);
 
     return process_error(0);
 }
@@ -86,24 +121,6 @@ int _tmain(int argc, _TCHAR* argv[])
 
     std::thread client_thread(&client_thread_main, sv[1]);
 
-    class SocketClient : public NonblockIoHandle::Client {
-    public:
-        void handleDidClose(NonblockIoHandle*)
-        {
-            closed = true;
-        }
-        void handleDidRead(NonblockIoHandle*, size_t numberOfBytesTransferred)
-        {
-            processing = false;
-        }
-        void handleDidWrite(NonblockIoHandle*, size_t numberOfBytesTransferred)
-        {
-        }
-
-        bool processing = false;
-        bool closed = false;
-    };
-
     SocketClient client;
 
     std::shared_ptr<CompletionPort> iocp = CompletionPort::create();
@@ -111,16 +128,14 @@ int _tmain(int argc, _TCHAR* argv[])
 
     static char message[256];
 
-    if (file->read(message, 256).first <= NonblockIoHandle::Pending)
-        client.processing = true;
-
-    while (client.processing) { }
+    CompletionEvent didRead;
+    didRead.wait(file->read(message, 256, &didRead));
 
     std::cout << message << std::endl;
 
     file->close();
 
-    while (!client.closed) { }
+    WaitForSingleObject(client.closed, INFINITE);
     client_thread.join();
 
     WSACleanup();